@@ -113,14 +113,18 @@ paddr_t ram_getfirstfree(void);
 /*
  * TLB shootdown bits.
  *
- * We'll take up to 16 invalidations before just flushing the whole TLB.
+ * A shootdown names a range of pages in one address space; a null
+ * address space means the whole TLB. Requests queued for the same
+ * cpu are merged where they can be, and if more than 16 distinct
+ * ones pile up the target just flushes its whole TLB.
  */
 
+struct addrspace;
+
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	struct addrspace *ts_as;	/* address space to invalidate in */
+	vaddr_t ts_start;		/* first page to invalidate */
+	vaddr_t ts_end;			/* end of range (exclusive) */
 };
 
 #define TLBSHOOTDOWN_MAX 16
@@ -29,6 +29,7 @@
 
 #include <types.h>
 #include <signal.h>
+#include <kern/wait.h>
 #include <lib.h>
 #include <mips/specialreg.h>
 #include <mips/trapframe.h>
@@ -36,6 +37,7 @@
 #include <spl.h>
 #include <thread.h>
 #include <current.h>
+#include <proc.h>
 #include <vm.h>
 #include <mainbus.h>
 #include <syscall.h>
@@ -108,13 +110,12 @@ kill_curthread(vaddr_t epc, unsigned code, vaddr_t vaddr)
 		break;
 	}
 
-	/*
-	 * You will probably want to change this.
-	 */
-
-	kprintf("Fatal user mode trap %u sig %d (%s, epc 0x%x, vaddr 0x%x)\n",
-		code, sig, trapcodenames[code], epc, vaddr);
-	panic("I don't know how to handle this\n");
+	if (!curproc->p_killed) {
+		kprintf("Fatal user mode trap %u sig %d (%s, epc 0x%x, "
+			"vaddr 0x%x)\n",
+			code, sig, trapcodenames[code], epc, vaddr);
+	}
+	proc_exit(_MKWAIT_SIG(sig));
 }
 
 /*
@@ -222,7 +223,7 @@ mips_trap(struct trapframe *tf)
 		      tf->tf_v0, tf->tf_a0, tf->tf_a1, tf->tf_a2, tf->tf_a3);
 
 		syscall(tf);
-		goto done;
+		goto user_done;
 	}
 
 	/*
@@ -233,17 +234,17 @@ mips_trap(struct trapframe *tf)
 	switch (code) {
 	case EX_MOD:
 		if (vm_fault(VM_FAULT_READONLY, tf->tf_vaddr)==0) {
-			goto done;
+			goto user_done;
 		}
 		break;
 	case EX_TLBL:
 		if (vm_fault(VM_FAULT_READ, tf->tf_vaddr)==0) {
-			goto done;
+			goto user_done;
 		}
 		break;
 	case EX_TLBS:
 		if (vm_fault(VM_FAULT_WRITE, tf->tf_vaddr)==0) {
-			goto done;
+			goto user_done;
 		}
 		break;
 	case EX_IBE:
@@ -314,6 +315,15 @@ mips_trap(struct trapframe *tf)
 
 	panic("I can't handle this... I think I'll just die now...\n");
 
+ user_done:
+	/*
+	 * A process killed (for memory) while it was in here exits now,
+	 * rather than going back to user mode.
+	 */
+	if (!iskern && curproc->p_killed) {
+		proc_exit(_MKWAIT_SIG(SIGKILL));
+	}
+
  done:
 	/*
 	 * Turn interrupts off on the processor, without affecting the
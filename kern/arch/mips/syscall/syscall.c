@@ -30,6 +30,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/syscall.h>
+#include <kern/wait.h>
 #include <kern/stat.h>
 #include <lib.h>
 #include <mips/trapframe.h>
@@ -46,6 +47,7 @@
 #include <kern/fcntl.h>
 #include <vnode.h>
 #include <copyinout.h>
+#include "opt-dumbvm.h"
 #define MAX_PATH 512
 
 /*
@@ -95,6 +97,9 @@ syscall(struct trapframe *tf)
         off_t np;
         off_t os;
         int whence;
+#if !OPT_DUMBVM
+	int mmapfd;
+#endif
 	KASSERT(curthread != NULL);
 	KASSERT(curthread->t_curspl == 0);
 	KASSERT(curthread->t_iplhigh_count == 0);
@@ -166,9 +171,45 @@ syscall(struct trapframe *tf)
 			break;
 
             case SYS__exit:
-                        err = 0;
-                        thread_exit();
+                        proc_exit(_MKWAIT_EXIT(tf->tf_a0));
                         break;
+
+#if !OPT_DUMBVM
+            case SYS_sbrk:
+                        err = sys_sbrk((intptr_t)tf->tf_a0,
+                                       (vaddr_t *)&retval);
+                        break;
+
+            case SYS_mmap:
+                        /*
+                         * fd is at sp+16; the 64-bit offset is
+                         * aligned to sp+24.
+                         */
+                        err = copyin((const_userptr_t)(tf->tf_sp+16),
+                                     &mmapfd, sizeof(mmapfd));
+                        if (err == 0) {
+                                err = copyin((const_userptr_t)(tf->tf_sp+24),
+                                             &os, sizeof(os));
+                        }
+                        if (err == 0) {
+                                err = sys_mmap((userptr_t)tf->tf_a0,
+                                               (size_t)tf->tf_a1,
+                                               tf->tf_a2, tf->tf_a3,
+                                               mmapfd, os,
+                                               (vaddr_t *)&retval);
+                        }
+                        break;
+
+            case SYS_munmap:
+                        err = sys_munmap((userptr_t)tf->tf_a0,
+                                         (size_t)tf->tf_a1);
+                        break;
+
+            case SYS_msync:
+                        err = sys_msync((userptr_t)tf->tf_a0,
+                                        (size_t)tf->tf_a1, tf->tf_a2);
+                        break;
+#endif
             default:
 			kprintf("Unknown syscall %d\n", callno);
 			err = ENOSYS;
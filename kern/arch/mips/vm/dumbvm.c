@@ -38,6 +38,7 @@
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <coremap.h>
 
 /*
  * Dumb MIPS-only "VM system" that is intended to only be just barely
@@ -59,15 +60,10 @@
 /* (this must be > 64K so argument blocks of size ARG_MAX will fit) */
 #define DUMBVM_STACKPAGES    18
 
-/*
- * Wrap ram_stealmem in a spinlock.
- */
-static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
-
 void
 vm_bootstrap(void)
 {
-	/* Do nothing. */
+	coremap_bootstrap();
 }
 
 /*
@@ -94,14 +90,7 @@ static
 paddr_t
 getppages(unsigned long npages)
 {
-	paddr_t addr;
-
-	spinlock_acquire(&stealmem_lock);
-
-	addr = ram_stealmem(npages);
-
-	spinlock_release(&stealmem_lock);
-	return addr;
+	return coremap_alloc(npages);
 }
 
 /* Allocate/free some kernel-space virtual pages */
@@ -118,20 +107,60 @@ alloc_kpages(unsigned npages)
 	return PADDR_TO_KVADDR(pa);
 }
 
+vaddr_t
+alloc_kzpage(void)
+{
+	paddr_t pa;
+
+	dumbvm_can_sleep();
+	pa = coremap_alloc_zeroed();
+	if (pa == 0) {
+		return 0;
+	}
+	return PADDR_TO_KVADDR(pa);
+}
+
+bool
+vm_idle(void)
+{
+	return coremap_zerofill();
+}
+
 void
 free_kpages(vaddr_t addr)
 {
-	/* nothing - leak the memory. */
+	KASSERT(addr >= MIPS_KSEG0 && addr < MIPS_KSEG1);
+	coremap_free(addr - MIPS_KSEG0);
+}
 
-	(void)addr;
+void
+vm_printstats(void)
+{
+	coremap_printstats();
 }
 
-unsigned
-int
-coremap_used_bytes() {
+void
+vm_printfaulthist(void)
+{
+	/* dumbvm doesn't time its faults. */
+}
 
-	/* dumbvm doesn't track page allocations. Return 0 so that khu works. */
+void
+vm_setfaulthist(bool on)
+{
+	(void)on;
+}
+
+int
+vm_setfaultaround(unsigned npages)
+{
+	/* dumbvm always loads just the one entry. */
+	return npages == 0 ? 0 : EINVAL;
+}
 
+unsigned
+vm_getfaultaround(void)
+{
 	return 0;
 }
 
@@ -142,6 +171,29 @@ vm_tlbshootdown(const struct tlbshootdown *ts)
 	panic("dumbvm tried to do tlb shootdown?!\n");
 }
 
+void
+vm_tlbshootdown_all(void)
+{
+	panic("dumbvm tried to do tlb shootdown?!\n");
+}
+
+bool
+vm_tlbshootdown_coalesce(struct tlbshootdown *pending,
+			 const struct tlbshootdown *ts)
+{
+	(void)pending;
+	(void)ts;
+	return false;
+}
+
+bool
+vm_tlbshootdown_needed(const struct cpu *c, const struct tlbshootdown *ts)
+{
+	(void)c;
+	(void)ts;
+	return true;
+}
+
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
@@ -266,6 +318,16 @@ void
 as_destroy(struct addrspace *as)
 {
 	dumbvm_can_sleep();
+
+	if (as->as_pbase1 != 0) {
+		coremap_free(as->as_pbase1);
+	}
+	if (as->as_pbase2 != 0) {
+		coremap_free(as->as_pbase2);
+	}
+	if (as->as_stackpbase != 0) {
+		coremap_free(as->as_stackpbase);
+	}
 	kfree(as);
 }
 
@@ -845,13 +845,18 @@ emufs_namefile(struct vnode *v, struct uio *uio)
 
 /*
  * VOP_MMAP
+ *
+ * Files on the emulator can be mapped like any other; the pages are
+ * read and written with emufs_read and emufs_write.
  */
 static
 int
-emufs_mmap(struct vnode *v)
+emufs_mmap(struct vnode *v, int prot, int flags)
 {
 	(void)v;
-	return ENOSYS;
+	(void)prot;
+	(void)flags;
+	return 0;
 }
 
 //////////////////////////////
@@ -1121,7 +1126,7 @@ static const struct vnode_ops emufs_dirops = {
 	.vop_gettype = emufs_dir_gettype,
 	.vop_isseekable = emufs_isseekable,
 	.vop_fsync = emufs_void_op_isdir,
-	.vop_mmap = emufs_void_op_isdir,
+	.vop_mmap = vopfail_mmap_isdir,
 	.vop_truncate = emufs_truncate_isdir,
 	.vop_namefile = emufs_namefile,
 
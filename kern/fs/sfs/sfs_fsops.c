@@ -41,6 +41,7 @@
 #include <uio.h>
 #include <vfs.h>
 #include <device.h>
+#include <kmem.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -263,6 +264,7 @@ sfs_fs_destroy(struct sfs_fs *sfs)
 		bitmap_destroy(sfs->sfs_freemap);
 	}
 	vnodearray_destroy(sfs->sfs_vnodes);
+	kmem_cache_destroy(sfs->sfs_vnodecache);
 	KASSERT(sfs->sfs_device == NULL);
 	kfree(sfs);
 }
@@ -356,12 +358,25 @@ sfs_fs_create(void)
 		goto cleanup_object;
 	}
 
+	/*
+	 * Storage for the vnodes. A struct sfs_vnode holds a whole
+	 * on-disk inode, which kmalloc would round up to 1k.
+	 */
+	sfs->sfs_vnodecache = kmem_cache_create("sfs_vnode",
+						sizeof(struct sfs_vnode),
+						NULL);
+	if (sfs->sfs_vnodecache == NULL) {
+		goto cleanup_vnodes;
+	}
+
 	/* freemap */
 	sfs->sfs_freemap = NULL;
 	sfs->sfs_freemapdirty = false;
 
 	return sfs;
 
+cleanup_vnodes:
+	vnodearray_destroy(sfs->sfs_vnodes);
 cleanup_object:
 	kfree(sfs);
 fail:
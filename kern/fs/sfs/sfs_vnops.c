@@ -232,14 +232,18 @@ sfs_fsync(struct vnode *v)
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(). Any regular file can be mapped; the VM system
+ * pages it in and out through sfs_read and sfs_write, so there's
+ * nothing to set up here.
  */
 static
 int
-sfs_mmap(struct vnode *v   /* add stuff as needed */)
+sfs_mmap(struct vnode *v, int prot, int flags)
 {
 	(void)v;
-	return ENOSYS;
+	(void)prot;
+	(void)flags;
+	return 0;
 }
 
 /*
@@ -35,17 +35,94 @@
  */
 
 
+#include <array.h>
+#include <spinlock.h>
 #include <vm.h>
+#include <platform/maxcpus.h>
 #include "opt-dumbvm.h"
 
 struct vnode;
+struct pagetable;
 
 
+#if !OPT_DUMBVM
+/*
+ * A region of the address space: a page-aligned range of virtual
+ * addresses that the program is allowed to touch, with the
+ * permissions given to as_define_region. Pages in a region are not
+ * backed by memory until they're first touched; see vm_fault, which
+ * also enforces the permissions. (MIPS can't tell instruction fetches
+ * from loads, so VR_EXEC implies reading.)
+ *
+ * A region may also be backed by part of a file, set up with
+ * as_define_file: the VR_FILESIZE bytes at VR_FILEADDR come from
+ * VR_VNODE starting at VR_FILEOFF, and are read in on first touch.
+ * The rest of the region is zero-filled. The region holds a
+ * reference to the vnode.
+ *
+ * VR_FLAGS say how the pages are backed. VRF_CACHED regions take
+ * their file pages from the vnode's file cache (see filecache.h), so
+ * they're shared with everyone else mapping the same file; unless
+ * VRF_SHARED is also set, a write gets a private copy. VRF_SHARED
+ * regions (MAP_SHARED) write to the cached pages themselves, which
+ * are written back to the file at msync and when unmapped. VRF_MMAP
+ * regions were made by mmap and may be removed with munmap.
+ *
+ * Pages of VRF_SHARED regions have no single owner, so the clock
+ * never evicts them. For file mappings that's what keeps a dirty page
+ * from being dropped before it's written back; but it also means an
+ * anonymous MAP_SHARED region stays entirely in RAM (there is no swap
+ * for it) until it's unmapped.
+ */
+struct vm_region {
+	vaddr_t vr_base;		/* first address (page-aligned) */
+	size_t vr_npages;		/* length in pages */
+	int vr_perm;			/* VR_READ | VR_WRITE | VR_EXEC */
+	int vr_flags;			/* VRF_* */
+	struct vnode *vr_vnode;		/* backing file, or NULL */
+	vaddr_t vr_fileaddr;		/* where the file data starts */
+	off_t vr_fileoff;		/* file offset of vr_fileaddr */
+	size_t vr_filesize;		/* bytes of file data */
+};
+
+/*
+ * An address space keeps its regions in an array sorted by base
+ * address, so a lookup is a binary search; regions are added rarely
+ * and looked up on every fault.
+ */
+#ifndef ASINLINE
+#define ASINLINE INLINE
+#endif
+
+DECLARRAY(vm_region, ASINLINE);
+DEFARRAY(vm_region, ASINLINE);
+
+#define VR_READ		4
+#define VR_WRITE	2
+#define VR_EXEC		1
+
+#define VRF_CACHED	0x1
+#define VRF_SHARED	0x2
+#define VRF_MMAP	0x4
+
+/*
+ * The stack starts as one page at the top of user space and grows
+ * down on faults, up to VM_STACKMAXPAGES (which must be > 64K for
+ * ARG_MAX). An unmapped guard page is always left between it and the
+ * next region down. VM_STACKLIMIT is as far down as it can go; the
+ * heap stops short of it and mmap stays below VM_MMAPTOP, further
+ * down still.
+ */
+#define VM_STACKMAXPAGES	1024
+#define VM_STACKLIMIT	(USERSTACK - VM_STACKMAXPAGES * PAGE_SIZE)
+
+/* mmap places mappings below here, working down */
+#define VM_MMAPTOP	(USERSTACK - 0x01000000)
+#endif
+
 /*
  * Address space - data structure associated with the virtual memory
  * space of a process.
- *
- * You write this.
  */
 
 struct addrspace {
@@ -58,7 +135,16 @@ struct addrspace {
         size_t as_npages2;
         paddr_t as_stackpbase;
 #else
-        /* Put stuff here for your VM system */
+        struct vm_regionarray as_regions; /* regions, sorted by base */
+        struct vm_region *as_lastregion; /* last as_findregion hit */
+        struct vm_region *as_heap;	/* heap region, or NULL */
+        struct vm_region *as_stack;	/* stack region, or NULL */
+        vaddr_t as_break;		/* current end of heap (sbrk) */
+        struct pagetable *as_pt;	/* page table */
+        uint32_t as_asid[MAXCPUS];	/* per-cpu ASID tag, see vm.c */
+        unsigned as_swapouts;		/* pages evicted, under vm_evictlock */
+        unsigned as_resident;		/* resident pages, under as_reslock */
+        struct spinlock as_reslock;
 #endif
 };
 
@@ -99,6 +185,52 @@ struct addrspace {
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_findregion - return the region containing VADDR, or NULL.
+ *                Takes O(log n) in the number of regions, and checks
+ *                the last region found first, since consecutive
+ *                faults tend to be in the same region. Only for use
+ *                by the address space's own thread. (Not available
+ *                with dumbvm.)
+ *
+ *    as_growstack - called for a fault at VADDR outside every region.
+ *                If it's within VM_STACKLIMIT and below the stack,
+ *                and the guard page below it would still be free,
+ *                extends the stack down to it and returns the stack
+ *                region. Otherwise returns NULL. (Not available with
+ *                dumbvm.)
+ *
+ *    as_setbreak - move the end of the heap to NEWBREAK. Growing only
+ *                extends the heap region; shrinking frees the pages
+ *                past the new end right away. (Not available with
+ *                dumbvm.)
+ *
+ *    as_mmap   - make a new region of LEN bytes with permissions PERM
+ *                (VR_*) and flags VRF_FLAGS, backed by V from OFFSET
+ *                or zero-filled if V is NULL. If FIXED, *ADDR is
+ *                where it goes; otherwise a free spot is picked and
+ *                returned in *ADDR. (Not available with dumbvm.)
+ *
+ *    as_munmap - remove the mmap regions in [ADDR, ADDR+LEN), writing
+ *                back shared pages first. Regions can only be removed
+ *                whole. If writing back fails, nothing is removed and
+ *                the error is returned; the pages that were written
+ *                are clean and the rest stay dirty. (Not available
+ *                with dumbvm.)
+ *
+ *    as_msync  - write back the dirty shared pages in [ADDR, ADDR+LEN),
+ *                which must be mapped throughout (ENOMEM if not),
+ *                leaving them mapped. (Not available with dumbvm.)
+ *
+ *    as_define_file - back FILESIZE bytes at VADDR, which must lie in
+ *                one region, with vnode V from file offset OFFSET.
+ *                The pages are read in when first touched. (Not
+ *                available with dumbvm.)
+ *
+ *    as_addresident - add DELTA to AS's count of resident pages. Called
+ *                wherever a PTE starts or stops mapping a frame, so
+ *                the count can be read without walking the page
+ *                table. Doesn't sleep. (Not available with dumbvm.)
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
@@ -118,6 +250,37 @@ int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 
+#if !OPT_DUMBVM
+struct vm_region *as_findregion(struct addrspace *as, vaddr_t vaddr);
+struct vm_region *as_growstack(struct addrspace *as, vaddr_t vaddr);
+int               as_define_file(struct addrspace *as, vaddr_t vaddr,
+                                 size_t filesize,
+                                 struct vnode *v, off_t offset);
+int               as_setbreak(struct addrspace *as, vaddr_t newbreak);
+int               as_mmap(struct addrspace *as, vaddr_t *addr, size_t len,
+                          int perm, int vrf_flags, bool fixed,
+                          struct vnode *v, off_t offset);
+int               as_munmap(struct addrspace *as, vaddr_t addr, size_t len);
+int               as_msync(struct addrspace *as, vaddr_t addr, size_t len);
+void              as_addresident(struct addrspace *as, int delta);
+
+/*
+ * TLB management for address spaces, in vm.c.
+ *    vm_tlbactivate  - load AS's ASID for this cpu into the MMU,
+ *                      assigning a fresh one if needed. Called by
+ *                      as_activate.
+ *    vm_tlbinvalidate - make sure no TLB entry for AS made before the
+ *                      call can match again, by forgetting its ASIDs.
+ *                      Call after changing or removing mappings.
+ *    vm_tlbunmap     - remove the entries for [START, END) in AS from
+ *                      every cpu's TLB, even where AS is running, and
+ *                      wait for them to be gone. May sleep.
+ */
+void vm_tlbactivate(struct addrspace *as);
+void vm_tlbinvalidate(struct addrspace *as);
+void vm_tlbunmap(struct addrspace *as, vaddr_t start, vaddr_t end);
+#endif
+
 
 /*
  * Functions in loadelf.c
@@ -0,0 +1,268 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _COREMAP_H_
+#define _COREMAP_H_
+
+/*
+ * Physical page allocator ("coremap").
+ *
+ * There is one struct coremap_entry for every physical page of RAM,
+ * indexed by physical page number. Free pages are kept on a doubly
+ * linked list threaded through the entries by page number, so that
+ * single-page allocations and frees are O(1) and a page in the middle
+ * of the list can be unlinked in O(1) when it becomes part of a
+ * contiguous multi-page allocation.
+ *
+ * Allocations carry a reference count (kept in the entry for their
+ * first page) so that user frames can be shared copy-on-write. Most
+ * allocations just have the one reference made by coremap_alloc.
+ *
+ * User pages (CM_USER) also record which address space and virtual
+ * address map them, so the clock hand can pick them for eviction.
+ * A user page shared by more than one address space has no single
+ * owner (cme_as is NULL) and is never evicted. Anyone who changes a
+ * PTE that maps a resident page, or who needs the page to stay put,
+ * must first pin it with coremap_pin.
+ *
+ * Idle cpus zero free pages ahead of time into a small pool (pages in
+ * state CM_ZEROED), so that callers who want a zeroed page can get
+ * one without paying for the bzero. The pool is given back to the
+ * free list whenever memory runs short.
+ *
+ * Pages below the first free page handed to us by ram_getfirstfree()
+ * (the kernel image, the coremap itself, and anything stolen with
+ * ram_stealmem before the VM system came up) are marked CM_FIXED
+ * and are never freed.
+ */
+
+#include <spinlock.h>
+#include <vm.h>
+#include <pagetable.h>
+
+struct addrspace;
+
+/* Page states */
+#define CM_FREE		0	/* on the free list */
+#define CM_FIXED	1	/* permanently in use by the kernel */
+#define CM_KERNEL	2	/* allocated with coremap_alloc */
+#define CM_CACHED	3	/* free, in some cpu's pagecache */
+#define CM_USER		4	/* mapped in user address space(s) */
+#define CM_ZEROED	5	/* free and zero-filled, in the zero pool */
+
+/* Flags */
+#define CMF_BUSY	0x01	/* pinned; see coremap_pin */
+#define CMF_REFERENCED	0x02	/* touched since the clock hand passed */
+#define CMF_MERGED	0x04	/* shared by same-page merging */
+#define CMF_DIRTY	0x08	/* shared file page not yet written back */
+#define CMF_NOMERGE	0x10	/* mapped MAP_SHARED; written in place */
+
+/* Null page number for the free list links */
+#define CM_NONE		0xffffffff
+
+struct coremap_entry {
+	uint32_t cme_next;		/* free list links (page numbers) */
+	uint32_t cme_prev;
+	uint16_t cme_npages;		/* pages in allocation (first page) */
+	uint16_t cme_refcount;		/* references (first page) */
+	uint8_t cme_state;		/* CM_* */
+	uint8_t cme_flags;		/* CMF_* */
+	struct addrspace *cme_as;	/* owner of a CM_USER page */
+	vaddr_t cme_va;			/* ...and where it's mapped */
+};
+
+/*
+ * Per-cpu page magazine.
+ *
+ * pc_lock is normally only taken by the owning cpu, so it is not
+ * contended; other cpus take it only to drain the magazine when the
+ * global free list runs dry. Lock ordering: pc_lock before the
+ * coremap lock.
+ */
+#define PAGECACHE_SIZE	16	/* pages per magazine */
+#define PAGECACHE_BATCH	8	/* pages moved per refill or drain */
+
+struct pagecache {
+	struct spinlock pc_lock;
+	unsigned pc_count;			/* pages in pc_pages[] */
+	uint32_t pc_pages[PAGECACHE_SIZE];	/* page numbers */
+
+	/* statistics */
+	unsigned pc_hits;		/* allocs satisfied locally */
+	unsigned pc_misses;		/* allocs that found it empty */
+	unsigned pc_frees;		/* frees absorbed locally */
+	unsigned pc_refills;		/* batches taken from the free list */
+	unsigned pc_drains;		/* batches given back */
+};
+
+/* Zero pool size, in pages */
+#define ZEROPOOL_SIZE	32
+
+/*
+ * Functions:
+ *
+ *    coremap_bootstrap - take over physical memory from ram.c. Must be
+ *                        called exactly once, from vm_bootstrap.
+ *
+ *    coremap_alloc     - allocate NPAGES physically contiguous pages.
+ *                        Returns the physical address of the first
+ *                        page, or 0 if no memory is available. Before
+ *                        coremap_bootstrap this steals memory from
+ *                        ram_stealmem (which can never be freed).
+ *
+ *    coremap_alloc_zeroed - allocate a single zero-filled page, from
+ *                        the zero pool if possible, otherwise by
+ *                        zeroing one. Returns 0 if out of memory.
+ *
+ *    coremap_zerofill  - zero one free page into the zero pool, if it
+ *                        wants one. Returns true if it did any work.
+ *                        Doesn't sleep; meant for the idle loop.
+ *
+ *    coremap_free      - release an allocation made by coremap_alloc.
+ *                        Freeing memory allocated before bootstrap is
+ *                        silently ignored. The allocation must have
+ *                        only one reference.
+ *
+ *    coremap_incref    - add a reference to the single-page allocation
+ *                        at PA. Used to share user frames copy-on-write
+ *                        between address spaces.
+ *
+ *    coremap_decref    - drop a reference to the user page at PA,
+ *                        which the caller has pinned, and unpin it.
+ *                        Frees the page when the last reference goes
+ *                        away.
+ *
+ *    coremap_refcount  - return the number of references to PA. Only
+ *                        a hint unless the caller holds one of them
+ *                        and knows nobody else can add more.
+ *
+ *    coremap_setuser   - record that the user page at PA is mapped
+ *                        only by AS at VA. PA must be freshly
+ *                        allocated or pinned by the caller; it is
+ *                        left pinned.
+ *
+ *    coremap_pin       - if the PTE at PTE maps a resident page, mark
+ *                        the page busy (waiting if someone else has
+ *                        it busy) and return true; the PTE cannot
+ *                        then change under the caller. Otherwise
+ *                        return false. May sleep.
+ *
+ *    coremap_pinpage   - pin the user page at PA, waiting if someone
+ *                        else has it busy. For holders of a reference
+ *                        that isn't a PTE. May sleep.
+ *
+ *    coremap_unpin     - release a page pinned by coremap_pin or
+ *                        coremap_setuser.
+ *
+ *    coremap_trypin    - pin the user page at PA unless it's already
+ *                        busy (or not a user page), without sleeping.
+ *                        Returns its owner and reference count.
+ *
+ *    coremap_userrefs  - return PA's reference count if it's a user
+ *                        page, or 0.
+ *
+ *    coremap_markmerged - flag the pinned page PA as holding merged
+ *                        contents.
+ *
+ *    coremap_mergestats - count merged pages and the frames they save.
+ *
+ *    coremap_marknomerge - flag the pinned page PA as mapped MAP_SHARED,
+ *                        so it's written in place and must never have
+ *                        unrelated mappings merged into it.
+ *
+ *    coremap_canmerge  - return true if other pages with the same
+ *                        contents may be merged into the pinned page
+ *                        PA: it's either private with a known owner or
+ *                        already a merged page, and it isn't marked
+ *                        CMF_NOMERGE or CMF_DIRTY. File cache pages
+ *                        (shared, no owner, not merged) never qualify.
+ *
+ *    coremap_setdirty  - set or clear the dirty flag of the pinned page
+ *                        PA. Used for MAP_SHARED file pages, which
+ *                        must be written back before they're dropped.
+ *
+ *    coremap_isdirty   - return the dirty flag of the pinned page PA.
+ *
+ *    coremap_totalpages - return the number of physical pages.
+ *
+ *    coremap_pickvictim - run the clock hand to choose a user page to
+ *                        evict. Returns its address, pinned, with its
+ *                        owner in AS and VA; or 0 if there's nothing
+ *                        evictable.
+ *
+ *    coremap_drain     - return the pages in every cpu's magazine, and
+ *                        the zero pool, to the free list. Returns how
+ *                        many there were.
+ *
+ *    coremap_nfree     - return the number of pages on the free list.
+ *
+ *    coremap_clockscans - return the number of pages the clock hand
+ *                        has examined so far.
+ *
+ *    coremap_printstats - print page counts and pagecache statistics.
+ *
+ *    pagecache_init    - initialize a cpu's magazine; called from
+ *                        cpu_create.
+ *
+ * coremap_used_bytes() (declared in vm.h) is also implemented here.
+ */
+
+void coremap_bootstrap(void);
+paddr_t coremap_alloc(unsigned npages);
+paddr_t coremap_alloc_zeroed(void);
+bool coremap_zerofill(void);
+void coremap_free(paddr_t pa);
+void coremap_incref(paddr_t pa);
+void coremap_decref(paddr_t pa);
+unsigned coremap_refcount(paddr_t pa);
+void coremap_setuser(paddr_t pa, struct addrspace *as, vaddr_t va);
+bool coremap_pin(const pte_t *pte);
+void coremap_pinpage(paddr_t pa);
+void coremap_unpin(paddr_t pa);
+bool coremap_trypin(paddr_t pa, struct addrspace **as, vaddr_t *va,
+		    unsigned *refcount);
+unsigned coremap_userrefs(paddr_t pa);
+void coremap_markmerged(paddr_t pa);
+void coremap_mergestats(unsigned *frames, unsigned *saved);
+void coremap_marknomerge(paddr_t pa);
+bool coremap_canmerge(paddr_t pa);
+void coremap_setdirty(paddr_t pa, bool dirty);
+bool coremap_isdirty(paddr_t pa);
+unsigned coremap_totalpages(void);
+paddr_t coremap_pickvictim(struct addrspace **as, vaddr_t *va);
+unsigned coremap_drain(void);
+unsigned coremap_nfree(void);
+unsigned coremap_clockscans(void);
+void coremap_printstats(void);
+
+void pagecache_init(struct pagecache *pc);
+
+
+#endif /* _COREMAP_H_ */
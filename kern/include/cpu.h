@@ -34,6 +34,7 @@
 #include <spinlock.h>
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
+#include <coremap.h>     /* for struct pagecache */
 
 extern unsigned num_cpus;
 
@@ -62,6 +63,9 @@ struct cpu {
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	unsigned c_asid_next;		/* Next TLB ASID to hand out */
+	unsigned c_asid_gen;		/* Current ASID generation */
+	unsigned c_asid_cur;		/* ASID loaded in EntryHi */
 
 	/*
 	 * Accessed by other cpus.
@@ -83,12 +87,37 @@ struct cpu {
 	 * The contents of struct tlbshootdown are also machine-
 	 * dependent and might reasonably be either an address space
 	 * and vaddr pair, or a paddr, or something else.
+	 *
+	 * New requests are merged into queued ones when the VM system
+	 * says they can be. If the queue fills anyway, it is dropped
+	 * and c_shootdown_flushall is set instead. Each request gets a
+	 * ticket from c_shootdown_seq; c_shootdown_done is the last
+	 * ticket handled, and senders wait on c_shootdown_wchan for it
+	 * to catch up. Those two are under c_shootdown_lock instead,
+	 * because waking the senders takes runqueue locks, which must
+	 * not be taken inside the IPI lock.
 	 */
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	unsigned c_numshootdown;
+	bool c_shootdown_flushall;	/* Queue overflowed */
+	unsigned c_shootdown_seq;	/* Last ticket issued */
+	unsigned c_shootdown_done;	/* Last ticket completed */
+	struct wchan *c_shootdown_wchan;
+	struct spinlock c_shootdown_lock;
 	struct spinlock c_ipi_lock;
 
+	/*
+	 * Magazine of free physical pages in front of the coremap.
+	 * Has its own lock; see coremap.h.
+	 */
+	struct pagecache c_pagecache;
+
+	/*
+	 * Magazines of free kmalloc blocks; see kmalloc.c.
+	 */
+	struct kmcache *c_kmcache;
+
 	/*
 	 * Accessed by other cpus. Protected inside hangman.c.
 	 */
@@ -156,6 +185,10 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * It returns a ticket that ipi_tlbshootdown_wait can wait on.
+ * ipi_tlbshootdown_allcpus is the corresponding broadcast; it skips
+ * CPUs that can't have the mapping, waits for the rest to finish,
+ * and returns the number of CPUs the request was sent to. May sleep.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -169,7 +202,10 @@ void cpu_halt(void);
 
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
-void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown(struct cpu *target,
+			  const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_wait(struct cpu *target, unsigned ticket);
+unsigned ipi_tlbshootdown_allcpus(const struct tlbshootdown *mapping);
 
 void interprocessor_interrupt(void);
 
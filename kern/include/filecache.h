@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _FILECACHE_H_
+#define _FILECACHE_H_
+
+/*
+ * Shared file pages.
+ *
+ * Pages of read-only file-backed regions (program text, mostly) are
+ * kept in a cache hanging off the vnode, so that every process
+ * running the same executable maps the same physical frames. The
+ * cache holds one coremap reference on each of its frames, and each
+ * PTE mapping one holds another, so the frames are always shared and
+ * always mapped read-only.
+ *
+ * A page is identified by the file offset of its first file byte and
+ * where in the page the file data lies, since the first and last
+ * pages of a segment may be partly zero-filled.
+ *
+ * The cache for a vnode is thrown away when the vnode's last
+ * reference goes away (see vnode_decref). Address spaces hold a
+ * reference to the vnodes they map, so by then the only frames still
+ * in use are ones that got shared some other way. Frames nobody maps
+ * any more are also given back under memory pressure.
+ *
+ * Functions:
+ *
+ *    filecache_bootstrap  - register the reclaim source. Called from
+ *                           vm_bootstrap.
+ *
+ *    filecache_lookup     - return the frame for the page of V with
+ *                           LEN bytes from file offset OFFSET at byte
+ *                           SKIP of the page, with a reference added
+ *                           for the caller, or 0 if not cached.
+ *
+ *    filecache_insert     - add PA, a pinned page with that content
+ *                           and one reference (the caller's), to the
+ *                           cache. If someone else got there first,
+ *                           returns their frame with a reference for
+ *                           the caller instead, and the caller should
+ *                           drop PA; otherwise returns PA. If there's
+ *                           no memory to cache it, PA just isn't.
+ *
+ *    filecache_release    - drop V's cache. Called on the vnode's
+ *                           last VOP_DECREF.
+ *
+ *    filecache_printstats - print hit rates and memory saved.
+ */
+
+struct vnode;
+
+void filecache_bootstrap(void);
+paddr_t filecache_lookup(struct vnode *v, off_t offset,
+			 unsigned skip, unsigned len);
+paddr_t filecache_insert(struct vnode *v, off_t offset,
+			 unsigned skip, unsigned len, paddr_t pa);
+void filecache_release(struct vnode *v);
+void filecache_printstats(void);
+
+
+#endif /* _FILECACHE_H_ */
@@ -64,7 +64,7 @@
 //#define SYS_mlock      13
 //#define SYS_munlock    14
 //#define SYS_munlockall 15
-//#define SYS_minherit   16
+#define SYS_msync        16
 //                              (security/credentials)
 #define SYS_umask        17
 #define SYS_issetugid    18
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _KMEM_H_
+#define _KMEM_H_
+
+/*
+ * Object caches ("slab allocator").
+ *
+ * A kmem_cache hands out objects of one type. It carves whole pages
+ * ("slabs") into slots of exactly the object's size, rounded up only
+ * for alignment, instead of to the next kmalloc size class. Each slab
+ * keeps its own free list, and a free finds its slab from the page
+ * the object is on, so alloc and free are constant time.
+ *
+ * A cache may have a constructor, which is run on each object once
+ * when its slab is made, not on every allocation. Objects must be
+ * handed back to kmem_cache_free in their constructed state. Then
+ * setup that survives from one use to the next (an empty list, an
+ * unheld spinlock) isn't redone every time.
+ *
+ * Empty slabs are kept, up to a point, for the next allocation, and
+ * are given back when the VM system wants memory (kmem_reclaim).
+ *
+ * Objects must be small enough that a slab holds several of them.
+ *
+ * Functions:
+ *
+ *    kmem_cache_create  - make a cache of objects of SIZE bytes, with
+ *                         constructor CTOR (may be NULL). NAME should
+ *                         be a string constant; it's used by the
+ *                         statistics. Returns NULL if out of memory.
+ *
+ *    kmem_cache_destroy - destroy a cache. Every object must have been
+ *                         freed.
+ *
+ *    kmem_cache_alloc   - allocate an object, or return NULL if out of
+ *                         memory.
+ *
+ *    kmem_cache_free    - free an object from kmem_cache_alloc.
+ *
+ *    kmem_reclaim       - free every empty slab in every cache. Returns
+ *                         the number of pages freed.
+ *
+ *    kmem_printstats    - print per-cache statistics.
+ */
+
+struct kmem_cache;
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     void (*ctor)(void *obj));
+void kmem_cache_destroy(struct kmem_cache *kc);
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+unsigned kmem_reclaim(void);
+void kmem_printstats(void);
+
+
+#endif /* _KMEM_H_ */
@@ -125,7 +125,17 @@ uint32_t random(void);
  *
  * kheap_nextgeneration, dump, and dumpall do nothing unless heap
  * labeling (for leak detection) in kmalloc.c (q.v.) is enabled.
+ *
+ * kheap_cpuinit sets up a new cpu's magazines of free blocks (called
+ * from cpu_create). kheap_drain gives everything in the magazines back
+ * to the heap pages. kheap_lockcount returns how many times kmalloc
+ * and kfree have had to take the global heap lock.
+ *
+ * kheap_printsites prints the MAX call sites with the most live memory,
+ * as estimated by sampling one kmalloc in every N. kheap_setsampling
+ * sets N; 0 turns sampling off.
  */
+struct cpu;
 void *kmalloc(size_t size);
 void kfree(void *ptr);
 void kheap_printstats(void);
@@ -134,6 +144,11 @@ unsigned long kheap_getused(void);
 void kheap_nextgeneration(void);
 void kheap_dump(void);
 void kheap_dumpall(void);
+void kheap_cpuinit(struct cpu *c);
+void kheap_drain(void);
+unsigned kheap_lockcount(void);
+void kheap_printsites(unsigned max);
+void kheap_setsampling(unsigned period);
 
 /*
  * C string functions.
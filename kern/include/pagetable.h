@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+
+/*
+ * Two-level page table for user address spaces.
+ *
+ * The top-level directory has one slot per 4M of user virtual space
+ * (512 of them for the 2G of kuseg); each slot points to a page of
+ * 1024 page table entries covering 4M, or is NULL if nothing in that
+ * 4M has ever been touched. Second-level pages are whole zeroed pages
+ * from alloc_kzpage, freed with free_kpages.
+ *
+ * A PTE holds the physical frame number in its upper bits and flags
+ * in the lower bits, like a MIPS TLBLO word. An entry of 0 means the
+ * page has never been materialized (it will be zero-filled on first
+ * touch). A page that has been paged out has PTE_SWAP set instead of
+ * PTE_VALID, and its swap slot number in the upper bits.
+ *
+ * Frames may be shared copy-on-write between page tables; the coremap
+ * reference count says how many PTEs point at a frame, and a frame is
+ * only mapped writeable when that count is 1.
+ */
+
+#include <vm.h>
+
+typedef uint32_t pte_t;
+
+#define PTE_FRAME	0xfffff000	/* physical frame */
+#define PTE_VALID	0x00000001	/* frame present in memory */
+#define PTE_SWAP	0x00000002	/* page is in swap */
+
+#define PTE_SWAPSHIFT	12
+#define PTE_SWAPSLOT(pte)	((pte) >> PTE_SWAPSHIFT)
+#define PTE_MKSWAP(slot)	(((pte_t)(slot) << PTE_SWAPSHIFT) | PTE_SWAP)
+
+#define PT_L1_SHIFT	22
+#define PT_L2_SHIFT	12
+#define PT_L1_ENTRIES	(USERSPACETOP >> PT_L1_SHIFT)
+#define PT_L2_ENTRIES	(PAGE_SIZE / sizeof(pte_t))
+
+#define PT_L1_INDEX(va)	((va) >> PT_L1_SHIFT)
+#define PT_L2_INDEX(va)	(((va) >> PT_L2_SHIFT) & (PT_L2_ENTRIES - 1))
+
+struct pagetable {
+	pte_t *pt_dir[PT_L1_ENTRIES];
+};
+
+/*
+ * Functions:
+ *
+ *    pt_create  - make an empty page table. Returns NULL if out of
+ *                 memory.
+ *
+ *    pt_destroy - free the page table and drop its reference to every
+ *                 frame and swap slot it maps.
+ *
+ *    pt_lookup  - return a pointer to the PTE for VA. If the
+ *                 second-level page doesn't exist, create it if
+ *                 CREATE is true (returning NULL if out of memory)
+ *                 or return NULL otherwise.
+ *
+ *    pt_unmap   - clear the PTEs for [START, END), dropping their
+ *                 references to frames and swap slots. The caller must
+ *                 shoot down the TLB entries first. Returns the number
+ *                 of resident frames it unmapped.
+ *
+ *    pt_copy    - make NEW, which must be empty, map the same frames
+ *                 and swap slots as OLD, sharing them copy-on-write,
+ *                 and set *RESIDENT to the number of frames mapped.
+ *                 The caller must make sure OLD's writeable TLB
+ *                 entries are flushed.
+ *                 Returns an error code; on failure NEW may be
+ *                 partially filled in and should be destroyed.
+ */
+
+struct pagetable *pt_create(void);
+void pt_destroy(struct pagetable *pt);
+pte_t *pt_lookup(struct pagetable *pt, vaddr_t va, bool create);
+unsigned pt_unmap(struct pagetable *pt, vaddr_t start, vaddr_t end);
+int pt_copy(struct pagetable *old, struct pagetable *new,
+	    unsigned *resident);
+
+
+#endif /* _PAGETABLE_H_ */
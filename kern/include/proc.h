@@ -36,6 +36,7 @@
  * Note: curproc is defined by <current.h>.
  */
 
+#include <kern/time.h>
 #include <spinlock.h>
 
 struct addrspace;
@@ -54,6 +55,19 @@ struct _file{
    int ref ;
 };
 
+/*
+ * Per-process VM counters, kept up to date by vm_fault. Protected by
+ * p_lock. (Pages paged out are counted in the address space instead,
+ * since that's all the pager knows about.)
+ */
+struct proc_vmstats {
+	unsigned pvs_minfaults;		/* faults handled without I/O */
+	unsigned pvs_majfaults;		/* faults that read a file or swap */
+	unsigned pvs_cowbreaks;		/* private copies made on write */
+	unsigned pvs_tlbrefills;	/* faults on pages already mapped */
+	unsigned pvs_swapins;		/* pages brought back from swap */
+};
+
 /*
  * Process structure.
  *
@@ -81,6 +95,9 @@ struct proc {
 
 	/* VM */
 	struct addrspace *p_addrspace;	/* virtual address space */
+	struct proc_vmstats p_vmstats;	/* fault counters */
+	struct timespec p_starttime;	/* when created, for the OOM killer */
+	bool p_killed;			/* killed; exit on the way to user */
 
 	/* VFS */
 	struct vnode *p_cwd;		/* current working directory */
@@ -118,6 +135,28 @@ int proc_addthread(struct proc *proc, struct thread *t);
 /* Detach a thread from its process. */
 void proc_remthread(struct thread *t);
 
+/* Print every process's VM counters (menu command "vmp"). */
+void proc_printvmstats(void);
+
+/*
+ * The exit path: record STATUS (an encoded wait status), release the
+ * address space, drop the process from the list "vmp" and the OOM
+ * killer look at, and exit the current thread. Does not return.
+ */
+__DEAD void proc_exit(int status);
+
+/*
+ * Kill the process SCORE rates highest, ignoring those it gives 0.
+ * SCORE is called with the process's p_lock held and DATA, and must
+ * be cheap and not sleep. The victim gets p_killed set, and calls
+ * proc_exit the next time it heads back to user mode. Returns true
+ * if anything was killed.
+ */
+bool proc_killworst(unsigned (*score)(struct proc *, void *), void *data);
+
+/* Number of killed processes that haven't exited yet. */
+unsigned proc_nkilled(void);
+
 /* Fetch the address space of the current process. */
 struct addrspace *proc_getas(void);
 
@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _RECLAIM_H_
+#define _RECLAIM_H_
+
+/*
+ * Memory reclaim.
+ *
+ * A kernel thread (the "reclaim daemon") keeps the number of free
+ * pages between a low and a high watermark. When an allocation
+ * leaves fewer than the low watermark free, the daemon is woken; it
+ * then calls the registered reclaim sources, cheapest first, until
+ * the high watermark is reached or nothing more can be freed.
+ *
+ * An allocator that finds no free memory at all calls reclaim_wait,
+ * which sleeps until the daemon has made a pass, and tells it whether
+ * retrying is worthwhile. Before the daemon is running, and in the
+ * daemon itself, reclaim_wait runs the sources directly instead.
+ *
+ * A reclaim source is a function that tries to free up to NPAGES
+ * pages and returns how many it freed. It's called from the daemon
+ * (or an allocating thread) and may sleep.
+ */
+
+struct reclaimer {
+	const char *rc_name;
+	unsigned (*rc_reclaim)(unsigned npages);
+
+	/* Filled in by reclaim.c */
+	struct reclaimer *rc_next;
+	unsigned rc_calls;		/* times called */
+	unsigned rc_pages;		/* pages it gave back */
+};
+
+/*
+ * Functions:
+ *
+ *    reclaim_register  - add a source. Sources are tried in the order
+ *                        they are registered. RC must stay around
+ *                        forever.
+ *
+ *    reclaim_bootstrap - set the watermarks and start the daemon.
+ *                        Called from vm_bootstrap.
+ *
+ *    reclaim_check     - wake the daemon if free memory is below the
+ *                        low watermark. Cheap; call after allocating.
+ *
+ *    reclaim_wait      - called when an allocation failed. Returns
+ *                        true if it's worth retrying, false if memory
+ *                        is exhausted.
+ *
+ *    reclaim_printstats - print watermarks and reclaim statistics.
+ */
+
+void reclaim_register(struct reclaimer *rc);
+void reclaim_bootstrap(void);
+void reclaim_check(void);
+bool reclaim_wait(void);
+void reclaim_printstats(void);
+
+
+#endif /* _RECLAIM_H_ */
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space.
+ *
+ * At boot we claim the first disk (lhd0) with vfs_swapon, if there
+ * is one, and divide it into page-sized slots. A bitmap records which
+ * slots are in use. Like frames, slots are reference counted, because
+ * as_copy shares paged-out pages between parent and child just as it
+ * shares resident ones.
+ *
+ * With the zswap option, pages are offered to the compressed pool in
+ * memory (see zswap.h) first, and only go to disk if they don't fit.
+ * Slot numbers with SWAP_ZSLOT set are really zswap handles; callers
+ * don't need to care.
+ *
+ * Functions:
+ *
+ *    swap_bootstrap - find and attach the swap device. Called from
+ *                     vm_bootstrap. Running without swap is fine.
+ *
+ *    swap_store     - save the page at physical address PA in a new
+ *                     slot with one reference. Returns ENOSPC if
+ *                     there's no room anywhere, or an I/O error.
+ *
+ *    swap_hasroom   - false if swap_store is sure to fail. Only a
+ *                     hint.
+ *
+ *    swap_incref    - add a reference to SLOT.
+ *
+ *    swap_decref    - drop a reference to SLOT, freeing it when the
+ *                     last one goes away.
+ *
+ *    swap_pagein    - read SLOT into the page at physical address PA.
+ *
+ *    swap_printstats - print slot usage and I/O counts, and how many
+ *                     pageins the compressed pool served.
+ */
+
+/* Flag for slots that are in the compressed pool */
+#define SWAP_ZSLOT	0x80000
+
+void swap_bootstrap(void);
+int swap_store(paddr_t pa, unsigned *slot);
+bool swap_hasroom(void);
+void swap_incref(unsigned slot);
+void swap_decref(unsigned slot);
+int swap_pagein(unsigned slot, paddr_t pa);
+void swap_printstats(void);
+
+
+#endif /* _SWAP_H_ */
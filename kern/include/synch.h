@@ -37,6 +37,12 @@
 
 #include <spinlock.h>
 
+/*
+ * Set up allocation of locks and CVs. Called once, early in boot,
+ * before any are created.
+ */
+void synch_bootstrap(void);
+
 /*
  * Dijkstra-style semaphore.
  *
@@ -82,4 +82,12 @@ int sys_chdir(const char *pathname);
 pid_t sys_getpid(void);
 
 
+// memory system calls (not with dumbvm)
+int sys_sbrk(intptr_t amount, vaddr_t *retval);
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	     off_t offset, vaddr_t *retval);
+int sys_munmap(userptr_t addr, size_t len);
+int sys_msync(userptr_t addr, size_t len, int flags);
+
+
 #endif /* _SYSCALL_H_ */
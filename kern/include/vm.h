@@ -55,6 +55,12 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 vaddr_t alloc_kpages(unsigned npages);
 void free_kpages(vaddr_t addr);
 
+/* Allocate one zero-filled kernel page (free it with free_kpages) */
+vaddr_t alloc_kzpage(void);
+
+/* Idle-loop background work; see vm.c. */
+bool vm_idle(void);
+
 /*
  * Return amount of memory (in bytes) used by allocated coremap pages.  If
  * there are ongoing allocations, this value could change after it is returned
@@ -62,8 +68,46 @@ void free_kpages(vaddr_t addr);
  */
 unsigned int coremap_used_bytes(void);
 
-/* TLB shootdown handling called from interprocessor_interrupt */
+/* Print VM system statistics (menu command "vm") */
+void vm_printstats(void);
+
+/*
+ * Print the histogram of page fault latencies (menu command "vmp").
+ * Faults are only timed while vm_setfaulthist has turned it on
+ * ("vmp on"/"vmp off"); turning it on clears the histogram.
+ */
+void vm_printfaulthist(void);
+void vm_setfaulthist(bool on);
+
+/*
+ * Fault-around window in pages (menu command "fa"): on a fault, also
+ * preload TLB entries for resident pages in the same aligned block.
+ * vm_setfaultaround returns EINVAL unless NPAGES is 0 or a power of
+ * two up to VM_FAULTAROUND_MAX.
+ */
+#define VM_FAULTAROUND_MAX	16
+int vm_setfaultaround(unsigned npages);
+unsigned vm_getfaultaround(void);
+
+/*
+ * TLB shootdown handling.
+ *    vm_tlbshootdown          - carry out one request on this cpu.
+ *    vm_tlbshootdown_all      - flush this cpu's whole TLB, when the
+ *                               request queue overflowed.
+ *    vm_tlbshootdown_coalesce - try to fold TS into PENDING, which is
+ *                               already queued; returns true if done.
+ *    vm_tlbshootdown_needed   - false if the cpu can't possibly hold
+ *                               entries the request would remove.
+ * The first two are called from interprocessor_interrupt, the others
+ * by the senders in thread.c.
+ */
+struct cpu;
 void vm_tlbshootdown(const struct tlbshootdown *);
+void vm_tlbshootdown_all(void);
+bool vm_tlbshootdown_coalesce(struct tlbshootdown *pending,
+			      const struct tlbshootdown *ts);
+bool vm_tlbshootdown_needed(const struct cpu *c,
+			    const struct tlbshootdown *ts);
 
 
 #endif /* _VM_H_ */
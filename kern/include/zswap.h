@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _ZSWAP_H_
+#define _ZSWAP_H_
+
+/*
+ * Compressed swap pool ("zswap").
+ *
+ * Pages being paged out are first compressed with a simplified LZ4
+ * codec and, if they shrink to half a page or less, kept in kernel
+ * memory instead of being written to disk. The pool is capped at a
+ * fraction of physical memory; once it's full, pages go to the swap
+ * disk as before. swap.c hides the difference from everyone else:
+ * slots with SWAP_ZSLOT set are zswap handles.
+ *
+ * Like swap slots, handles are reference counted, since as_copy
+ * shares paged-out pages.
+ *
+ * Functions:
+ *
+ *    zswap_bootstrap  - set up the pool. Called from swap_bootstrap.
+ *
+ *    zswap_store      - compress the page at PA into the pool and
+ *                       return a handle with one reference. Returns
+ *                       ENOSPC if the page doesn't compress well
+ *                       enough or the pool is full. May sleep.
+ *
+ *    zswap_load       - decompress HANDLE into the page at PA.
+ *
+ *    zswap_incref     - add a reference to HANDLE.
+ *
+ *    zswap_decref     - drop a reference to HANDLE, freeing its space
+ *                       when the last one goes away.
+ *
+ *    zswap_full       - true if the pool has no room for more pages.
+ *
+ *    zswap_printstats - print pool usage, compression ratio, and
+ *                       counts of pages stored and turned away.
+ */
+
+void zswap_bootstrap(void);
+int zswap_store(paddr_t pa, unsigned *handle);
+void zswap_load(unsigned handle, paddr_t pa);
+void zswap_incref(unsigned handle);
+void zswap_decref(unsigned handle);
+bool zswap_full(void);
+void zswap_printstats(void);
+
+
+#endif /* _ZSWAP_H_ */
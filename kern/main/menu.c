@@ -40,6 +40,8 @@
 #include <thread.h>
 #include <proc.h>
 #include <vfs.h>
+#include <vm.h>
+#include <kmem.h>
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
@@ -471,6 +473,7 @@ cmd_kheapstats(int nargs, char **args)
 	(void)args;
 
 	kheap_printstats();
+	kmem_printstats();
 
 	return 0;
 }
@@ -487,6 +490,29 @@ cmd_kheapused(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_vmprocstats(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "on")) {
+		vm_setfaulthist(true);
+		return 0;
+	}
+	if (nargs == 2 && !strcmp(args[1], "off")) {
+		vm_setfaulthist(false);
+		return 0;
+	}
+	if (nargs != 1) {
+		kprintf("Usage: vmp [on | off]\n");
+		return EINVAL;
+	}
+
+	proc_printvmstats();
+	vm_printfaulthist();
+
+	return 0;
+}
+
 static
 int
 cmd_kheapgeneration(int nargs, char **args)
@@ -516,6 +542,88 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+/*
+ * Parse S as a decimal number of at most 9 digits (so it can't
+ * overflow). Returns false if it isn't one; no signs allowed.
+ */
+static
+bool
+getnum(const char *s, unsigned *ret)
+{
+	unsigned i, n;
+
+	n = 0;
+	for (i=0; s[i] != 0; i++) {
+		if (s[i] < '0' || s[i] > '9' || i == 9) {
+			return false;
+		}
+		n = n * 10 + (s[i] - '0');
+	}
+	if (i == 0) {
+		return false;
+	}
+	*ret = n;
+	return true;
+}
+
+static
+int
+cmd_kheapsites(int nargs, char **args)
+{
+	unsigned n;
+
+	if (nargs == 1) {
+		kheap_printsites(10);
+	}
+	else if (nargs == 2 && getnum(args[1], &n)) {
+		kheap_printsites(n);
+	}
+	else if (nargs == 3 && !strcmp(args[1], "rate") &&
+		 getnum(args[2], &n)) {
+		kheap_setsampling(n);
+	}
+	else {
+		kprintf("Usage: khsites [count | rate n]\n");
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_faultaround(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 1) {
+		kprintf("Fault-around window: %u pages\n",
+			vm_getfaultaround());
+		return 0;
+	}
+	if (nargs != 2) {
+		kprintf("Usage: fa [npages]\n");
+		return EINVAL;
+	}
+	result = vm_setfaultaround(atoi(args[1]));
+	if (result) {
+		kprintf("fa: window must be 0 or a power of two up to %u\n",
+			VM_FAULTAROUND_MAX);
+	}
+	return result;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -583,6 +691,7 @@ static const char *testmenu[] = {
 	"[km3] Large kmalloc test            ",
 	"[km4] Multipage kmalloc test        ",
 	"[km5] kmalloc coremap alloc test    ",
+	"[km6] kfree latency test            ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -665,8 +774,12 @@ static const char *mainmenu[] = {
 	"[?t] Tests menu                     ",
 	"[kh] Kernel heap stats              ",
 	"[khu] Kernel heap usage             ",
+	"[vmp] Per-process VM stats          ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[khsites] Top kernel heap sites     ",
+	"[vm] VM system stats                ",
+	"[fa] Set fault-around window        ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -720,8 +833,12 @@ static struct {
 	/* stats */
 	{ "kh",         cmd_kheapstats },
 	{ "khu",        cmd_kheapused },
+	{ "vmp",        cmd_vmprocstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "khsites",    cmd_kheapsites },
+	{ "vm",         cmd_vmstats },
+	{ "fa",         cmd_faultaround },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -733,6 +850,7 @@ static struct {
 	{ "km3",	kmalloctest3 },
 	{ "km4",	kmalloctest4 },
 	{ "km5",	kmalloctest5 },
+	{ "km6",	kmalloctest6 },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
@@ -44,22 +44,57 @@
 
 #include <types.h>
 #include <spl.h>
+#include <array.h>
 #include <proc.h>
 #include <current.h>
 #include <addrspace.h>
 #include <vnode.h>
+#include <clock.h>
+#include <thread.h>
 #include <kern/unistd.h>
 #include <vfs.h>
 #include <synch.h>
+#include <kmem.h>
 #define MAX_PATH 512
 #include <copyinout.h>
 #include <kern/fcntl.h>
+#include "opt-dumbvm.h"
 
 /*
  * The process for the kernel; this holds all the kernel-only threads.
  */
 struct proc *kproc;
 
+/*
+ * Every user process that hasn't exited, for proc_printvmstats and
+ * the OOM killer. kproc isn't on it: it's created before there are
+ * threads to take the lock with, and has no user memory anyway.
+ */
+static struct array *allprocs;
+static struct lock *allprocs_lock;
+
+/* Processes with p_killed set; protected by allprocs_lock */
+static unsigned proc_killed;
+
+/* Object caches for procs and their file table entries. */
+static struct kmem_cache *proc_cache;
+static struct kmem_cache *file_cache;
+
+/*
+ * Constructor for file_cache. Entries are handed back with these
+ * fields cleared again, which is how next_fd tells a free one.
+ */
+static
+void
+file_ctor(void *obj)
+{
+	struct _file *f = obj;
+
+	f->vn = NULL;
+	f->file_name = NULL;
+	f->lk = NULL;
+}
+
 /*
  * Create a proc structure.
  */
@@ -68,22 +103,22 @@ struct proc *
 proc_create(const char *name)
 {
 	struct proc *proc;
-	struct _file *f_t;
-	proc = kmalloc(sizeof(*proc));
+	int result;
+
+	proc = kmem_cache_alloc(proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		kmem_cache_free(proc_cache, proc);
 		return NULL;
 	}
 
         /* memory allocation for the file table of size 64 */
 	for (int i = 0 ; i < 64 ; i++){
-	        proc->f_table[i] = kmalloc (sizeof(*f_t)); 		//alocating memory to every file indiviually
-		proc->f_table[i]->vn = NULL;
-		proc->f_table[i]->file_name = NULL;
+	        proc->f_table[i] = kmem_cache_alloc(file_cache);	//alocating memory to every file indiviually
+		/* vn, file_name and lk were cleared by file_ctor */
 	}
 
 	proc->p_numthreads = 0;
@@ -91,9 +126,33 @@ proc_create(const char *name)
 	/* VM fields */
 	proc->p_addrspace = NULL;
 
+	bzero(&proc->p_vmstats, sizeof(proc->p_vmstats));
+	proc->p_killed = false;
+
 	/* VFS fields */
 	proc->p_cwd = NULL;
 
+	if (kproc == NULL) {
+		/* This is kproc; there's no clock yet either. */
+		proc->p_starttime.tv_sec = 0;
+		proc->p_starttime.tv_nsec = 0;
+		return proc;
+	}
+	gettime(&proc->p_starttime);
+
+	lock_acquire(allprocs_lock);
+	result = array_add(allprocs, proc, NULL);
+	lock_release(allprocs_lock);
+	if (result) {
+		for (int i = 0 ; i < 64 ; i++){
+			kmem_cache_free(file_cache, proc->f_table[i]);
+		}
+		spinlock_cleanup(&proc->p_lock);
+		kfree(proc->p_name);
+		kmem_cache_free(proc_cache, proc);
+		return NULL;
+	}
+
 	return proc;
 }
 
@@ -128,6 +187,8 @@ int next_fd(struct proc *proc){
 void
 proc_destroy(struct proc *proc)
 {
+	unsigned i, num;
+
 	/*
 	 * You probably want to destroy and null out much of the
 	 * process (particularly the address space) at exit time if
@@ -139,6 +200,22 @@ proc_destroy(struct proc *proc)
 	KASSERT(proc != NULL);
 	KASSERT(proc != kproc);
 
+	lock_acquire(allprocs_lock);
+	/* Not there if it already went through proc_exit. */
+	num = array_num(allprocs);
+	for (i = 0; i < num; i++) {
+		if (array_get(allprocs, i) == proc) {
+			array_remove(allprocs, i);
+			break;
+		}
+	}
+	if (proc->p_killed) {
+		/* Killed, but never made it to proc_exit. */
+		KASSERT(proc_killed > 0);
+		proc_killed--;
+	}
+	lock_release(allprocs_lock);
+
 	/*
 	 * We don't take p_lock in here because we must have the only
 	 * reference to this structure. (Otherwise it would be
@@ -150,7 +227,8 @@ proc_destroy(struct proc *proc)
           for (int i = 0 ; i < 64 ; i++){
                 VOP_DECREF(proc->f_table[i]->vn);     // deference
                 lock_destroy(proc->f_table[i]->lk);   // destroy the lock
-                kfree(proc->f_table[i]);
+                file_ctor(proc->f_table[i]);          // back to constructed state
+                kmem_cache_free(file_cache, proc->f_table[i]);
               }
         }
 
@@ -213,7 +291,7 @@ proc_destroy(struct proc *proc)
 	spinlock_cleanup(&proc->p_lock);
 
 	kfree(proc->p_name);
-	kfree(proc);
+	kmem_cache_free(proc_cache, proc);
 }
 
 /*
@@ -222,6 +300,19 @@ proc_destroy(struct proc *proc)
 void
 proc_bootstrap(void)
 {
+	proc_cache = kmem_cache_create("proc", sizeof(struct proc), NULL);
+	file_cache = kmem_cache_create("file", sizeof(struct _file),
+				       file_ctor);
+	if (proc_cache == NULL || file_cache == NULL) {
+		panic("proc_bootstrap: Out of memory\n");
+	}
+
+	allprocs = array_create();
+	allprocs_lock = lock_create("allprocs");
+	if (allprocs == NULL || allprocs_lock == NULL) {
+		panic("proc_bootstrap: Out of memory\n");
+	}
+
 	kproc = proc_create("[kernel]");
 	if (kproc == NULL) {
 		panic("proc_create for kproc failed\n");
@@ -417,3 +508,126 @@ proc_setas(struct addrspace *newas)
 	spinlock_release(&proc->p_lock);
 	return oldas;
 }
+
+/*
+ * Print the VM counters of every process.
+ */
+void
+proc_printvmstats(void)
+{
+	struct proc *proc;
+	struct proc_vmstats pvs;
+	unsigned i, swapouts;
+
+	kprintf("%-16s %8s %8s %8s %8s %8s %8s\n", "name",
+		"minflt", "majflt", "cow", "tlbref", "swapin", "swapout");
+
+	lock_acquire(allprocs_lock);
+	for (i = 0; i < array_num(allprocs); i++) {
+		proc = array_get(allprocs, i);
+
+		spinlock_acquire(&proc->p_lock);
+		pvs = proc->p_vmstats;
+		swapouts = 0;
+#if !OPT_DUMBVM
+		if (proc->p_addrspace != NULL) {
+			swapouts = proc->p_addrspace->as_swapouts;
+		}
+#endif
+		spinlock_release(&proc->p_lock);
+
+		kprintf("%-16s %8u %8u %8u %8u %8u %8u\n", proc->p_name,
+			pvs.pvs_minfaults, pvs.pvs_majfaults,
+			pvs.pvs_cowbreaks, pvs.pvs_tlbrefills,
+			pvs.pvs_swapins, swapouts);
+	}
+	lock_release(allprocs_lock);
+}
+
+void
+proc_exit(int status)
+{
+	struct proc *proc = curproc;
+	struct addrspace *as;
+	unsigned i, num;
+
+	KASSERT(proc != kproc);
+
+	spinlock_acquire(&proc->p_lock);
+	proc->exit_code = status;
+	spinlock_release(&proc->p_lock);
+
+	as = proc_setas(NULL);
+	as_deactivate();
+	if (as != NULL) {
+		as_destroy(as);
+	}
+
+	/*
+	 * Nothing is left to count or kill, so take it off the list;
+	 * otherwise the list would grow with every process ever run.
+	 */
+	lock_acquire(allprocs_lock);
+	num = array_num(allprocs);
+	for (i = 0; i < num; i++) {
+		if (array_get(allprocs, i) == proc) {
+			array_remove(allprocs, i);
+			break;
+		}
+	}
+	KASSERT(i < num);
+	if (proc->p_killed) {
+		KASSERT(proc_killed > 0);
+		proc_killed--;
+		proc->p_killed = false;
+	}
+	lock_release(allprocs_lock);
+
+	thread_exit();
+}
+
+bool
+proc_killworst(unsigned (*score)(struct proc *, void *), void *data)
+{
+	struct proc *proc, *victim;
+	unsigned i, s, best;
+
+	victim = NULL;
+	best = 0;
+
+	lock_acquire(allprocs_lock);
+	for (i = 0; i < array_num(allprocs); i++) {
+		proc = array_get(allprocs, i);
+
+		spinlock_acquire(&proc->p_lock);
+		s = proc->p_killed ? 0 : score(proc, data);
+		spinlock_release(&proc->p_lock);
+
+		if (s > best) {
+			best = s;
+			victim = proc;
+		}
+	}
+	if (victim != NULL) {
+		spinlock_acquire(&victim->p_lock);
+		victim->p_killed = true;
+		spinlock_release(&victim->p_lock);
+		proc_killed++;
+		kprintf("Out of memory: killed process %s (score %u)\n",
+			victim->p_name, best);
+	}
+	lock_release(allprocs_lock);
+
+	return victim != NULL;
+}
+
+unsigned
+proc_nkilled(void)
+{
+	unsigned n;
+
+	lock_acquire(allprocs_lock);
+	n = proc_killed;
+	lock_release(allprocs_lock);
+	return n;
+}
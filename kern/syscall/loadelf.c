@@ -42,8 +42,11 @@
  * circumstances, as_prepare_load and as_complete_load probably don't
  * need to do anything.
  *
- * If you wanted to support memory-mapped executables you would need
- * to rearrange this to map each segment.
+ * With dumbvm, each chunk is loaded by reading it into the address
+ * space. Otherwise each segment is instead handed to as_define_file,
+ * which arranges for its pages to be read from the executable when
+ * they're first touched, so only the parts of the program that are
+ * actually used get read at all.
  *
  * To support dynamically linked executables with shared libraries
  * you'd need to change this to load the "ELF interpreter" (dynamic
@@ -52,6 +55,7 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/stat.h>
 #include <lib.h>
 #include <uio.h>
 #include <proc.h>
@@ -59,6 +63,9 @@
 #include <addrspace.h>
 #include <vnode.h>
 #include <elf.h>
+#include "opt-dumbvm.h"
+
+#if OPT_DUMBVM
 
 /*
  * Load a segment at virtual address VADDR. The segment in memory
@@ -145,6 +152,43 @@ load_segment(struct addrspace *as, struct vnode *v,
 	return result;
 }
 
+#else /* !OPT_DUMBVM */
+
+/*
+ * Map a segment at virtual address VADDR, with the same arguments as
+ * load_segment above, plus FILELEN, the size of the executable. The
+ * pages are read in later by vm_fault; all we check now is that the
+ * file actually contains the data.
+ */
+static
+int
+map_segment(struct addrspace *as, struct vnode *v,
+	    off_t offset, vaddr_t vaddr,
+	    size_t memsize, size_t filesize, off_t filelen)
+{
+	if (filesize > memsize) {
+		kprintf("ELF: warning: segment filesize > segment memsize\n");
+		filesize = memsize;
+	}
+
+	if (offset < 0 || offset + (off_t)filesize > filelen) {
+		/* would be a short read; problem with executable? */
+		kprintf("ELF: segment past end of file - file truncated?\n");
+		return ENOEXEC;
+	}
+
+	DEBUG(DB_EXEC, "ELF: Mapping %lu bytes to 0x%lx\n",
+	      (unsigned long) filesize, (unsigned long) vaddr);
+
+	if (filesize == 0) {
+		/* all bss */
+		return 0;
+	}
+	return as_define_file(as, vaddr, filesize, v, offset);
+}
+
+#endif /* OPT_DUMBVM */
+
 /*
  * Load an ELF executable user program into the current address space.
  *
@@ -159,6 +203,9 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 	struct iovec iov;
 	struct uio ku;
 	struct addrspace *as;
+#if !OPT_DUMBVM
+	struct stat st;
+#endif
 
 	as = proc_getas();
 
@@ -258,8 +305,15 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		return result;
 	}
 
+#if !OPT_DUMBVM
+	result = VOP_STAT(v, &st);
+	if (result) {
+		return result;
+	}
+#endif
+
 	/*
-	 * Now actually load each segment.
+	 * Now actually load (or map) each segment.
 	 */
 
 	for (i=0; i<eh.e_phnum; i++) {
@@ -288,9 +342,14 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
+#if OPT_DUMBVM
 		result = load_segment(as, v, ph.p_offset, ph.p_vaddr,
 				      ph.p_memsz, ph.p_filesz,
 				      ph.p_flags & PF_X);
+#else
+		result = map_segment(as, v, ph.p_offset, ph.p_vaddr,
+				     ph.p_memsz, ph.p_filesz, st.st_size);
+#endif
 		if (result) {
 			return result;
 		}
@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Memory management system calls.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <proc.h>
+#include <current.h>
+#include <vnode.h>
+#include <addrspace.h>
+#include <syscall.h>
+
+/*
+ * sbrk: move the end of the heap by AMOUNT bytes (which may be
+ * negative) and return the old end in RETVAL. Frames are only
+ * allocated when the new pages are touched; see as_setbreak.
+ */
+int
+sys_sbrk(intptr_t amount, vaddr_t *retval)
+{
+	struct addrspace *as;
+	vaddr_t oldbreak, newbreak;
+	int result;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EINVAL;
+	}
+
+	oldbreak = as->as_break;
+	newbreak = oldbreak + amount;
+	if (amount > 0 && newbreak < oldbreak) {
+		return ENOMEM;
+	}
+	if (amount < 0 && newbreak > oldbreak) {
+		return EINVAL;
+	}
+
+	result = as_setbreak(as, newbreak);
+	if (result) {
+		return result;
+	}
+	*retval = oldbreak;
+	return 0;
+}
+
+/*
+ * mmap: map LEN bytes of the file open on FD, starting at OFFSET, or
+ * of zeros if FLAGS has MAP_ANON. Pages are read in when touched.
+ * MAP_PRIVATE mappings share the file's cached pages until written
+ * and then get private copies; MAP_SHARED ones write to the cached
+ * pages in place, and dirty pages are written back at msync, munmap,
+ * and exit.
+ */
+int
+sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	 off_t offset, vaddr_t *retval)
+{
+	struct addrspace *as;
+	struct vnode *v;
+	vaddr_t base;
+	int perm, vrf, accmode, result;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EINVAL;
+	}
+	if (len == 0 || offset < 0 || (offset & (PAGE_SIZE - 1)) != 0) {
+		return EINVAL;
+	}
+	switch (flags & (MAP_SHARED | MAP_PRIVATE)) {
+	    case MAP_SHARED:
+		vrf = VRF_SHARED;
+		break;
+	    case MAP_PRIVATE:
+		vrf = 0;
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	perm = 0;
+	if (prot & PROT_READ) {
+		perm |= VR_READ;
+	}
+	if (prot & PROT_WRITE) {
+		perm |= VR_WRITE;
+	}
+	if (prot & PROT_EXEC) {
+		perm |= VR_EXEC;
+	}
+
+	v = NULL;
+	if ((flags & MAP_ANON) == 0) {
+		if (fd < 0 || fd >= 64 || curproc->f_table[fd] == NULL ||
+		    curproc->f_table[fd]->vn == NULL) {
+			return EBADF;
+		}
+		accmode = curproc->f_table[fd]->flag & O_ACCMODE;
+		if (accmode == O_WRONLY) {
+			return EACCES;
+		}
+		if ((vrf & VRF_SHARED) && (prot & PROT_WRITE) &&
+		    accmode != O_RDWR) {
+			return EACCES;
+		}
+		v = curproc->f_table[fd]->vn;
+		result = VOP_MMAP(v, prot, flags);
+		if (result) {
+			return result;
+		}
+		vrf |= VRF_CACHED;
+	}
+
+	base = (vaddr_t)addr;
+	result = as_mmap(as, &base, len, perm, vrf,
+			 (flags & MAP_FIXED) != 0, v, offset);
+	if (result) {
+		return result;
+	}
+	*retval = base;
+	return 0;
+}
+
+/*
+ * munmap: remove the mappings in [ADDR, ADDR+LEN), writing back any
+ * dirty MAP_SHARED pages first.
+ */
+int
+sys_munmap(userptr_t addr, size_t len)
+{
+	struct addrspace *as;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EINVAL;
+	}
+	return as_munmap(as, (vaddr_t)addr, len);
+}
+
+/*
+ * msync: write back the dirty MAP_SHARED pages in [ADDR, ADDR+LEN)
+ * without unmapping them. Writes are always synchronous, so MS_ASYNC
+ * gets MS_SYNC's behavior; MS_INVALIDATE has nothing to do, since
+ * mappings use the file's cached pages directly.
+ */
+int
+sys_msync(userptr_t addr, size_t len, int flags)
+{
+	struct addrspace *as;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EINVAL;
+	}
+	if ((flags & ~(MS_ASYNC | MS_SYNC | MS_INVALIDATE)) != 0 ||
+	    (flags & (MS_ASYNC | MS_SYNC)) == (MS_ASYNC | MS_SYNC)) {
+		return EINVAL;
+	}
+	return as_msync(as, (vaddr_t)addr, len);
+}
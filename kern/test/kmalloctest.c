@@ -36,6 +36,7 @@
 #include <cpu.h>
 #include <thread.h>
 #include <synch.h>
+#include <clock.h>
 #include <vm.h> /* for PAGE_SIZE */
 #include <test.h>
 #include <kern/test161.h>
@@ -128,6 +129,7 @@ int
 kmallocstress(int nargs, char **args)
 {
 	struct semaphore *sem;
+	unsigned locks;
 	int i, result;
 
 	(void)nargs;
@@ -139,6 +141,7 @@ kmallocstress(int nargs, char **args)
 	}
 
 	kprintf("Starting kmalloc stress test...\n");
+	locks = kheap_lockcount();
 
 	for (i=0; i<NTHREADS; i++) {
 		result = thread_fork("kmallocstress", NULL,
@@ -155,6 +158,10 @@ kmallocstress(int nargs, char **args)
 
 	sem_destroy(sem);
 	kprintf("\n");
+
+	/* Without the per-cpu magazines, this would be every call. */
+	kprintf("%u kmallocs and kfrees took the global heap lock %u "
+		"times\n", 2 * NTHREADS * NTRIES, kheap_lockcount() - locks);
 	success(TEST161_SUCCESS, SECRET, "km2");
 
 	return 0;
@@ -605,3 +612,84 @@ kmalloctest5(int nargs, char **args)
 
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+// km6
+
+/*
+ * Measure kfree latency as the heap grows. For each heap size, fill
+ * that many heap pages with ballast blocks (two per page), then time
+ * freeing a batch of small blocks allocated on top of them. The time
+ * per free should not depend on the size of the heap.
+ */
+
+#define KM6_BATCH	500
+#define KM6_SMALLSIZE	100
+#define KM6_BALLASTSIZE	2000
+
+static const unsigned km6_heappages[] = { 16, 64, 256, 512 };
+
+int
+kmalloctest6(int nargs, char **args)
+{
+	void **ballast, **batch;
+	unsigned i, j, nballast;
+	struct timespec before, after, delta;
+	uint64_t ns;
+
+	(void)nargs;
+	(void)args;
+
+	nballast = 2 * km6_heappages[ARRAYCOUNT(km6_heappages) - 1];
+	ballast = kmalloc(nballast * sizeof(void *));
+	batch = kmalloc(KM6_BATCH * sizeof(void *));
+	if (ballast == NULL || batch == NULL) {
+		panic("km6: Out of memory\n");
+	}
+
+	kprintf("Starting kfree latency test...\n");
+	kprintf("%10s  %12s\n", "heap pages", "ns per kfree");
+
+	for (i = 0; i < ARRAYCOUNT(km6_heappages); i++) {
+		nballast = 2 * km6_heappages[i];
+		for (j = 0; j < nballast; j++) {
+			ballast[j] = kmalloc(KM6_BALLASTSIZE);
+			if (ballast[j] == NULL) {
+				break;
+			}
+		}
+		if (j < nballast) {
+			kprintf("%10u  (out of memory)\n", km6_heappages[i]);
+			nballast = j;
+		}
+		else {
+			for (j = 0; j < KM6_BATCH; j++) {
+				batch[j] = kmalloc(KM6_SMALLSIZE);
+				if (batch[j] == NULL) {
+					panic("km6: kmalloc returned NULL\n");
+				}
+			}
+
+			gettime(&before);
+			for (j = 0; j < KM6_BATCH; j++) {
+				kfree(batch[j]);
+			}
+			gettime(&after);
+
+			timespec_sub(&after, &before, &delta);
+			ns = delta.tv_sec * 1000000000ULL + delta.tv_nsec;
+			kprintf("%10u  %12llu\n", km6_heappages[i],
+				(unsigned long long)ns / KM6_BATCH);
+		}
+
+		for (j = 0; j < nballast; j++) {
+			kfree(ballast[j]);
+		}
+	}
+
+	kfree(batch);
+	kfree(ballast);
+
+	success(TEST161_SUCCESS, SECRET, "km6");
+	return 0;
+}
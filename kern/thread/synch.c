@@ -40,6 +40,45 @@
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <kmem.h>
+
+/* Object caches for locks and CVs. */
+static struct kmem_cache *lock_cache;
+static struct kmem_cache *cv_cache;
+
+/*
+ * Constructors. A lock or CV is freed unheld with its spinlock clear,
+ * which is the state these set up.
+ */
+static
+void
+lock_ctor(void *obj)
+{
+	struct lock *lock = obj;
+
+	spinlock_init(&lock->lk_lock);
+	lock->lk_holder = NULL;
+}
+
+static
+void
+cv_ctor(void *obj)
+{
+	struct cv *cv = obj;
+
+	spinlock_init(&cv->cv_lock);
+}
+
+void
+synch_bootstrap(void)
+{
+	lock_cache = kmem_cache_create("lock", sizeof(struct lock),
+				       lock_ctor);
+	cv_cache = kmem_cache_create("cv", sizeof(struct cv), cv_ctor);
+	if (lock_cache == NULL || cv_cache == NULL) {
+		panic("synch_bootstrap: Out of memory\n");
+	}
+}
 
 ////////////////////////////////////////////////////////////
 //
@@ -142,14 +181,14 @@ V(struct semaphore *sem)
 struct lock * lock_create(const char *name) {
 	struct lock *lock;
 
-	lock = kmalloc(sizeof(*lock));
+	lock = kmem_cache_alloc(lock_cache);
 	if (lock == NULL) {
 		return NULL;
 	}
 
 	lock->lk_name = kstrdup(name);
 	if (lock->lk_name == NULL) {
-		kfree(lock);
+		kmem_cache_free(lock_cache, lock);
 		return NULL;
 	}
 
@@ -158,13 +197,11 @@ struct lock * lock_create(const char *name) {
 	if (lock->lk_wchan == NULL) // this is null that means lock was not properly created
 	{
 		kfree(lock->lk_name);
-		kfree(lock);
+		kmem_cache_free(lock_cache, lock);
 		return NULL;
 	}
 
-	spinlock_init(&lock->lk_lock);
-	lock->lk_holder = NULL;//also no threads should be holding it when it is created
-        // unlike the semaphore we will not have count but instead we will nullify holds.
+	/* lk_lock and lk_holder were set up by lock_ctor */
 
 	return lock; // return the lock that was created
 }
@@ -182,7 +219,7 @@ void lock_destroy(struct lock *lock) {
         }
         lock->lk_holder = NULL; // no thread should be holding it when it is destroyed
         kfree(lock->lk_name); // after the lock is destroyed freeing the name and memory
-        kfree(lock);
+        kmem_cache_free(lock_cache, lock);
 }
 
 void lock_acquire(struct lock *lock) {       /* implementing this similar to semaphore*/
@@ -240,14 +277,14 @@ bool lock_do_i_hold(struct lock *lock) {
 struct cv * cv_create(const char *name) {
 	struct cv *cv;
 
-	cv = kmalloc(sizeof(*cv));
+	cv = kmem_cache_alloc(cv_cache);
 	if (cv == NULL) {
 		return NULL;
 	}
 
 	cv->cv_name = kstrdup(name);
 	if (cv->cv_name==NULL) {
-		kfree(cv);
+		kmem_cache_free(cv_cache, cv);
 		return NULL;
 	}
         /*similar implemention to the semaphone and lock for create*/
@@ -255,10 +292,10 @@ struct cv * cv_create(const char *name) {
 	if(cv->cv_wchan == NULL)
 	{
 		kfree(cv->cv_name);
-		kfree(cv);
+		kmem_cache_free(cv_cache, cv);
 		return NULL;
 	}
-        spinlock_init(&cv->cv_lock);
+	/* cv_lock was set up by cv_ctor */
 	return cv;
 }
 
@@ -267,7 +304,7 @@ void cv_destroy(struct cv *cv) {
 	wchan_destroy(cv->cv_wchan);
 	spinlock_cleanup(&cv->cv_lock);
 	kfree(cv->cv_name);
-	kfree(cv);
+	kmem_cache_free(cv_cache, cv);
 }
 
 void cv_wait(struct cv *cv, struct lock *lock) {
@@ -48,8 +48,11 @@
 #include <current.h>
 #include <synch.h>
 #include <addrspace.h>
+#include <vm.h>
 #include <mainbus.h>
+#include <platform/maxcpus.h>
 #include <vnode.h>
+#include <kmem.h>
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
@@ -75,6 +78,10 @@ unsigned thread_count = 0;
 static struct spinlock thread_count_lock = SPINLOCK_INITIALIZER;
 static struct wchan *thread_count_wchan;
 
+/* Object caches for threads and wait channels. */
+static struct kmem_cache *thread_cache;
+static struct kmem_cache *wchan_cache;
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -129,7 +136,7 @@ thread_create(const char *name)
 		return NULL;
 	}
 
-	thread = kmalloc(sizeof(*thread));
+	thread = kmem_cache_alloc(thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
@@ -184,6 +191,9 @@ cpu_create(unsigned hardware_number)
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
 	c->c_spinlocks = 0;
+	c->c_asid_next = 1;
+	c->c_asid_gen = 1;
+	c->c_asid_cur = 0;
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
@@ -191,8 +201,19 @@ cpu_create(unsigned hardware_number)
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdown_flushall = false;
+	c->c_shootdown_seq = 0;
+	c->c_shootdown_done = 0;
+	c->c_shootdown_wchan = wchan_create("shootdown");
+	if (c->c_shootdown_wchan == NULL) {
+		panic("cpu_create: Out of memory\n");
+	}
+	spinlock_init(&c->c_shootdown_lock);
 	spinlock_init(&c->c_ipi_lock);
 
+	pagecache_init(&c->c_pagecache);
+	kheap_cpuinit(c);
+
 	result = cpuarray_add(&allcpus, c, &c->c_number);
 	if (result != 0) {
 		panic("cpu_create: array_add: %s\n", strerror(result));
@@ -286,7 +307,7 @@ thread_destroy(struct thread *thread)
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
 
-	kfree(thread);
+	kmem_cache_free(thread_cache, thread);
 }
 
 /*
@@ -373,6 +394,12 @@ thread_shutdown(void)
 void
 thread_bootstrap(void)
 {
+	thread_cache = kmem_cache_create("thread", sizeof(struct thread),
+					 NULL);
+	if (thread_cache == NULL) {
+		panic("thread_bootstrap: Out of memory\n");
+	}
+
 	cpuarray_init(&allcpus);
 
 	/*
@@ -654,6 +681,8 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	 * Note that c_isidle becomes true briefly even if we don't go
 	 * idle. However, because one is supposed to hold the runqueue
 	 * lock to look at it, this should not be visible or matter.
+	 *
+	 * vm_idle gets a turn before each cpu_idle; see vm.c.
 	 */
 
 	/* The current cpu is now idle. */
@@ -662,7 +691,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			if (!vm_idle()) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -988,6 +1019,33 @@ thread_consider_migration(void)
  * Wait channel functions
  */
 
+/*
+ * Constructor for wchan_cache: wait channels are freed with an empty
+ * thread list, so the list only needs setting up once.
+ */
+static
+void
+wchan_ctor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	threadlist_init(&wc->wc_threads);
+}
+
+/*
+ * Set up the wait channel cache. Called early in boot, before anything
+ * makes a lock.
+ */
+void
+wchan_bootstrap(void)
+{
+	wchan_cache = kmem_cache_create("wchan", sizeof(struct wchan),
+					wchan_ctor);
+	if (wchan_cache == NULL) {
+		panic("wchan_bootstrap: Out of memory\n");
+	}
+}
+
 /*
  * Create a wait channel. NAME is a symbolic string name for it.
  * This is what's displayed by ps -alx in Unix.
@@ -1001,11 +1059,11 @@ wchan_create(const char *name)
 {
 	struct wchan *wc;
 
-	wc = kmalloc(sizeof(*wc));
+	wc = kmem_cache_alloc(wchan_cache);
 	if (wc == NULL) {
 		return NULL;
 	}
-	threadlist_init(&wc->wc_threads);
+	/* wc_threads was initialized by wchan_ctor */
 	wc->wc_name = name;
 
 	return wc;
@@ -1019,7 +1077,7 @@ void
 wchan_destroy(struct wchan *wc)
 {
 	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
+	kmem_cache_free(wchan_cache, wc);
 }
 
 /*
@@ -1160,37 +1218,110 @@ ipi_broadcast(int code)
 }
 
 /*
- * Send a TLB shootdown IPI to the specified CPU.
+ * Send a TLB shootdown IPI to the specified CPU. Returns a ticket to
+ * pass to ipi_tlbshootdown_wait. Tickets are never 0, even when the
+ * counter wraps.
+ *
+ * If the request overlaps one already queued for the same address
+ * space, the two are merged. If the queue is full, it is thrown away
+ * and the target flushes its whole TLB instead. Either way no IPI is
+ * sent if one is already pending; the target will see the request
+ * when it handles that one.
  */
-void
+unsigned
 ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 {
-	unsigned n;
+	unsigned i, n, ticket;
+	bool merged;
 
 	spinlock_acquire(&target->c_ipi_lock);
 
 	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
-		/*
-		 * If you have problems with this panic going off,
-		 * consider: (1) increasing the maximum, (2) putting
-		 * logic here to sleep until space appears (may
-		 * interact awkwardly with VM system locking), (3)
-		 * putting logic here to coalesce requests together,
-		 * and/or (4) improving VM system state tracking to
-		 * reduce the number of unnecessary shootdowns.
-		 */
-		panic("ipi_tlbshootdown: Too many shootdowns queued\n");
+	if (!target->c_shootdown_flushall) {
+		merged = false;
+		for (i=0; i<n && !merged; i++) {
+			merged = vm_tlbshootdown_coalesce(
+				&target->c_shootdown[i], mapping);
+		}
+		if (!merged && n == TLBSHOOTDOWN_MAX) {
+			target->c_shootdown_flushall = true;
+			target->c_numshootdown = 0;
+		}
+		else if (!merged) {
+			target->c_shootdown[n] = *mapping;
+			target->c_numshootdown = n+1;
+		}
 	}
-	else {
-		target->c_shootdown[n] = *mapping;
-		target->c_numshootdown = n+1;
+	ticket = ++target->c_shootdown_seq;
+	if (ticket == 0) {
+		/* 0 means "not sent" to ipi_tlbshootdown_allcpus */
+		ticket = ++target->c_shootdown_seq;
 	}
 
-	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
-	mainbus_send_ipi(target);
+	if ((target->c_ipi_pending & ((uint32_t)1 << IPI_TLBSHOOTDOWN)) == 0) {
+		target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
+		mainbus_send_ipi(target);
+	}
 
 	spinlock_release(&target->c_ipi_lock);
+	return ticket;
+}
+
+/*
+ * Wait until the specified CPU has handled the shootdown that
+ * returned TICKET. May sleep.
+ */
+void
+ipi_tlbshootdown_wait(struct cpu *target, unsigned ticket)
+{
+	spinlock_acquire(&target->c_shootdown_lock);
+	/* Compare by difference so the counters can wrap. */
+	while ((int)(target->c_shootdown_done - ticket) < 0) {
+		wchan_sleep(target->c_shootdown_wchan,
+			    &target->c_shootdown_lock);
+	}
+	spinlock_release(&target->c_shootdown_lock);
+}
+
+/*
+ * Send a TLB shootdown IPI to every CPU but this one that might have
+ * the mapping, and wait for them all to finish. Returns the number
+ * of CPUs sent to.
+ */
+unsigned
+ipi_tlbshootdown_allcpus(const struct tlbshootdown *mapping)
+{
+	unsigned i, sent;
+	unsigned tickets[MAXCPUS];
+	struct cpu *c, *me;
+	int spl;
+
+	KASSERT(cpuarray_num(&allcpus) <= MAXCPUS);
+
+	/* Stay on this cpu while deciding which cpus are "others". */
+	spl = splhigh();
+	me = curcpu->c_self;
+	sent = 0;
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		tickets[i] = 0;
+		if (c != me && vm_tlbshootdown_needed(c, mapping)) {
+			tickets[i] = ipi_tlbshootdown(c, mapping);
+			sent++;
+		}
+	}
+	splx(spl);
+
+	if (sent == 0) {
+		return 0;
+	}
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != me && tickets[i] != 0) {
+			ipi_tlbshootdown_wait(c, tickets[i]);
+		}
+	}
+	return sent;
 }
 
 /*
@@ -1200,8 +1331,9 @@ void
 interprocessor_interrupt(void)
 {
 	uint32_t bits;
-	unsigned i;
+	unsigned i, done;
 
+	done = 0;
 	spinlock_acquire(&curcpu->c_ipi_lock);
 	bits = curcpu->c_ipi_pending;
 
@@ -1233,14 +1365,33 @@ interprocessor_interrupt(void)
 		 * need to release the ipi lock while calling
 		 * vm_tlbshootdown.
 		 */
-		for (i=0; i<curcpu->c_numshootdown; i++) {
-			vm_tlbshootdown(&curcpu->c_shootdown[i]);
+		if (curcpu->c_shootdown_flushall) {
+			vm_tlbshootdown_all();
+		}
+		else {
+			for (i=0; i<curcpu->c_numshootdown; i++) {
+				vm_tlbshootdown(&curcpu->c_shootdown[i]);
+			}
 		}
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdown_flushall = false;
+		done = curcpu->c_shootdown_seq;
 	}
 
 	curcpu->c_ipi_pending = 0;
 	spinlock_release(&curcpu->c_ipi_lock);
+
+	if (bits & (1U << IPI_TLBSHOOTDOWN)) {
+		/*
+		 * Not under the ipi lock: waking a sender takes its
+		 * cpu's runqueue lock and maybe that cpu's ipi lock.
+		 */
+		spinlock_acquire(&curcpu->c_shootdown_lock);
+		curcpu->c_shootdown_done = done;
+		wchan_wakeall(curcpu->c_shootdown_wchan,
+			      &curcpu->c_shootdown_lock);
+		spinlock_release(&curcpu->c_shootdown_lock);
+	}
 }
 
 /*
@@ -242,9 +242,11 @@ null_fsync(struct vnode *v)
  */
 static
 int
-dev_mmap(struct vnode *v  /* add stuff as needed */)
+dev_mmap(struct vnode *v, int prot, int flags)
 {
 	(void)v;
+	(void)prot;
+	(void)flags;
 	return ENOSYS;
 }
 
@@ -36,6 +36,8 @@
 #include <synch.h>
 #include <vfs.h>
 #include <vnode.h>
+#include <filecache.h>
+#include "opt-dumbvm.h"
 
 /*
  * Initialize an abstract vnode.
@@ -52,6 +54,7 @@ vnode_init(struct vnode *vn, const struct vnode_ops *ops,
 	spinlock_init(&vn->vn_countlock);
 	vn->vn_fs = fs;
 	vn->vn_data = fsdata;
+	vn->vn_filecache = NULL;
 	return 0;
 }
 
@@ -62,6 +65,7 @@ void
 vnode_cleanup(struct vnode *vn)
 {
 	KASSERT(vn->vn_refcount == 1);
+	KASSERT(vn->vn_filecache == NULL);
 
 	spinlock_cleanup(&vn->vn_countlock);
 
@@ -113,6 +117,10 @@ vnode_decref(struct vnode *vn)
 	spinlock_release(&vn->vn_countlock);
 
 	if (destroy) {
+#if !OPT_DUMBVM
+		/* Nobody is mapping the file any more. */
+		filecache_release(vn);
+#endif
 		result = VOP_RECLAIM(vn);
 		if (result != 0 && result != EBUSY) {
 			// XXX: lame.
@@ -27,12 +27,20 @@
  * SUCH DAMAGE.
  */
 
+
+#define ASINLINE
+
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/stat.h>
 #include <lib.h>
+#include <uio.h>
 #include <addrspace.h>
+#include <pagetable.h>
 #include <vm.h>
+#include <coremap.h>
 #include <proc.h>
+#include <vnode.h>
 
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
@@ -44,46 +52,306 @@ struct addrspace *
 as_create(void)
 {
 	struct addrspace *as;
+	unsigned i;
 
 	as = kmalloc(sizeof(struct addrspace));
 	if (as == NULL) {
 		return NULL;
 	}
 
-	/*
-	 * Initialize as needed.
-	 */
+	vm_regionarray_init(&as->as_regions);
+	as->as_lastregion = NULL;
+	as->as_heap = NULL;
+	as->as_stack = NULL;
+	as->as_break = 0;
+	as->as_swapouts = 0;
+	as->as_resident = 0;
+	spinlock_init(&as->as_reslock);
+	for (i=0; i<MAXCPUS; i++) {
+		as->as_asid[i] = 0;
+	}
+	as->as_pt = pt_create();
+	if (as->as_pt == NULL) {
+		spinlock_cleanup(&as->as_reslock);
+		vm_regionarray_cleanup(&as->as_regions);
+		kfree(as);
+		return NULL;
+	}
 
 	return as;
 }
 
+/*
+ * Return the index of the first region in AS whose base is above
+ * VADDR (or the number of regions, if none is).
+ */
+static
+unsigned
+as_regionindex(struct addrspace *as, vaddr_t vaddr)
+{
+	unsigned lo, hi, mid;
+
+	lo = 0;
+	hi = vm_regionarray_num(&as->as_regions);
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (vm_regionarray_get(&as->as_regions, mid)->vr_base <= vaddr) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+ * Add a region, keeping the array sorted. Fails with EINVAL if it
+ * would overlap an existing region.
+ */
+static
+int
+as_addregion(struct addrspace *as, vaddr_t base, size_t npages, int perm,
+	     struct vm_region **ret)
+{
+	struct vm_region *vr, *prev, *next;
+	unsigned i, n, pos;
+	int result;
+
+	n = vm_regionarray_num(&as->as_regions);
+	pos = as_regionindex(as, base);
+	if (pos > 0) {
+		prev = vm_regionarray_get(&as->as_regions, pos - 1);
+		if (prev->vr_base + prev->vr_npages * PAGE_SIZE > base) {
+			return EINVAL;
+		}
+	}
+	if (pos < n) {
+		next = vm_regionarray_get(&as->as_regions, pos);
+		if (base + npages * PAGE_SIZE > next->vr_base) {
+			return EINVAL;
+		}
+	}
+
+	vr = kmalloc(sizeof(*vr));
+	if (vr == NULL) {
+		return ENOMEM;
+	}
+	vr->vr_base = base;
+	vr->vr_npages = npages;
+	vr->vr_perm = perm;
+	vr->vr_flags = 0;
+	vr->vr_vnode = NULL;
+	vr->vr_fileaddr = 0;
+	vr->vr_fileoff = 0;
+	vr->vr_filesize = 0;
+
+	result = vm_regionarray_setsize(&as->as_regions, n + 1);
+	if (result) {
+		kfree(vr);
+		return result;
+	}
+	for (i = n; i > pos; i--) {
+		vm_regionarray_set(&as->as_regions, i,
+				   vm_regionarray_get(&as->as_regions, i - 1));
+	}
+	vm_regionarray_set(&as->as_regions, pos, vr);
+
+	if (ret != NULL) {
+		*ret = vr;
+	}
+	return 0;
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *newas;
+	struct vm_region *vr, *newvr;
+	unsigned i;
+	int result;
 
 	newas = as_create();
 	if (newas==NULL) {
 		return ENOMEM;
 	}
 
+	for (i=0; i<vm_regionarray_num(&old->as_regions); i++) {
+		vr = vm_regionarray_get(&old->as_regions, i);
+		result = as_addregion(newas, vr->vr_base, vr->vr_npages,
+				      vr->vr_perm, &newvr);
+		if (result) {
+			as_destroy(newas);
+			return result;
+		}
+		if (vr == old->as_heap) {
+			newas->as_heap = newvr;
+		}
+		if (vr == old->as_stack) {
+			newas->as_stack = newvr;
+		}
+		newvr->vr_flags = vr->vr_flags;
+		if (vr->vr_vnode != NULL) {
+			VOP_INCREF(vr->vr_vnode);
+			newvr->vr_vnode = vr->vr_vnode;
+			newvr->vr_fileaddr = vr->vr_fileaddr;
+			newvr->vr_fileoff = vr->vr_fileoff;
+			newvr->vr_filesize = vr->vr_filesize;
+		}
+	}
+	newas->as_break = old->as_break;
+
 	/*
-	 * Write this.
+	 * Share all the frames copy-on-write. Since they're now
+	 * shared, the old address space's TLB entries for them may no
+	 * longer be writeable; drop them so they get reloaded
+	 * read-only.
 	 */
-
-	(void)old;
+	result = pt_copy(old->as_pt, newas->as_pt, &newas->as_resident);
+	vm_tlbinvalidate(old);
+	if (result) {
+		as_destroy(newas);
+		return result;
+	}
 
 	*ret = newas;
 	return 0;
 }
 
+/*
+ * Write the dirty pages in [START, END) of the MAP_SHARED region VR
+ * back to its file. Each dirty page is unmapped from the TLB first, with the page
+ * pinned so it can't be faulted back in writeable until we're done.
+ * Each mapper writes back what it sees as dirty; the dirty flag is
+ * only cleared by the last one, since the others may still have the
+ * page writeable in their TLBs.
+ */
+static
+int
+as_syncregion(struct addrspace *as, struct vm_region *vr,
+	      vaddr_t start, vaddr_t end)
+{
+	struct iovec iov;
+	struct uio ku;
+	struct stat st;
+	pte_t *pte;
+	paddr_t pa;
+	vaddr_t va;
+	off_t offset;
+	size_t len;
+	int result, ret;
+
+	KASSERT(vr->vr_flags & VRF_SHARED);
+	KASSERT(start >= vr->vr_base && start <= end);
+	KASSERT(end <= vr->vr_base + vr->vr_npages * PAGE_SIZE);
+	if (vr->vr_vnode == NULL) {
+		/* Anonymous; nowhere to write it. */
+		return 0;
+	}
+
+	result = VOP_STAT(vr->vr_vnode, &st);
+	if (result) {
+		return result;
+	}
+
+	ret = 0;
+	for (va = start; va < end; va += PAGE_SIZE) {
+		pte = pt_lookup(as->as_pt, va, false);
+		if (pte == NULL || !coremap_pin(pte)) {
+			continue;
+		}
+		pa = *pte & PTE_FRAME;
+		if (!coremap_isdirty(pa)) {
+			coremap_unpin(pa);
+			continue;
+		}
+
+		/* Make the next write fault and set the flag again. */
+		vm_tlbunmap(as, va, va + PAGE_SIZE);
+
+		result = 0;
+		offset = vr->vr_fileoff + (va - vr->vr_fileaddr);
+		if (offset < st.st_size) {
+			/* Writes past EOF don't extend the file. */
+			len = PAGE_SIZE;
+			if (offset + (off_t)len > st.st_size) {
+				len = st.st_size - offset;
+			}
+			uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(pa),
+				  len, offset, UIO_WRITE);
+			result = VOP_WRITE(vr->vr_vnode, &ku);
+			if (result && ret == 0) {
+				ret = result;
+			}
+		}
+		/* Only the file cache and us left? */
+		if (result == 0 && coremap_refcount(pa) <= 2) {
+			coremap_setdirty(pa, false);
+		}
+		coremap_unpin(pa);
+	}
+	return ret;
+}
+
+/*
+ * Remove the region at index POS: unmap its pages, freeing what
+ * nobody else uses, and drop its file.
+ */
+static
+void
+as_removeregion(struct addrspace *as, unsigned pos)
+{
+	struct vm_region *vr;
+	vaddr_t top;
+	unsigned n;
+
+	vr = vm_regionarray_get(&as->as_regions, pos);
+	top = vr->vr_base + vr->vr_npages * PAGE_SIZE;
+	if (vr->vr_npages > 0) {
+		vm_tlbunmap(as, vr->vr_base, top);
+		n = pt_unmap(as->as_pt, vr->vr_base, top);
+		as_addresident(as, -(int)n);
+	}
+	if (vr->vr_vnode != NULL) {
+		VOP_DECREF(vr->vr_vnode);
+	}
+	if (as->as_lastregion == vr) {
+		as->as_lastregion = NULL;
+	}
+	vm_regionarray_remove(&as->as_regions, pos);
+	kfree(vr);
+}
+
 void
 as_destroy(struct addrspace *as)
 {
-	/*
-	 * Clean up as needed.
-	 */
+	struct vm_region *vr;
+	unsigned i;
+	int result;
+
+	for (i=0; i<vm_regionarray_num(&as->as_regions); i++) {
+		vr = vm_regionarray_get(&as->as_regions, i);
+		if (vr->vr_flags & VRF_SHARED) {
+			result = as_syncregion(as, vr, vr->vr_base,
+				vr->vr_base + vr->vr_npages * PAGE_SIZE);
+			if (result) {
+				kprintf("vm: msync on exit: %s\n",
+					strerror(result));
+			}
+		}
+	}
 
+	for (i=0; i<vm_regionarray_num(&as->as_regions); i++) {
+		vr = vm_regionarray_get(&as->as_regions, i);
+		if (vr->vr_vnode != NULL) {
+			VOP_DECREF(vr->vr_vnode);
+		}
+		kfree(vr);
+	}
+	vm_regionarray_setsize(&as->as_regions, 0);
+	vm_regionarray_cleanup(&as->as_regions);
+	pt_destroy(as->as_pt);
+	spinlock_cleanup(&as->as_reslock);
 	kfree(as);
 }
 
@@ -101,19 +369,70 @@ as_activate(void)
 		return;
 	}
 
-	/*
-	 * Write this.
-	 */
+	vm_tlbactivate(as);
 }
 
 void
 as_deactivate(void)
 {
-	/*
-	 * Write this. For many designs it won't need to actually do
-	 * anything. See proc.c for an explanation of why it (might)
-	 * be needed.
-	 */
+	/* nothing */
+}
+
+/*
+ * Return the region containing VADDR, or NULL if there isn't one.
+ */
+struct vm_region *
+as_findregion(struct addrspace *as, vaddr_t vaddr)
+{
+	struct vm_region *vr;
+	unsigned pos;
+
+	vr = as->as_lastregion;
+	if (vr != NULL && vaddr >= vr->vr_base &&
+	    vaddr < vr->vr_base + vr->vr_npages * PAGE_SIZE) {
+		return vr;
+	}
+
+	pos = as_regionindex(as, vaddr);
+	if (pos == 0) {
+		return NULL;
+	}
+	vr = vm_regionarray_get(&as->as_regions, pos - 1);
+	if (vaddr >= vr->vr_base + vr->vr_npages * PAGE_SIZE) {
+		return NULL;
+	}
+	as->as_lastregion = vr;
+	return vr;
+}
+
+struct vm_region *
+as_growstack(struct addrspace *as, vaddr_t vaddr)
+{
+	struct vm_region *stack, *prev;
+	vaddr_t base;
+	unsigned pos;
+
+	stack = as->as_stack;
+	if (stack == NULL || vaddr >= stack->vr_base ||
+	    vaddr < VM_STACKLIMIT) {
+		return NULL;
+	}
+	base = vaddr & PAGE_FRAME;
+
+	/* Keep the guard page below the new bottom free. */
+	pos = as_regionindex(as, stack->vr_base - 1);
+	if (pos > 0) {
+		prev = vm_regionarray_get(&as->as_regions, pos - 1);
+		if (prev->vr_base + prev->vr_npages * PAGE_SIZE >
+		    base - PAGE_SIZE) {
+			return NULL;
+		}
+	}
+
+	stack->vr_npages += (stack->vr_base - base) / PAGE_SIZE;
+	stack->vr_base = base;
+	as->as_lastregion = stack;
+	return stack;
 }
 
 /*
@@ -122,57 +441,186 @@ as_deactivate(void)
  * VADDR+MEMSIZE.
  *
  * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
- * write, or execute permission should be set on the segment. At the
- * moment, these are ignored. When you write the VM system, you may
- * want to implement them.
+ * write, or execute permission should be set on the segment. They
+ * are recorded in the region and enforced by vm_fault. The region
+ * must not overlap any other (EINVAL).
+ *
+ * No memory is allocated here; pages are zero-filled (or read from
+ * the file given to as_define_file) on first touch by vm_fault.
  */
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 		 int readable, int writeable, int executable)
 {
-	/*
-	 * Write this.
-	 */
+	size_t npages;
+	vaddr_t top;
+	int perm;
 
-	(void)as;
-	(void)vaddr;
-	(void)memsize;
-	(void)readable;
-	(void)writeable;
-	(void)executable;
-	return ENOSYS;
+	/* Align the region. First, the base... */
+	memsize += vaddr & ~(vaddr_t)PAGE_FRAME;
+	vaddr &= PAGE_FRAME;
+
+	/* ...and now the length. */
+	memsize = (memsize + PAGE_SIZE - 1) & PAGE_FRAME;
+
+	npages = memsize / PAGE_SIZE;
+	top = vaddr + memsize;
+	if (top < vaddr || top > USERSPACETOP) {
+		return EFAULT;
+	}
+
+	perm = 0;
+	if (readable) {
+		perm |= VR_READ;
+	}
+	if (writeable) {
+		perm |= VR_WRITE;
+	}
+	if (executable) {
+		perm |= VR_EXEC;
+	}
+
+	return as_addregion(as, vaddr, npages, perm, NULL);
+}
+
+/*
+ * Back FILESIZE bytes at VADDR with the contents of V starting at
+ * file offset OFFSET. The range must lie within a single region,
+ * which must not already have a file. Nothing is read now; vm_fault
+ * reads each page in when it's first touched.
+ */
+int
+as_define_file(struct addrspace *as, vaddr_t vaddr, size_t filesize,
+	       struct vnode *v, off_t offset)
+{
+	struct vm_region *vr;
+
+	vr = as_findregion(as, vaddr);
+	if (vr == NULL || vr->vr_vnode != NULL) {
+		return EINVAL;
+	}
+	if (vaddr + filesize < vaddr ||
+	    vaddr + filesize > vr->vr_base + vr->vr_npages * PAGE_SIZE) {
+		return EINVAL;
+	}
+
+	VOP_INCREF(v);
+	if ((vr->vr_perm & VR_WRITE) == 0) {
+		/* Read-only, so every process can share the pages. */
+		vr->vr_flags |= VRF_CACHED;
+	}
+	vr->vr_vnode = v;
+	vr->vr_fileaddr = vaddr;
+	vr->vr_fileoff = offset;
+	vr->vr_filesize = filesize;
+	return 0;
 }
 
 int
 as_prepare_load(struct addrspace *as)
 {
 	/*
-	 * Write this.
+	 * Nothing to do: load_elf attaches the executable to the new
+	 * segments with as_define_file and vm_fault reads the pages.
 	 */
-
 	(void)as;
 	return 0;
 }
 
+/*
+ * Now that the program's segments are known, start the heap (empty)
+ * at the first page above them.
+ */
 int
 as_complete_load(struct addrspace *as)
 {
-	/*
-	 * Write this.
-	 */
+	struct vm_region *last;
+	unsigned n;
+	vaddr_t base;
+	int result;
 
-	(void)as;
+	KASSERT(as->as_heap == NULL);
+
+	n = vm_regionarray_num(&as->as_regions);
+	base = 0;
+	if (n > 0) {
+		last = vm_regionarray_get(&as->as_regions, n - 1);
+		base = last->vr_base + last->vr_npages * PAGE_SIZE;
+	}
+
+	result = as_addregion(as, base, 0, VR_READ | VR_WRITE, &as->as_heap);
+	if (result) {
+		return result;
+	}
+	as->as_break = base;
+	return 0;
+}
+
+/*
+ * Move the break. The heap region always covers the pages up to the
+ * break, and must not run into the next region up (normally the
+ * stack). Nothing is allocated when growing; the new pages are
+ * zero-filled on first touch like any others. When shrinking, the
+ * pages no longer covered are unmapped and their frames and swap
+ * slots freed immediately, so a process that gives memory back
+ * really gives it back.
+ */
+int
+as_setbreak(struct addrspace *as, vaddr_t newbreak)
+{
+	struct vm_region *heap, *next;
+	vaddr_t oldtop, newtop;
+	unsigned pos, n;
+
+	heap = as->as_heap;
+	if (heap == NULL) {
+		return EINVAL;
+	}
+	if (newbreak < heap->vr_base) {
+		return EINVAL;
+	}
+
+	oldtop = heap->vr_base + heap->vr_npages * PAGE_SIZE;
+	newtop = ROUNDUP(newbreak, PAGE_SIZE);
+	if (newtop < newbreak || newtop > VM_STACKLIMIT - PAGE_SIZE) {
+		/* Leave room for the stack to grow, and its guard page. */
+		return ENOMEM;
+	}
+
+	if (newtop > oldtop) {
+		pos = as_regionindex(as, heap->vr_base);
+		if (pos < vm_regionarray_num(&as->as_regions)) {
+			next = vm_regionarray_get(&as->as_regions, pos);
+			if (newtop > next->vr_base) {
+				return ENOMEM;
+			}
+		}
+	}
+	else if (newtop < oldtop) {
+		/* Drop the TLB entries before the frames can be reused. */
+		vm_tlbunmap(as, newtop, oldtop);
+		n = pt_unmap(as->as_pt, newtop, oldtop);
+		as_addresident(as, -(int)n);
+	}
+
+	heap->vr_npages = (newtop - heap->vr_base) / PAGE_SIZE;
+	as->as_break = newbreak;
 	return 0;
 }
 
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
-	/*
-	 * Write this.
-	 */
+	int result;
 
-	(void)as;
+	KASSERT(as->as_stack == NULL);
+
+	/* One page for now; as_growstack adds more as it's touched. */
+	result = as_addregion(as, USERSTACK - PAGE_SIZE, 1,
+			      VR_READ | VR_WRITE, &as->as_stack);
+	if (result) {
+		return result;
+	}
 
 	/* Initial user-level stack pointer */
 	*stackptr = USERSTACK;
@@ -180,3 +628,199 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+/*
+ * Find room for NPAGES pages of mappings, working down from
+ * VM_MMAPTOP, and return the base address (or 0 if there's no room).
+ */
+static
+vaddr_t
+as_findgap(struct addrspace *as, size_t npages)
+{
+	struct vm_region *prev;
+	vaddr_t top, prevtop, size;
+	unsigned pos;
+
+	size = npages * PAGE_SIZE;
+	top = VM_MMAPTOP;
+	pos = as_regionindex(as, top - 1);
+	for (; pos > 0; pos--) {
+		prev = vm_regionarray_get(&as->as_regions, pos - 1);
+		prevtop = prev->vr_base + prev->vr_npages * PAGE_SIZE;
+		if (prevtop <= top && top - prevtop >= size) {
+			return top - size;
+		}
+		if (prev->vr_base < top) {
+			top = prev->vr_base;
+		}
+	}
+	/* Never map page 0, so null pointers still fault. */
+	if (top >= size + PAGE_SIZE) {
+		return top - size;
+	}
+	return 0;
+}
+
+int
+as_mmap(struct addrspace *as, vaddr_t *addr, size_t len, int perm,
+	int vrf_flags, bool fixed, struct vnode *v, off_t offset)
+{
+	struct vm_region *vr;
+	size_t npages;
+	vaddr_t base;
+	int result;
+
+	if (len == 0 || len > USERSPACETOP) {
+		return EINVAL;
+	}
+	npages = DIVROUNDUP(len, PAGE_SIZE);
+
+	if (fixed) {
+		base = *addr;
+		if ((base & ~(vaddr_t)PAGE_FRAME) != 0 || base == 0 ||
+		    base + npages * PAGE_SIZE < base ||
+		    base + npages * PAGE_SIZE > USERSPACETOP) {
+			return EINVAL;
+		}
+	}
+	else {
+		base = as_findgap(as, npages);
+		if (base == 0) {
+			return ENOMEM;
+		}
+	}
+
+	result = as_addregion(as, base, npages, perm, &vr);
+	if (result) {
+		return result;
+	}
+	vr->vr_flags = vrf_flags | VRF_MMAP;
+	if (v != NULL) {
+		VOP_INCREF(v);
+		vr->vr_vnode = v;
+		vr->vr_fileaddr = base;
+		vr->vr_fileoff = offset;
+		vr->vr_filesize = npages * PAGE_SIZE;
+	}
+
+	*addr = base;
+	return 0;
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t addr, size_t len)
+{
+	struct vm_region *vr;
+	vaddr_t end, top;
+	unsigned pos, first, last;
+	int result;
+
+	if ((addr & ~(vaddr_t)PAGE_FRAME) != 0 || len == 0) {
+		return EINVAL;
+	}
+	end = addr + ROUNDUP(len, PAGE_SIZE);
+	if (end < addr || end > USERSPACETOP) {
+		return EINVAL;
+	}
+
+	/* Find the regions touching the range; all must be removable. */
+	first = as_regionindex(as, addr);
+	if (first > 0) {
+		vr = vm_regionarray_get(&as->as_regions, first - 1);
+		if (vr->vr_base + vr->vr_npages * PAGE_SIZE > addr) {
+			first--;
+		}
+	}
+	last = as_regionindex(as, end - 1);
+	for (pos = first; pos < last; pos++) {
+		vr = vm_regionarray_get(&as->as_regions, pos);
+		top = vr->vr_base + vr->vr_npages * PAGE_SIZE;
+		if ((vr->vr_flags & VRF_MMAP) == 0 ||
+		    vr->vr_base < addr || top > end) {
+			return EINVAL;
+		}
+	}
+
+	/*
+	 * Write everything back before removing anything, so a failed
+	 * write leaves the whole range mapped for the caller to retry.
+	 */
+	for (pos = first; pos < last; pos++) {
+		vr = vm_regionarray_get(&as->as_regions, pos);
+		if (vr->vr_flags & VRF_SHARED) {
+			result = as_syncregion(as, vr, vr->vr_base,
+				vr->vr_base + vr->vr_npages * PAGE_SIZE);
+			if (result) {
+				return result;
+			}
+		}
+	}
+
+	for (pos = last; pos-- > first; ) {
+		as_removeregion(as, pos);
+	}
+	return 0;
+}
+
+int
+as_msync(struct addrspace *as, vaddr_t addr, size_t len)
+{
+	struct vm_region *vr;
+	vaddr_t end, top, at;
+	unsigned pos, first, last;
+	int result, ret;
+
+	if ((addr & ~(vaddr_t)PAGE_FRAME) != 0) {
+		return EINVAL;
+	}
+	end = addr + ROUNDUP(len, PAGE_SIZE);
+	if (end < addr || end > USERSPACETOP) {
+		return ENOMEM;
+	}
+
+	/* Find the regions touching the range; there must be no gaps. */
+	first = as_regionindex(as, addr);
+	if (first > 0) {
+		vr = vm_regionarray_get(&as->as_regions, first - 1);
+		if (vr->vr_base + vr->vr_npages * PAGE_SIZE > addr) {
+			first--;
+		}
+	}
+	last = as_regionindex(as, end - 1);
+	at = addr;
+	for (pos = first; pos < last; pos++) {
+		vr = vm_regionarray_get(&as->as_regions, pos);
+		if (vr->vr_base > at) {
+			return ENOMEM;
+		}
+		at = vr->vr_base + vr->vr_npages * PAGE_SIZE;
+	}
+	if (at < end) {
+		return ENOMEM;
+	}
+
+	/* Keep going past a failed write; report the first error. */
+	ret = 0;
+	for (pos = first; pos < last; pos++) {
+		vr = vm_regionarray_get(&as->as_regions, pos);
+		if ((vr->vr_flags & VRF_SHARED) == 0) {
+			continue;
+		}
+		top = vr->vr_base + vr->vr_npages * PAGE_SIZE;
+		result = as_syncregion(as, vr,
+				       vr->vr_base < addr ? addr : vr->vr_base,
+				       top > end ? end : top);
+		if (result && ret == 0) {
+			ret = result;
+		}
+	}
+	return ret;
+}
+
+void
+as_addresident(struct addrspace *as, int delta)
+{
+	spinlock_acquire(&as->as_reslock);
+	KASSERT(delta >= 0 || as->as_resident >= (unsigned)-delta);
+	as->as_resident += delta;
+	spinlock_release(&as->as_reslock);
+}
@@ -0,0 +1,1174 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Physical page allocator. See coremap.h for the overview.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <cpu.h>
+#include <current.h>
+#include <vm.h>
+#include <coremap.h>
+#include <platform/maxcpus.h>
+
+/*
+ * One spinlock protects the whole coremap. (It has to be a spinlock
+ * rather than a sleep lock because the coremap is needed in contexts
+ * that cannot sleep, such as the TLB fault path.)
+ */
+static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+
+static struct coremap_entry *coremap;	/* NULL until bootstrap */
+static unsigned coremap_npages;		/* total pages of RAM */
+static unsigned coremap_base;		/* first page we manage */
+static unsigned coremap_nused;		/* pages not on the free list */
+static uint32_t coremap_freehead;	/* head of the free list */
+static uint32_t coremap_clockhand;	/* next page the clock looks at */
+static struct wchan *coremap_wchan;	/* for waiting on busy pages */
+
+/* Eviction statistics */
+static unsigned coremap_clocksteps;	/* pages examined by the clock */
+static unsigned coremap_victims;	/* pages chosen for eviction */
+
+/*
+ * All the per-cpu magazines, so they can be drained when the global
+ * free list runs dry and summed for coremap_used_bytes. Cpus are
+ * only ever added (by cpu_create), never removed.
+ */
+static struct pagecache *pagecaches[MAXCPUS];
+static unsigned npagecaches;
+
+/*
+ * The zero pool. Like the magazines, pages in it are counted in
+ * coremap_nused and subtracted back out by coremap_used_bytes.
+ * Protected by the coremap lock.
+ */
+static uint32_t zeropool[ZEROPOOL_SIZE];
+static unsigned zeropool_count;
+static unsigned zeropool_hits;		/* allocs served from the pool */
+static unsigned zeropool_misses;	/* allocs that had to bzero */
+static unsigned zeropool_fills;		/* pages zeroed while idle */
+
+/*
+ * Put page PN at the head of the free list.
+ */
+static
+void
+coremap_freelist_push(uint32_t pn)
+{
+	struct coremap_entry *cme = &coremap[pn];
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	cme->cme_state = CM_FREE;
+	cme->cme_npages = 0;
+	cme->cme_refcount = 0;
+	cme->cme_flags = 0;
+	cme->cme_as = NULL;
+	cme->cme_va = 0;
+	cme->cme_prev = CM_NONE;
+	cme->cme_next = coremap_freehead;
+	if (coremap_freehead != CM_NONE) {
+		coremap[coremap_freehead].cme_prev = pn;
+	}
+	coremap_freehead = pn;
+}
+
+/*
+ * Unlink page PN from wherever it is on the free list.
+ */
+static
+void
+coremap_freelist_remove(uint32_t pn)
+{
+	struct coremap_entry *cme = &coremap[pn];
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(cme->cme_state == CM_FREE);
+
+	if (cme->cme_prev != CM_NONE) {
+		coremap[cme->cme_prev].cme_next = cme->cme_next;
+	}
+	else {
+		KASSERT(coremap_freehead == pn);
+		coremap_freehead = cme->cme_next;
+	}
+	if (cme->cme_next != CM_NONE) {
+		coremap[cme->cme_next].cme_prev = cme->cme_prev;
+	}
+	cme->cme_next = cme->cme_prev = CM_NONE;
+}
+
+/*
+ * Take over physical memory. Called once from vm_bootstrap.
+ *
+ * The coremap itself is allocated with ram_stealmem, so it ends up
+ * below the first free address and is accounted as CM_FIXED along
+ * with the kernel image.
+ */
+void
+coremap_bootstrap(void)
+{
+	paddr_t lastpaddr, firstpaddr, cmpaddr;
+	size_t cmsize;
+	uint32_t i;
+
+	KASSERT(coremap == NULL);
+
+	lastpaddr = ram_getsize();
+	coremap_npages = lastpaddr / PAGE_SIZE;
+	cmsize = coremap_npages * sizeof(struct coremap_entry);
+
+	spinlock_acquire(&coremap_lock);
+
+	cmpaddr = ram_stealmem(DIVROUNDUP(cmsize, PAGE_SIZE));
+	if (cmpaddr == 0) {
+		panic("coremap_bootstrap: no memory for the coremap\n");
+	}
+	firstpaddr = ram_getfirstfree();
+	KASSERT((firstpaddr & PAGE_FRAME) == firstpaddr);
+
+	coremap = (struct coremap_entry *)PADDR_TO_KVADDR(cmpaddr);
+	coremap_base = firstpaddr / PAGE_SIZE;
+	coremap_freehead = CM_NONE;
+	coremap_clockhand = coremap_base;
+
+	for (i=0; i<coremap_base; i++) {
+		coremap[i].cme_next = coremap[i].cme_prev = CM_NONE;
+		coremap[i].cme_npages = 0;
+		coremap[i].cme_refcount = 0;
+		coremap[i].cme_state = CM_FIXED;
+		coremap[i].cme_flags = 0;
+		coremap[i].cme_as = NULL;
+		coremap[i].cme_va = 0;
+	}
+	coremap_nused = coremap_base;
+
+	/* Push in descending order so the list comes out ascending. */
+	for (i=coremap_npages; i-- > coremap_base; ) {
+		coremap_freelist_push(i);
+	}
+
+	spinlock_release(&coremap_lock);
+
+	coremap_wchan = wchan_create("coremap");
+	if (coremap_wchan == NULL) {
+		panic("coremap_bootstrap: Out of memory\n");
+	}
+
+	kprintf("coremap: %u pages, %u free, %zu bytes of coremap\n",
+		coremap_npages, coremap_npages - coremap_nused, cmsize);
+}
+
+/*
+ * Find NPAGES contiguous free pages, first fit. Returns the first
+ * page number or CM_NONE.
+ *
+ * This is a linear scan, but multi-page allocations are rare (most
+ * kernel allocations, including thread stacks, are a single page)
+ * so that's acceptable.
+ */
+static
+uint32_t
+coremap_findrun(unsigned npages)
+{
+	uint32_t pn, run;
+
+	run = 0;
+	for (pn = coremap_base; pn < coremap_npages; pn++) {
+		if (coremap[pn].cme_state != CM_FREE) {
+			run = 0;
+			continue;
+		}
+		run++;
+		if (run == npages) {
+			return pn + 1 - npages;
+		}
+	}
+	return CM_NONE;
+}
+
+/*
+ * Take pages for a multi-page allocation, or for a single page when
+ * the local magazine can't help. Returns the first page number or
+ * CM_NONE. Called with the coremap lock held.
+ */
+static
+uint32_t
+coremap_take(unsigned npages)
+{
+	uint32_t pn, i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	if (npages > 0xffff || npages > coremap_npages - coremap_nused) {
+		return CM_NONE;
+	}
+
+	if (npages == 1) {
+		pn = coremap_freehead;
+	}
+	else {
+		pn = coremap_findrun(npages);
+	}
+	if (pn == CM_NONE) {
+		return CM_NONE;
+	}
+
+	for (i=0; i<npages; i++) {
+		coremap_freelist_remove(pn + i);
+		coremap[pn + i].cme_state = CM_KERNEL;
+		coremap[pn + i].cme_npages = 0;
+	}
+	coremap[pn].cme_npages = npages;
+	coremap[pn].cme_refcount = 1;
+	coremap_nused += npages;
+
+	return pn;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Per-cpu magazines
+
+void
+pagecache_init(struct pagecache *pc)
+{
+	spinlock_init(&pc->pc_lock);
+	pc->pc_count = 0;
+	pc->pc_hits = 0;
+	pc->pc_misses = 0;
+	pc->pc_frees = 0;
+	pc->pc_refills = 0;
+	pc->pc_drains = 0;
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(npagecaches < MAXCPUS);
+	pagecaches[npagecaches++] = pc;
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Move up to PAGECACHE_BATCH pages from the free list into PC.
+ * Pages in a magazine stay counted in coremap_nused; coremap_used_bytes
+ * subtracts them back out.
+ */
+static
+void
+pagecache_refill(struct pagecache *pc)
+{
+	uint32_t pn;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&pc->pc_lock));
+
+	spinlock_acquire(&coremap_lock);
+	for (i=0; i<PAGECACHE_BATCH && pc->pc_count < PAGECACHE_SIZE; i++) {
+		pn = coremap_freehead;
+		if (pn == CM_NONE) {
+			break;
+		}
+		coremap_freelist_remove(pn);
+		coremap[pn].cme_state = CM_CACHED;
+		coremap_nused++;
+		pc->pc_pages[pc->pc_count++] = pn;
+	}
+	spinlock_release(&coremap_lock);
+
+	if (i > 0) {
+		pc->pc_refills++;
+	}
+}
+
+/*
+ * Give up to NPAGES pages from PC back to the free list. Returns the
+ * number given back.
+ */
+static
+unsigned
+pagecache_drain(struct pagecache *pc, unsigned npages)
+{
+	uint32_t pn;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&pc->pc_lock));
+
+	spinlock_acquire(&coremap_lock);
+	for (i=0; i<npages && pc->pc_count > 0; i++) {
+		pn = pc->pc_pages[--pc->pc_count];
+		KASSERT(coremap[pn].cme_state == CM_CACHED);
+		coremap_freelist_push(pn);
+		KASSERT(coremap_nused > 0);
+		coremap_nused--;
+	}
+	spinlock_release(&coremap_lock);
+
+	if (i > 0) {
+		pc->pc_drains++;
+	}
+	return i;
+}
+
+/*
+ * Empty every cpu's magazine into the free list. Used when an
+ * allocation can't be satisfied otherwise. Returns the number of
+ * pages recovered.
+ */
+static
+unsigned
+pagecache_drainall(void)
+{
+	unsigned i, n, total;
+
+	spinlock_acquire(&coremap_lock);
+	n = npagecaches;
+	spinlock_release(&coremap_lock);
+
+	total = 0;
+	for (i=0; i<n; i++) {
+		spinlock_acquire(&pagecaches[i]->pc_lock);
+		total += pagecache_drain(pagecaches[i], PAGECACHE_SIZE);
+		spinlock_release(&pagecaches[i]->pc_lock);
+	}
+	return total;
+}
+
+/*
+ * Try to allocate one page from the current cpu's magazine.
+ *
+ * The thread may migrate between looking up curcpu and taking the
+ * lock, in which case we use another cpu's magazine. That's still
+ * correct, just not local.
+ */
+static
+uint32_t
+pagecache_alloc(void)
+{
+	struct pagecache *pc;
+	uint32_t pn;
+
+	pc = &curcpu->c_pagecache;
+	spinlock_acquire(&pc->pc_lock);
+	if (pc->pc_count == 0) {
+		pc->pc_misses++;
+		pagecache_refill(pc);
+		if (pc->pc_count == 0) {
+			spinlock_release(&pc->pc_lock);
+			return CM_NONE;
+		}
+	}
+	else {
+		pc->pc_hits++;
+	}
+	pn = pc->pc_pages[--pc->pc_count];
+
+	/*
+	 * Cached and allocated are both non-free states, and nobody
+	 * but us can be looking at this page, so the state change
+	 * doesn't need the coremap lock.
+	 */
+	KASSERT(coremap[pn].cme_state == CM_CACHED);
+	coremap[pn].cme_state = CM_KERNEL;
+	coremap[pn].cme_npages = 1;
+	coremap[pn].cme_refcount = 1;
+	spinlock_release(&pc->pc_lock);
+
+	return pn;
+}
+
+/*
+ * Return a single page to the current cpu's magazine, draining a
+ * batch first if it's full.
+ */
+static
+void
+pagecache_free(uint32_t pn)
+{
+	struct pagecache *pc;
+
+	pc = &curcpu->c_pagecache;
+	spinlock_acquire(&pc->pc_lock);
+	if (pc->pc_count == PAGECACHE_SIZE) {
+		pagecache_drain(pc, PAGECACHE_BATCH);
+	}
+	coremap[pn].cme_state = CM_CACHED;
+	coremap[pn].cme_npages = 0;
+	coremap[pn].cme_refcount = 0;
+	pc->pc_pages[pc->pc_count++] = pn;
+	pc->pc_frees++;
+	spinlock_release(&pc->pc_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Zero pool
+
+/*
+ * Give the whole zero pool back to the free list. Returns the number
+ * of pages.
+ */
+static
+unsigned
+zeropool_drain(void)
+{
+	unsigned n;
+
+	spinlock_acquire(&coremap_lock);
+	n = zeropool_count;
+	while (zeropool_count > 0) {
+		coremap_freelist_push(zeropool[--zeropool_count]);
+		KASSERT(coremap_nused > 0);
+		coremap_nused--;
+	}
+	spinlock_release(&coremap_lock);
+	return n;
+}
+
+/*
+ * Zero one page for the pool, if it isn't full and there's memory to
+ * spare. The page is taken off the free list first so we can zero it
+ * without the lock; interrupts are off when we're called from the
+ * idle loop, so only do one page per call to keep that short.
+ */
+bool
+coremap_zerofill(void)
+{
+	uint32_t pn;
+
+	if (coremap == NULL) {
+		return false;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	if (zeropool_count >= ZEROPOOL_SIZE ||
+	    coremap_npages - coremap_nused <= ZEROPOOL_SIZE) {
+		spinlock_release(&coremap_lock);
+		return false;
+	}
+	pn = coremap_take(1);
+	spinlock_release(&coremap_lock);
+	if (pn == CM_NONE) {
+		return false;
+	}
+
+	bzero((void *)PADDR_TO_KVADDR((paddr_t)pn * PAGE_SIZE), PAGE_SIZE);
+
+	spinlock_acquire(&coremap_lock);
+	if (zeropool_count < ZEROPOOL_SIZE) {
+		coremap[pn].cme_state = CM_ZEROED;
+		coremap[pn].cme_npages = 0;
+		coremap[pn].cme_refcount = 0;
+		zeropool[zeropool_count++] = pn;
+		zeropool_fills++;
+	}
+	else {
+		/* Someone else filled it meanwhile. */
+		coremap_freelist_push(pn);
+		coremap_nused--;
+	}
+	spinlock_release(&coremap_lock);
+	return true;
+}
+
+paddr_t
+coremap_alloc_zeroed(void)
+{
+	paddr_t pa;
+	uint32_t pn;
+
+	pn = CM_NONE;
+	if (coremap != NULL) {
+		spinlock_acquire(&coremap_lock);
+		if (zeropool_count > 0) {
+			pn = zeropool[--zeropool_count];
+			KASSERT(coremap[pn].cme_state == CM_ZEROED);
+			coremap[pn].cme_state = CM_KERNEL;
+			coremap[pn].cme_npages = 1;
+			coremap[pn].cme_refcount = 1;
+			zeropool_hits++;
+		}
+		else {
+			zeropool_misses++;
+		}
+		spinlock_release(&coremap_lock);
+	}
+	if (pn != CM_NONE) {
+		return (paddr_t)pn * PAGE_SIZE;
+	}
+
+	pa = coremap_alloc(1);
+	if (pa != 0) {
+		bzero((void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
+	}
+	return pa;
+}
+
+////////////////////////////////////////////////////////////
+
+paddr_t
+coremap_alloc(unsigned npages)
+{
+	paddr_t pa;
+	uint32_t pn;
+
+	KASSERT(npages > 0);
+
+	if (coremap == NULL) {
+		/* Too early; steal it. This can never be given back. */
+		spinlock_acquire(&coremap_lock);
+		pa = ram_stealmem(npages);
+		spinlock_release(&coremap_lock);
+		return pa;
+	}
+
+	if (npages == 1 && CURCPU_EXISTS()) {
+		pn = pagecache_alloc();
+		if (pn != CM_NONE) {
+			return (paddr_t)pn * PAGE_SIZE;
+		}
+	}
+
+	spinlock_acquire(&coremap_lock);
+	pn = coremap_take(npages);
+	spinlock_release(&coremap_lock);
+
+	if (pn == CM_NONE) {
+		/* Pull back whatever is sitting in magazines and retry. */
+		pagecache_drainall();
+		zeropool_drain();
+		spinlock_acquire(&coremap_lock);
+		pn = coremap_take(npages);
+		spinlock_release(&coremap_lock);
+		if (pn == CM_NONE) {
+			return 0;
+		}
+	}
+
+	return (paddr_t)pn * PAGE_SIZE;
+}
+
+void
+coremap_free(paddr_t pa)
+{
+	uint32_t pn, i, npages;
+
+	KASSERT((pa & PAGE_FRAME) == pa);
+
+	if (coremap == NULL) {
+		/* Stolen memory; nothing we can do with it. */
+		return;
+	}
+
+	pn = pa / PAGE_SIZE;
+	KASSERT(pn < coremap_npages);
+
+	if (coremap[pn].cme_state == CM_FIXED) {
+		/* Allocated before bootstrap; leak it as before. */
+		return;
+	}
+
+	if ((coremap[pn].cme_state != CM_KERNEL &&
+	     coremap[pn].cme_state != CM_USER) ||
+	    coremap[pn].cme_npages == 0) {
+		panic("coremap_free: bad free of 0x%x\n", pa);
+	}
+	KASSERT(coremap[pn].cme_refcount == 1);
+
+	if (coremap[pn].cme_state == CM_USER) {
+		/*
+		 * Forget the owner and wake anyone waiting for the
+		 * page; they'll find their PTE has changed.
+		 */
+		spinlock_acquire(&coremap_lock);
+		if (coremap[pn].cme_flags & CMF_BUSY) {
+			wchan_wakeall(coremap_wchan, &coremap_lock);
+		}
+		coremap[pn].cme_state = CM_KERNEL;
+		coremap[pn].cme_flags = 0;
+		coremap[pn].cme_as = NULL;
+		coremap[pn].cme_va = 0;
+		spinlock_release(&coremap_lock);
+	}
+
+	npages = coremap[pn].cme_npages;
+	if (npages == 1 && CURCPU_EXISTS()) {
+		pagecache_free(pn);
+		return;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(pn + npages <= coremap_npages);
+	for (i=npages; i-- > 0; ) {
+		KASSERT(coremap[pn + i].cme_state == CM_KERNEL);
+		coremap_freelist_push(pn + i);
+	}
+	KASSERT(coremap_nused >= npages);
+	coremap_nused -= npages;
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Reference counting for shared (copy-on-write) user frames.
+ */
+void
+coremap_incref(paddr_t pa)
+{
+	uint32_t pn;
+
+	KASSERT((pa & PAGE_FRAME) == pa);
+	pn = pa / PAGE_SIZE;
+	KASSERT(coremap != NULL && pn < coremap_npages);
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap[pn].cme_state == CM_USER);
+	KASSERT(coremap[pn].cme_npages == 1);
+	KASSERT(coremap[pn].cme_refcount > 0);
+	if (coremap[pn].cme_refcount == 0xffff) {
+		panic("coremap_incref: too many references to 0x%x\n", pa);
+	}
+	coremap[pn].cme_refcount++;
+	/* Shared, so no longer has a single owner. */
+	coremap[pn].cme_as = NULL;
+	coremap[pn].cme_va = 0;
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_decref(paddr_t pa)
+{
+	uint32_t pn;
+	bool last;
+
+	KASSERT((pa & PAGE_FRAME) == pa);
+	pn = pa / PAGE_SIZE;
+	KASSERT(coremap != NULL && pn < coremap_npages);
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap[pn].cme_state == CM_USER);
+	KASSERT(coremap[pn].cme_flags & CMF_BUSY);
+	KASSERT(coremap[pn].cme_refcount > 0);
+	last = coremap[pn].cme_refcount == 1;
+	if (!last) {
+		coremap[pn].cme_refcount--;
+		coremap[pn].cme_flags &= ~CMF_BUSY;
+		wchan_wakeall(coremap_wchan, &coremap_lock);
+	}
+	spinlock_release(&coremap_lock);
+
+	/*
+	 * If this was the last reference nobody else can get at the
+	 * page (and we still have it pinned), so it's safe to drop
+	 * the lock before freeing it.
+	 */
+	if (last) {
+		coremap_free(pa);
+	}
+}
+
+unsigned
+coremap_refcount(paddr_t pa)
+{
+	uint32_t pn;
+	unsigned ret;
+
+	KASSERT((pa & PAGE_FRAME) == pa);
+	pn = pa / PAGE_SIZE;
+	KASSERT(coremap != NULL && pn < coremap_npages);
+
+	spinlock_acquire(&coremap_lock);
+	ret = coremap[pn].cme_refcount;
+	spinlock_release(&coremap_lock);
+
+	return ret;
+}
+
+/*
+ * Reclaim source: give back the pages parked in the magazines and
+ * the zero pool.
+ */
+unsigned
+coremap_drain(void)
+{
+	if (coremap == NULL) {
+		return 0;
+	}
+	return pagecache_drainall() + zeropool_drain();
+}
+
+/*
+ * Number of pages on the global free list (not counting magazines).
+ */
+unsigned
+coremap_nfree(void)
+{
+	unsigned ret;
+
+	spinlock_acquire(&coremap_lock);
+	ret = coremap_npages - coremap_nused;
+	spinlock_release(&coremap_lock);
+	return ret;
+}
+
+/*
+ * Total number of pages the clock hand has looked at.
+ */
+unsigned
+coremap_clockscans(void)
+{
+	unsigned ret;
+
+	spinlock_acquire(&coremap_lock);
+	ret = coremap_clocksteps;
+	spinlock_release(&coremap_lock);
+	return ret;
+}
+
+////////////////////////////////////////////////////////////
+//
+// User pages
+
+void
+coremap_setuser(paddr_t pa, struct addrspace *as, vaddr_t va)
+{
+	uint32_t pn;
+
+	KASSERT((pa & PAGE_FRAME) == pa);
+	pn = pa / PAGE_SIZE;
+	KASSERT(coremap != NULL && pn < coremap_npages);
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap[pn].cme_npages == 1);
+	KASSERT(coremap[pn].cme_refcount == 1);
+	if (coremap[pn].cme_state == CM_KERNEL) {
+		/* Fresh from coremap_alloc. */
+		coremap[pn].cme_state = CM_USER;
+		coremap[pn].cme_flags = CMF_BUSY | CMF_REFERENCED;
+	}
+	KASSERT(coremap[pn].cme_state == CM_USER);
+	KASSERT(coremap[pn].cme_flags & CMF_BUSY);
+	coremap[pn].cme_as = as;
+	coremap[pn].cme_va = va;
+	spinlock_release(&coremap_lock);
+}
+
+bool
+coremap_pin(const pte_t *pte)
+{
+	pte_t val;
+	uint32_t pn;
+
+	KASSERT(coremap != NULL);
+
+	spinlock_acquire(&coremap_lock);
+	while (1) {
+		/*
+		 * Changes to a PTE that maps a resident page are only
+		 * made with that page pinned, so once we have it
+		 * pinned the PTE is stable.
+		 */
+		val = *pte;
+		if ((val & PTE_VALID) == 0) {
+			spinlock_release(&coremap_lock);
+			return false;
+		}
+		pn = (val & PTE_FRAME) / PAGE_SIZE;
+		KASSERT(pn < coremap_npages);
+		KASSERT(coremap[pn].cme_state == CM_USER);
+		if ((coremap[pn].cme_flags & CMF_BUSY) == 0) {
+			break;
+		}
+		wchan_sleep(coremap_wchan, &coremap_lock);
+	}
+	coremap[pn].cme_flags |= CMF_BUSY | CMF_REFERENCED;
+	spinlock_release(&coremap_lock);
+	return true;
+}
+
+void
+coremap_pinpage(paddr_t pa)
+{
+	uint32_t pn;
+
+	KASSERT((pa & PAGE_FRAME) == pa);
+	pn = pa / PAGE_SIZE;
+	KASSERT(coremap != NULL && pn < coremap_npages);
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap[pn].cme_state == CM_USER);
+	while (coremap[pn].cme_flags & CMF_BUSY) {
+		wchan_sleep(coremap_wchan, &coremap_lock);
+	}
+	coremap[pn].cme_flags |= CMF_BUSY;
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_unpin(paddr_t pa)
+{
+	uint32_t pn;
+
+	KASSERT((pa & PAGE_FRAME) == pa);
+	pn = pa / PAGE_SIZE;
+	KASSERT(coremap != NULL && pn < coremap_npages);
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap[pn].cme_state == CM_USER);
+	KASSERT(coremap[pn].cme_flags & CMF_BUSY);
+	coremap[pn].cme_flags &= ~CMF_BUSY;
+	wchan_wakeall(coremap_wchan, &coremap_lock);
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Pin the user page at PA if nobody else has it pinned, without
+ * waiting. On success, returns its owner (NULL if shared) and
+ * reference count.
+ */
+bool
+coremap_trypin(paddr_t pa, struct addrspace **as, vaddr_t *va,
+	       unsigned *refcount)
+{
+	struct coremap_entry *cme;
+	uint32_t pn;
+
+	KASSERT((pa & PAGE_FRAME) == pa);
+	pn = pa / PAGE_SIZE;
+	KASSERT(coremap != NULL && pn < coremap_npages);
+	cme = &coremap[pn];
+
+	spinlock_acquire(&coremap_lock);
+	if (cme->cme_state != CM_USER || (cme->cme_flags & CMF_BUSY)) {
+		spinlock_release(&coremap_lock);
+		return false;
+	}
+	cme->cme_flags |= CMF_BUSY;
+	*as = cme->cme_as;
+	*va = cme->cme_va;
+	*refcount = cme->cme_refcount;
+	spinlock_release(&coremap_lock);
+	return true;
+}
+
+/*
+ * Return the reference count of PA if it's a user page, else 0. Only
+ * a hint.
+ */
+unsigned
+coremap_userrefs(paddr_t pa)
+{
+	uint32_t pn;
+	unsigned ret;
+
+	KASSERT((pa & PAGE_FRAME) == pa);
+	pn = pa / PAGE_SIZE;
+	KASSERT(coremap != NULL && pn < coremap_npages);
+
+	spinlock_acquire(&coremap_lock);
+	ret = coremap[pn].cme_state == CM_USER ? coremap[pn].cme_refcount : 0;
+	spinlock_release(&coremap_lock);
+	return ret;
+}
+
+/*
+ * Note that the pinned user page PA holds merged contents (see
+ * ksm.c), for coremap_mergestats.
+ */
+void
+coremap_markmerged(paddr_t pa)
+{
+	uint32_t pn;
+
+	KASSERT((pa & PAGE_FRAME) == pa);
+	pn = pa / PAGE_SIZE;
+	KASSERT(coremap != NULL && pn < coremap_npages);
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap[pn].cme_state == CM_USER);
+	KASSERT(coremap[pn].cme_flags & CMF_BUSY);
+	coremap[pn].cme_flags |= CMF_MERGED;
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_marknomerge(paddr_t pa)
+{
+	uint32_t pn;
+
+	KASSERT((pa & PAGE_FRAME) == pa);
+	pn = pa / PAGE_SIZE;
+	KASSERT(coremap != NULL && pn < coremap_npages);
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap[pn].cme_state == CM_USER);
+	KASSERT(coremap[pn].cme_flags & CMF_BUSY);
+	coremap[pn].cme_flags |= CMF_NOMERGE;
+	spinlock_release(&coremap_lock);
+}
+
+bool
+coremap_canmerge(paddr_t pa)
+{
+	struct coremap_entry *cme;
+	uint32_t pn;
+	bool ret;
+
+	KASSERT((pa & PAGE_FRAME) == pa);
+	pn = pa / PAGE_SIZE;
+	KASSERT(coremap != NULL && pn < coremap_npages);
+	cme = &coremap[pn];
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(cme->cme_state == CM_USER);
+	KASSERT(cme->cme_flags & CMF_BUSY);
+	if (cme->cme_flags & (CMF_NOMERGE | CMF_DIRTY)) {
+		ret = false;
+	}
+	else if (cme->cme_as != NULL) {
+		ret = cme->cme_refcount == 1;
+	}
+	else {
+		ret = (cme->cme_flags & CMF_MERGED) != 0;
+	}
+	spinlock_release(&coremap_lock);
+	return ret;
+}
+
+void
+coremap_setdirty(paddr_t pa, bool dirty)
+{
+	uint32_t pn;
+
+	KASSERT((pa & PAGE_FRAME) == pa);
+	pn = pa / PAGE_SIZE;
+	KASSERT(coremap != NULL && pn < coremap_npages);
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap[pn].cme_state == CM_USER);
+	KASSERT(coremap[pn].cme_flags & CMF_BUSY);
+	if (dirty) {
+		coremap[pn].cme_flags |= CMF_DIRTY;
+	}
+	else {
+		coremap[pn].cme_flags &= ~CMF_DIRTY;
+	}
+	spinlock_release(&coremap_lock);
+}
+
+bool
+coremap_isdirty(paddr_t pa)
+{
+	uint32_t pn;
+	bool ret;
+
+	KASSERT((pa & PAGE_FRAME) == pa);
+	pn = pa / PAGE_SIZE;
+	KASSERT(coremap != NULL && pn < coremap_npages);
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap[pn].cme_state == CM_USER);
+	KASSERT(coremap[pn].cme_flags & CMF_BUSY);
+	ret = (coremap[pn].cme_flags & CMF_DIRTY) != 0;
+	spinlock_release(&coremap_lock);
+	return ret;
+}
+
+/*
+ * Count the merged pages still shared, and how many page frames the
+ * sharing is saving.
+ */
+void
+coremap_mergestats(unsigned *frames, unsigned *saved)
+{
+	uint32_t pn;
+
+	*frames = *saved = 0;
+	if (coremap == NULL) {
+		return;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	for (pn = coremap_base; pn < coremap_npages; pn++) {
+		if (coremap[pn].cme_state == CM_USER &&
+		    (coremap[pn].cme_flags & CMF_MERGED) &&
+		    coremap[pn].cme_refcount > 1) {
+			(*frames)++;
+			*saved += coremap[pn].cme_refcount - 1;
+		}
+	}
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Return the number of pages of RAM, i.e. one past the highest page
+ * number.
+ */
+unsigned
+coremap_totalpages(void)
+{
+	return coremap_npages;
+}
+
+/*
+ * Clock (second-chance) replacement. The hand sweeps the coremap;
+ * a page that has been referenced since the last sweep has its
+ * reference bit cleared and is passed over, and the first evictable
+ * page without it is chosen. Two full sweeps are enough to find a
+ * victim if there is one.
+ *
+ * There is no hardware reference bit on MIPS; CMF_REFERENCED is set
+ * when a page is faulted into the TLB (see coremap_pin).
+ */
+paddr_t
+coremap_pickvictim(struct addrspace **as, vaddr_t *va)
+{
+	struct coremap_entry *cme;
+	unsigned steps, maxsteps;
+	uint32_t pn;
+
+	KASSERT(coremap != NULL);
+
+	spinlock_acquire(&coremap_lock);
+	maxsteps = 2 * (coremap_npages - coremap_base);
+	for (steps = 0; steps < maxsteps; steps++) {
+		pn = coremap_clockhand++;
+		if (coremap_clockhand == coremap_npages) {
+			coremap_clockhand = coremap_base;
+		}
+		cme = &coremap[pn];
+		if (cme->cme_state != CM_USER ||
+		    (cme->cme_flags & CMF_BUSY) ||
+		    cme->cme_refcount != 1 ||
+		    cme->cme_as == NULL) {
+			continue;
+		}
+		if (cme->cme_flags & CMF_REFERENCED) {
+			cme->cme_flags &= ~CMF_REFERENCED;
+			continue;
+		}
+		cme->cme_flags |= CMF_BUSY;
+		*as = cme->cme_as;
+		*va = cme->cme_va;
+		coremap_clocksteps += steps + 1;
+		coremap_victims++;
+		spinlock_release(&coremap_lock);
+		return (paddr_t)pn * PAGE_SIZE;
+	}
+	coremap_clocksteps += steps;
+	spinlock_release(&coremap_lock);
+	return 0;
+}
+
+/*
+ * Return the number of bytes of physical memory in use. This
+ * includes the kernel image and other fixed allocations, but not
+ * pages sitting free in the per-cpu magazines.
+ *
+ * Take all the magazine locks (in order, before the coremap lock) so
+ * the answer is a consistent snapshot.
+ */
+unsigned
+int
+coremap_used_bytes(void)
+{
+	unsigned i, n, used;
+
+	spinlock_acquire(&coremap_lock);
+	n = npagecaches;
+	spinlock_release(&coremap_lock);
+
+	for (i=0; i<n; i++) {
+		spinlock_acquire(&pagecaches[i]->pc_lock);
+	}
+	spinlock_acquire(&coremap_lock);
+
+	used = coremap_nused;
+	KASSERT(used >= zeropool_count);
+	used -= zeropool_count;
+	for (i=0; i<n; i++) {
+		KASSERT(used >= pagecaches[i]->pc_count);
+		used -= pagecaches[i]->pc_count;
+	}
+
+	spinlock_release(&coremap_lock);
+	for (i=n; i-- > 0; ) {
+		spinlock_release(&pagecaches[i]->pc_lock);
+	}
+
+	return used * PAGE_SIZE;
+}
+
+/*
+ * Print page counts and per-cpu magazine statistics.
+ */
+void
+coremap_printstats(void)
+{
+	struct pagecache *pc;
+	unsigned i, n, total, used, steps, victims;
+	unsigned zcount, zhits, zmisses, zfills;
+	unsigned long lookups;
+
+	spinlock_acquire(&coremap_lock);
+	total = coremap_npages;
+	n = npagecaches;
+	steps = coremap_clocksteps;
+	victims = coremap_victims;
+	zcount = zeropool_count;
+	zhits = zeropool_hits;
+	zmisses = zeropool_misses;
+	zfills = zeropool_fills;
+	spinlock_release(&coremap_lock);
+
+	used = coremap_used_bytes() / PAGE_SIZE;
+	kprintf("coremap: %u pages, %u used, %u free\n",
+		total, used, total - used);
+	kprintf("coremap: clock chose %u victims in %u steps\n",
+		victims, steps);
+	kprintf("coremap: zero pool %u/%u pages, %u hits, %u misses, "
+		"%u zeroed while idle\n", zcount, ZEROPOOL_SIZE,
+		zhits, zmisses, zfills);
+
+	for (i=0; i<n; i++) {
+		pc = pagecaches[i];
+		spinlock_acquire(&pc->pc_lock);
+		lookups = (unsigned long)pc->pc_hits + pc->pc_misses;
+		kprintf("pagecache %u: %u cached, %u hits, %u misses "
+			"(%lu%% hit), %u frees, %u refills, %u drains\n",
+			i, pc->pc_count, pc->pc_hits, pc->pc_misses,
+			lookups ? (unsigned long)pc->pc_hits * 100 / lookups
+				: 0UL,
+			pc->pc_frees, pc->pc_refills, pc->pc_drains);
+		spinlock_release(&pc->pc_lock);
+	}
+}
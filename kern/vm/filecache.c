@@ -0,0 +1,364 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Shared file pages. See filecache.h.
+ *
+ * Each vnode with cached pages has a small hash table of them, keyed
+ * by page number within the file. All the tables are on one list so
+ * the reclaim source and the statistics can find them. A single
+ * spinlock covers everything; nothing here takes long, and page
+ * contents are read in by the caller before insertion.
+ *
+ * Lock order: filecache_lock, then the coremap lock.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vnode.h>
+#include <vm.h>
+#include <coremap.h>
+#include <reclaim.h>
+#include <filecache.h>
+
+#define FC_NBUCKETS	32
+
+struct fcpage {
+	off_t fp_offset;		/* file offset of first file byte */
+	unsigned fp_skip;		/* where in the page it goes */
+	unsigned fp_len;		/* bytes of file data */
+	paddr_t fp_pa;			/* the frame */
+	struct fcpage *fp_next;		/* next in hash bucket */
+};
+
+struct filecache {
+	struct vnode *fc_vnode;
+	struct fcpage *fc_buckets[FC_NBUCKETS];
+	unsigned fc_npages;
+	struct filecache *fc_next;	/* on filecache_all */
+};
+
+static struct spinlock filecache_lock = SPINLOCK_INITIALIZER;
+static struct filecache *filecache_all;
+
+/* Statistics, protected by filecache_lock */
+static unsigned filecache_hits;		/* lookups that found a page */
+static unsigned filecache_misses;	/* lookups that didn't */
+static unsigned filecache_races;	/* inserts that lost to another */
+static unsigned filecache_reclaimed;	/* unused pages given back */
+static unsigned filecache_released;	/* pages dropped with their vnode */
+
+static
+unsigned
+fc_hash(off_t offset)
+{
+	return (unsigned)(offset / PAGE_SIZE) % FC_NBUCKETS;
+}
+
+/*
+ * Find a page in FC. Call with filecache_lock held.
+ */
+static
+struct fcpage *
+fc_find(struct filecache *fc, off_t offset, unsigned skip, unsigned len)
+{
+	struct fcpage *fp;
+
+	for (fp = fc->fc_buckets[fc_hash(offset)]; fp != NULL;
+	     fp = fp->fp_next) {
+		if (fp->fp_offset == offset && fp->fp_skip == skip &&
+		    fp->fp_len == len) {
+			return fp;
+		}
+	}
+	return NULL;
+}
+
+paddr_t
+filecache_lookup(struct vnode *v, off_t offset, unsigned skip, unsigned len)
+{
+	struct fcpage *fp;
+	paddr_t pa;
+
+	pa = 0;
+	spinlock_acquire(&filecache_lock);
+	if (v->vn_filecache != NULL) {
+		fp = fc_find(v->vn_filecache, offset, skip, len);
+		if (fp != NULL) {
+			/* Our reference keeps it from going away. */
+			coremap_incref(fp->fp_pa);
+			pa = fp->fp_pa;
+		}
+	}
+	if (pa != 0) {
+		filecache_hits++;
+	}
+	else {
+		filecache_misses++;
+	}
+	spinlock_release(&filecache_lock);
+	return pa;
+}
+
+paddr_t
+filecache_insert(struct vnode *v, off_t offset, unsigned skip, unsigned len,
+		 paddr_t pa)
+{
+	struct filecache *fc, *newfc;
+	struct fcpage *fp, *newfp;
+	unsigned i, h;
+
+	/* Allocate before taking the spinlock. */
+	newfp = kmalloc(sizeof(*newfp));
+	if (newfp == NULL) {
+		return pa;
+	}
+	newfc = NULL;
+	if (v->vn_filecache == NULL) {
+		newfc = kmalloc(sizeof(*newfc));
+		if (newfc == NULL) {
+			kfree(newfp);
+			return pa;
+		}
+		newfc->fc_vnode = v;
+		for (i=0; i<FC_NBUCKETS; i++) {
+			newfc->fc_buckets[i] = NULL;
+		}
+		newfc->fc_npages = 0;
+	}
+
+	spinlock_acquire(&filecache_lock);
+	fc = v->vn_filecache;
+	if (fc == NULL) {
+		if (newfc == NULL) {
+			/* Raced with filecache_release; don't bother. */
+			spinlock_release(&filecache_lock);
+			kfree(newfp);
+			return pa;
+		}
+		fc = newfc;
+		newfc = NULL;
+		fc->fc_next = filecache_all;
+		filecache_all = fc;
+		v->vn_filecache = fc;
+	}
+
+	fp = fc_find(fc, offset, skip, len);
+	if (fp != NULL) {
+		coremap_incref(fp->fp_pa);
+		pa = fp->fp_pa;
+		filecache_races++;
+	}
+	else {
+		/* The cache's own reference. */
+		coremap_incref(pa);
+		newfp->fp_offset = offset;
+		newfp->fp_skip = skip;
+		newfp->fp_len = len;
+		newfp->fp_pa = pa;
+		h = fc_hash(offset);
+		newfp->fp_next = fc->fc_buckets[h];
+		fc->fc_buckets[h] = newfp;
+		fc->fc_npages++;
+		newfp = NULL;
+	}
+	spinlock_release(&filecache_lock);
+
+	if (newfp != NULL) {
+		kfree(newfp);
+	}
+	if (newfc != NULL) {
+		kfree(newfc);
+	}
+	return pa;
+}
+
+/*
+ * Drop the cache's reference to each page on the list FP.
+ */
+static
+void
+fc_droplist(struct fcpage *fp)
+{
+	struct fcpage *next;
+
+	while (fp != NULL) {
+		next = fp->fp_next;
+		coremap_pinpage(fp->fp_pa);
+		coremap_decref(fp->fp_pa);
+		kfree(fp);
+		fp = next;
+	}
+}
+
+void
+filecache_release(struct vnode *v)
+{
+	struct filecache *fc, **p;
+	struct fcpage *fp, *list;
+	unsigned i;
+
+	spinlock_acquire(&filecache_lock);
+	fc = v->vn_filecache;
+	if (fc == NULL) {
+		spinlock_release(&filecache_lock);
+		return;
+	}
+	v->vn_filecache = NULL;
+	for (p = &filecache_all; *p != fc; p = &(*p)->fc_next) {
+		KASSERT(*p != NULL);
+	}
+	*p = fc->fc_next;
+	filecache_released += fc->fc_npages;
+	spinlock_release(&filecache_lock);
+
+	/* Nobody else can see it now. */
+	list = NULL;
+	for (i=0; i<FC_NBUCKETS; i++) {
+		while (fc->fc_buckets[i] != NULL) {
+			fp = fc->fc_buckets[i];
+			fc->fc_buckets[i] = fp->fp_next;
+			fp->fp_next = list;
+			list = fp;
+		}
+	}
+	fc_droplist(list);
+	kfree(fc);
+}
+
+/*
+ * Reclaim source: give back pages that only the cache is holding.
+ * They're pinned while we decide, so no new mapping can appear; new
+ * lookups are held off by filecache_lock.
+ */
+static
+unsigned
+filecache_reclaim(unsigned npages)
+{
+	struct filecache *fc;
+	struct fcpage **p, *fp, *list;
+	struct addrspace *as;
+	vaddr_t va;
+	unsigned i, n, refs;
+
+	list = NULL;
+	n = 0;
+	spinlock_acquire(&filecache_lock);
+	for (fc = filecache_all; fc != NULL && n < npages; fc = fc->fc_next) {
+		for (i=0; i<FC_NBUCKETS && n < npages; i++) {
+			p = &fc->fc_buckets[i];
+			while (*p != NULL && n < npages) {
+				fp = *p;
+				if (!coremap_trypin(fp->fp_pa, &as, &va,
+						    &refs)) {
+					p = &fp->fp_next;
+					continue;
+				}
+				if (refs != 1 || coremap_isdirty(fp->fp_pa)) {
+					/* In use, or not written back. */
+					coremap_unpin(fp->fp_pa);
+					p = &fp->fp_next;
+					continue;
+				}
+				/* Leave it pinned for fc_droplist. */
+				*p = fp->fp_next;
+				fc->fc_npages--;
+				fp->fp_next = list;
+				list = fp;
+				n++;
+			}
+		}
+	}
+	filecache_reclaimed += n;
+	spinlock_release(&filecache_lock);
+
+	while (list != NULL) {
+		fp = list;
+		list = fp->fp_next;
+		coremap_decref(fp->fp_pa);
+		kfree(fp);
+	}
+	return n;
+}
+
+static struct reclaimer filecache_reclaimer = {
+	.rc_name = "filecache",
+	.rc_reclaim = filecache_reclaim,
+};
+
+void
+filecache_bootstrap(void)
+{
+	reclaim_register(&filecache_reclaimer);
+}
+
+/*
+ * Each page in the cache is mapped by (references - 1) processes,
+ * all but one of which would otherwise have had their own copy.
+ */
+void
+filecache_printstats(void)
+{
+	struct filecache *fc;
+	struct fcpage *fp;
+	unsigned i, files, pages, refs, saved;
+	unsigned hits, misses, races, reclaimed, released;
+
+	files = pages = saved = 0;
+	spinlock_acquire(&filecache_lock);
+	for (fc = filecache_all; fc != NULL; fc = fc->fc_next) {
+		files++;
+		for (i=0; i<FC_NBUCKETS; i++) {
+			for (fp = fc->fc_buckets[i]; fp != NULL;
+			     fp = fp->fp_next) {
+				pages++;
+				refs = coremap_userrefs(fp->fp_pa);
+				if (refs > 2) {
+					saved += refs - 2;
+				}
+			}
+		}
+	}
+	hits = filecache_hits;
+	misses = filecache_misses;
+	races = filecache_races;
+	reclaimed = filecache_reclaimed;
+	released = filecache_released;
+	spinlock_release(&filecache_lock);
+
+	kprintf("filecache: %u pages cached for %u files; "
+		"%u hits, %u misses (%u races)\n",
+		pages, files, hits, misses, races);
+	kprintf("filecache: %u pages reclaimed, %u released with "
+		"their files\n", reclaimed, released);
+	kprintf("filecache: sharing saves %u pages (%u KB)\n",
+		saved, saved * (PAGE_SIZE / 1024));
+}
@@ -30,7 +30,10 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <platform/maxcpus.h>
 #include <kern/test161.h>
 #include <test.h>
 
@@ -123,15 +126,46 @@ fill_deadbeef(void *vptr, size_t len)
 #undef CHECKBEEF
 #undef CHECKGUARDS
 
+/*
+ * MAGAZINES puts per-cpu caches of free blocks in front of the
+ * subpage allocator (see below). GUARDS and LABELS need to see every
+ * allocation and free, so they turn it off.
+ */
+#if !defined(GUARDS) && !defined(LABELS)
+#define MAGAZINES
+#endif
+
 ////////////////////////////////////////
 
 #if PAGE_SIZE == 4096
 
-#define NSIZES 8
-static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
+/*
+ * Besides the powers of two there are classes halfway between them,
+ * so that a request just over a power of two doesn't lose nearly half
+ * its block. The one between 1024 and 2048 is 1360 rather than 1536
+ * because that's the largest size that fits three to a page; two
+ * 1536-byte blocks per page would waste as much as two 2048s do.
+ *
+ * All sizes are multiples of SIZE_GRAIN, and blocktype() finds the
+ * class for a request by looking it up in sizetable[], indexed by the
+ * request size in units of SIZE_GRAIN. SIZECLASS below must list the
+ * same sizes as sizes[].
+ */
+#define NSIZES 14
+static const size_t sizes[NSIZES] = {
+	16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1360, 2048
+};
 
 #define SMALLEST_SUBPAGE_SIZE 16
 #define LARGEST_SUBPAGE_SIZE 2048
+#define SIZE_GRAIN 16
+
+#define SIZECLASS(sz) \
+	((sz) <= 16 ? 0 : (sz) <= 32 ? 1 : (sz) <= 48 ? 2 : \
+	 (sz) <= 64 ? 3 : (sz) <= 96 ? 4 : (sz) <= 128 ? 5 : \
+	 (sz) <= 192 ? 6 : (sz) <= 256 ? 7 : (sz) <= 384 ? 8 : \
+	 (sz) <= 512 ? 9 : (sz) <= 768 ? 10 : (sz) <= 1024 ? 11 : \
+	 (sz) <= 1360 ? 12 : 13)
 
 #elif PAGE_SIZE == 8192
 #error "No support for 8k pages (yet?)"
@@ -147,7 +181,7 @@ struct freelist {
 
 struct pageref {
 	struct pageref *next_samesize;
-	struct pageref *next_all;
+	struct pageref *prev_samesize;
 	vaddr_t pageaddr_and_blocktype;
 	uint16_t freelist_offset;
 	uint16_t nfree;
@@ -162,14 +196,24 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the pages underneath. Most allocations and
+ * frees don't get this far; they're handled by the per-cpu magazines
+ * further down, which have their own locks.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
 
+/* Times kmalloc_spinlock was taken by kmalloc or kfree */
+static unsigned kmalloc_lockcount;
+
+/*
+ * Allocations made from the pages, and the bytes asked for, per block
+ * type. Used to work out internal fragmentation. (Allocations served
+ * by the magazines are counted in the magazines.)
+ */
+static unsigned kmalloc_nreqs[NSIZES];
+static uint64_t kmalloc_reqbytes[NSIZES];
+
 ////////////////////////////////////////
 
 /*
@@ -341,11 +385,19 @@ freepageref(struct pageref *p)
 ////////////////////////////////////////
 
 /*
- * Each pageref is on two linked lists: one list of pages of blocks of
- * that same size, and one of all blocks.
+ * Each pageref is on a doubly linked list of pages of blocks of that
+ * same size, and is also found through pageindex[], which maps heap
+ * pages to their pagerefs by physical page number. This lets kfree
+ * find a block's page, and unlink the page when it becomes free, in
+ * constant time. Like kheaproots[], it's sized for System/161's 16M
+ * of RAM.
  */
 static struct pageref *sizebases[NSIZES];
-static struct pageref *allbase;
+
+#define KHEAP_MAXPAGES	(16*1024*1024 / PAGE_SIZE)
+#define PAGEINDEX(va)	(((va) - PADDR_TO_KVADDR(0)) / PAGE_SIZE)
+
+static struct pageref *pageindex[KHEAP_MAXPAGES];
 
 ////////////////////////////////////////
 
@@ -595,8 +647,13 @@ checksubpages(void)
 		}
 	}
 
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
+	for (i=0; i<KHEAP_MAXPAGES; i++) {
+		pr = pageindex[i];
+		if (pr == NULL) {
+			continue;
+		}
 		checksubpage(pr);
+		KASSERT(PAGEINDEX(PR_PAGEADDR(pr)) == (unsigned)i);
 		KASSERT(ac < TOTAL_PAGEREFS);
 		ac++;
 	}
@@ -799,6 +856,73 @@ subpage_stats(struct pageref *pr, bool quiet)
 	return ((unsigned long)sizes[blktype] * (n - (unsigned) pr->nfree));
 }
 
+#ifdef MAGAZINES
+static void kmcache_printstats(void);
+static void kmcache_classstats(unsigned *cached, unsigned *nreqs,
+			       uint64_t *reqbytes);
+#endif
+
+/*
+ * Print, for each block size, how well its pages are used and how
+ * much of each block is wasted.
+ *
+ * "util" is the part of the class's pages holding live blocks; it
+ * counts both free blocks and the tail of the page past the last
+ * block as waste. "frag" is internal fragmentation: the part of the
+ * blocks handed out so far that their callers didn't ask for.
+ * Blocks sitting in the magazines count as free.
+ */
+static
+void
+kheap_printclasses(void)
+{
+	unsigned pages[NSIZES], nfree[NSIZES], cached[NSIZES];
+	unsigned nreqs[NSIZES];
+	uint64_t reqbytes[NSIZES];
+	struct pageref *pr;
+	unsigned i, perpage, blocks, inuse, util, frag, avg;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	for (i=0; i<NSIZES; i++) {
+		pages[i] = nfree[i] = 0;
+		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
+			pages[i]++;
+			nfree[i] += pr->nfree;
+		}
+		cached[i] = 0;
+		nreqs[i] = kmalloc_nreqs[i];
+		reqbytes[i] = kmalloc_reqbytes[i];
+	}
+	spinlock_release(&kmalloc_spinlock);
+
+#ifdef MAGAZINES
+	kmcache_classstats(cached, nreqs, reqbytes);
+#endif
+
+	kprintf("Size classes:\n");
+	kprintf("  size  pages     inuse/blocks  util    allocs  avgreq  frag\n");
+	for (i=0; i<NSIZES; i++) {
+		if (pages[i] == 0 && nreqs[i] == 0) {
+			continue;
+		}
+		perpage = PAGE_SIZE / sizes[i];
+		blocks = pages[i] * perpage;
+		/* the two counts weren't taken at once, so may overlap */
+		inuse = nfree[i] + cached[i] >= blocks ? 0 :
+			blocks - nfree[i] - cached[i];
+		util = pages[i] == 0 ? 0 :
+			(uint64_t)inuse * sizes[i] * 100 /
+			((uint64_t)pages[i] * PAGE_SIZE);
+		avg = nreqs[i] == 0 ? 0 : reqbytes[i] / nreqs[i];
+		frag = nreqs[i] == 0 ? 0 :
+			100 - reqbytes[i] * 100 /
+			((uint64_t)nreqs[i] * sizes[i]);
+		kprintf("  %4lu %6u %9u/%-6u %4u%% %9u %7u %4u%%\n",
+			(unsigned long)sizes[i], pages[i], inuse, blocks,
+			util, nreqs[i], avg, frag);
+	}
+}
+
 /*
  * Print the whole heap.
  */
@@ -806,17 +930,29 @@ void
 kheap_printstats(void)
 {
 	struct pageref *pr;
+	unsigned i;
 
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
 
 	kprintf("Subpage allocator status:\n");
 
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
-		subpage_stats(pr, false);
+	for (i=0; i<KHEAP_MAXPAGES; i++) {
+		pr = pageindex[i];
+		if (pr != NULL) {
+			subpage_stats(pr, false);
+		}
 	}
 
+	kprintf("Global heap lock taken %u times\n", kmalloc_lockcount);
+
 	spinlock_release(&kmalloc_spinlock);
+
+	kheap_printclasses();
+
+#ifdef MAGAZINES
+	kmcache_printstats();
+#endif
 }
 
 
@@ -829,12 +965,19 @@ kheap_getused(void) {
 	struct pageref *pr;
 	unsigned long total = 0;
 	unsigned int num_pages = 0, coremap_bytes = 0;
+	unsigned i;
+
+	/* Blocks sitting in magazines aren't in use. */
+	kheap_drain();
 
 	/* compute with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
-		total += subpage_stats(pr, true);
-		num_pages++;
+	for (i=0; i<KHEAP_MAXPAGES; i++) {
+		pr = pageindex[i];
+		if (pr != NULL) {
+			total += subpage_stats(pr, true);
+			num_pages++;
+		}
 	}
 
 	coremap_bytes = coremap_used_bytes();
@@ -865,33 +1008,71 @@ kheap_printused(void)
 ////////////////////////////////////////
 
 /*
- * Remove a pageref from both lists that it's on.
+ * Add a pageref to its size list and to pageindex[].
  */
 static
 void
-remove_lists(struct pageref *pr, int blktype)
+insert_lists(struct pageref *pr, int blktype)
 {
-	struct pageref **guy;
+	vaddr_t index;
 
 	KASSERT(blktype>=0 && blktype<NSIZES);
 
-	for (guy = &sizebases[blktype]; *guy; guy = &(*guy)->next_samesize) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_samesize;
-			break;
-		}
+	pr->prev_samesize = NULL;
+	pr->next_samesize = sizebases[blktype];
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->prev_samesize = pr;
 	}
+	sizebases[blktype] = pr;
 
-	for (guy = &allbase; *guy; guy = &(*guy)->next_all) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_all;
-			break;
-		}
+	index = PAGEINDEX(PR_PAGEADDR(pr));
+	KASSERT(index < KHEAP_MAXPAGES);
+	KASSERT(pageindex[index] == NULL);
+	pageindex[index] = pr;
+}
+
+/*
+ * Remove a pageref from its size list and from pageindex[].
+ */
+static
+void
+remove_lists(struct pageref *pr, int blktype)
+{
+	vaddr_t index;
+
+	KASSERT(blktype>=0 && blktype<NSIZES);
+
+	if (pr->prev_samesize != NULL) {
+		checksubpage(pr->prev_samesize);
+		pr->prev_samesize->next_samesize = pr->next_samesize;
+	}
+	else {
+		KASSERT(sizebases[blktype] == pr);
+		sizebases[blktype] = pr->next_samesize;
+	}
+	if (pr->next_samesize != NULL) {
+		checksubpage(pr->next_samesize);
+		pr->next_samesize->prev_samesize = pr->prev_samesize;
 	}
+
+	index = PAGEINDEX(PR_PAGEADDR(pr));
+	KASSERT(pageindex[index] == pr);
+	pageindex[index] = NULL;
 }
 
+/*
+ * Block type for each request size, in units of SIZE_GRAIN (rounded
+ * up), built at compile time from SIZECLASS.
+ */
+#define ST1(k)  SIZECLASS((k) * SIZE_GRAIN)
+#define ST4(k)  ST1(k), ST1((k)+1), ST1((k)+2), ST1((k)+3)
+#define ST16(k) ST4(k), ST4((k)+4), ST4((k)+8), ST4((k)+12)
+#define ST64(k) ST16(k), ST16((k)+16), ST16((k)+32), ST16((k)+48)
+
+static const uint8_t sizetable[LARGEST_SUBPAGE_SIZE / SIZE_GRAIN + 1] = {
+	ST64(0), ST64(64), ST1(128)
+};
+
 /*
  * Given a requested client size, return the block type, that is, the
  * index into the sizes[] array for the block size to use.
@@ -901,17 +1082,18 @@ inline
 int blocktype(size_t clientsz)
 {
 	unsigned i;
-	for (i=0; i<NSIZES; i++) {
-		if (clientsz <= sizes[i]) {
-			return i;
-		}
+
+	if (clientsz > LARGEST_SUBPAGE_SIZE) {
+		panic("Subpage allocator cannot handle allocation "
+		      "of size %zu\n", clientsz);
 	}
 
-	panic("Subpage allocator cannot handle allocation of size %zu\n",
-	      clientsz);
+	i = sizetable[DIVROUNDUP(clientsz, SIZE_GRAIN)];
 
-	// keep compiler happy
-	return 0;
+	/* check that SIZECLASS agrees with sizes[] */
+	DEBUGASSERT(clientsz <= sizes[i]);
+	DEBUGASSERT(i == 0 || clientsz > sizes[i-1]);
+	return i;
 }
 
 /*
@@ -932,6 +1114,7 @@ subpage_kmalloc(size_t sz
 	vaddr_t fla;		// free list entry address
 	struct freelist *volatile fl;	// free list entry
 	void *retptr;		// our result
+	size_t reqsz;		// size asked for, for the statistics
 
 	volatile int i;
 
@@ -939,6 +1122,7 @@ subpage_kmalloc(size_t sz
 	size_t clientsz;
 #endif
 
+	reqsz = sz;
 #ifdef GUARDS
 	clientsz = sz;
 	sz += GUARD_OVERHEAD;
@@ -956,6 +1140,7 @@ subpage_kmalloc(size_t sz
 #endif
 
 	spinlock_acquire(&kmalloc_spinlock);
+	kmalloc_lockcount++;
 
 	checksubpages();
 
@@ -988,6 +1173,8 @@ subpage_kmalloc(size_t sz
 				KASSERT(pr->nfree == 0);
 				pr->freelist_offset = INVALID_OFFSET;
 			}
+			kmalloc_nreqs[blktype]++;
+			kmalloc_reqbytes[blktype] += reqsz;
 #ifdef GUARDS
 			retptr = establishguardband(retptr, clientsz, sz);
 #endif
@@ -1024,6 +1211,7 @@ subpage_kmalloc(size_t sz
 	fill_deadbeef((void *)prpage, PAGE_SIZE);
 #endif
 	spinlock_acquire(&kmalloc_spinlock);
+	kmalloc_lockcount++;
 
 	pr = allocpageref();
 	if (pr==NULL) {
@@ -1055,16 +1243,42 @@ subpage_kmalloc(size_t sz
 	pr->freelist_offset = fla - prpage;
 	KASSERT(pr->freelist_offset == (pr->nfree-1)*sizes[blktype]);
 
-	pr->next_samesize = sizebases[blktype];
-	sizebases[blktype] = pr;
-
-	pr->next_all = allbase;
-	allbase = pr;
+	insert_lists(pr, blktype);
 
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
 }
 
+/*
+ * Find the pageref for the heap page PTRADDR is on, or return NULL if
+ * it isn't on one of ours.
+ *
+ * If PTRADDR is an allocated block, its page can't stop being a heap
+ * page (or become one) under us, so this is safe without
+ * kmalloc_spinlock.
+ */
+static
+struct pageref *
+subpage_findpage(vaddr_t ptraddr)
+{
+	struct pageref *pr;
+	vaddr_t index;
+
+	if (ptraddr < PADDR_TO_KVADDR(0)) {
+		return NULL;
+	}
+	index = PAGEINDEX(ptraddr);
+	if (index >= KHEAP_MAXPAGES) {
+		return NULL;
+	}
+	pr = pageindex[index];
+
+	/* check for corruption */
+	KASSERT(pr == NULL || PR_BLOCKTYPE(pr) < NSIZES);
+	KASSERT(pr == NULL || PR_PAGEADDR(pr) == (ptraddr & PAGE_FRAME));
+	return pr;
+}
+
 /*
  * Free a pointer previously returned from subpage_kmalloc. If the
  * pointer is not on any heap page we recognize, return -1.
@@ -1110,32 +1324,19 @@ subpage_kfree(void *ptr)
 #endif
 
 	spinlock_acquire(&kmalloc_spinlock);
+	kmalloc_lockcount++;
 
 	checksubpages();
 
-	/* Silence warnings with gcc 4.8 -Og (but not -O2) */
-	prpage = 0;
-	blktype = 0;
-
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-		KASSERT(blktype >= 0 && blktype < NSIZES);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
+	pr = subpage_findpage(ptraddr);
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
 		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
+	checksubpage(pr);
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
 
 	offset = ptraddr - prpage;
 
@@ -1207,28 +1408,801 @@ subpage_kfree(void *ptr)
 	return 0;
 }
 
+////////////////////////////////////////////////////////////
+//
+// Per-cpu magazines.
+//
+// Each cpu keeps two magazines (small stacks of free blocks) for each
+// block size, so most kmallocs and kfrees only take the cpu's own
+// lock and not kmalloc_spinlock. When both are empty on an alloc, or
+// both full on a free, one of them is exchanged with the depot for
+// that size, which keeps lists of full and empty magazines. Only when
+// the depot can't help do we go down to the pages. This is the scheme
+// of Bonwick and Adams, "Magazines and Vmem" (USENIX 2001).
+//
+// As with the page magazines in coremap.c, kmc_lock is normally only
+// taken by its own cpu; others take it only to drain. Lock ordering:
+// kmc_lock, then kd_lock. Neither is held while calling into the
+// subpage allocator.
+//
+// kfree has to work at splhigh and from inside the reclaimers, so it
+// never allocates. The depots are stocked with empty magazines at
+// boot; if a free finds none, the block goes straight back to its
+// page instead.
+//
+// Blocks in magazines are free as far as kmalloc's users are
+// concerned, but still allocated as far as their pages are; so
+// kheap_getused drains everything before counting, and so does the
+// VM system when it wants memory back.
+//
+
+#ifdef MAGAZINES
+
+#define KMAG_ROUNDS	14	/* blocks per magazine; makes it 64 bytes */
+#define KMDEPOT_MAXFULL	4	/* full magazines the depot will hold */
+
+struct kmag {
+	struct kmag *km_next;		/* depot list link */
+	unsigned km_rounds;		/* blocks in km_blocks[] */
+	void *km_blocks[KMAG_ROUNDS];
+};
+
+struct kmdepot {
+	struct spinlock kd_lock;
+	struct kmag *kd_full;		/* full magazines */
+	struct kmag *kd_empty;		/* empty magazines */
+	unsigned kd_nfull;
+	unsigned kd_nempty;
+};
+
+struct kmcache {
+	struct spinlock kmc_lock;
+	struct kmag *kmc_loaded[NSIZES];	/* used first */
+	struct kmag *kmc_previous[NSIZES];	/* swapped in when needed */
+
+	/* statistics */
+	unsigned kmc_hits;		/* allocs and frees done here */
+	unsigned kmc_exchanges;		/* magazines traded with the depot */
+	unsigned kmc_misses;		/* went down to the pages */
+	unsigned kmc_nreqs[NSIZES];	/* allocs done here, by type... */
+	uint64_t kmc_reqbytes[NSIZES];	/* ...and the bytes asked for */
+};
+
+static struct kmdepot kmdepots[NSIZES];
+
+/* Every cpu's cache; protected by kmalloc_spinlock */
+static struct kmcache *kmcaches[MAXCPUS];
+static unsigned nkmcaches;
+
+/*
+ * Allocate an empty magazine.
+ */
+static
+struct kmag *
+kmag_create(void)
+{
+	struct kmag *mag;
+
+	mag = subpage_kmalloc(sizeof(*mag));
+	if (mag == NULL) {
+		return NULL;
+	}
+	mag->km_next = NULL;
+	mag->km_rounds = 0;
+	return mag;
+}
+
+/*
+ * Set up the magazines for a new cpu. Called from cpu_create.
+ */
+void
+kheap_cpuinit(struct cpu *c)
+{
+	struct kmcache *kmc;
+	struct kmag *mag;
+	unsigned i, j;
+	bool first;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	first = nkmcaches == 0;
+	if (first) {
+		/* First cpu; nobody else is running yet. */
+		for (i=0; i<NSIZES; i++) {
+			spinlock_init(&kmdepots[i].kd_lock);
+			kmdepots[i].kd_full = NULL;
+			kmdepots[i].kd_empty = NULL;
+			kmdepots[i].kd_nfull = 0;
+			kmdepots[i].kd_nempty = 0;
+		}
+	}
+	spinlock_release(&kmalloc_spinlock);
+
+	kmc = subpage_kmalloc(sizeof(*kmc));
+	if (kmc == NULL) {
+		panic("kheap_cpuinit: Out of memory\n");
+	}
+	spinlock_init(&kmc->kmc_lock);
+	for (i=0; i<NSIZES; i++) {
+		kmc->kmc_loaded[i] = kmag_create();
+		kmc->kmc_previous[i] = kmag_create();
+		if (kmc->kmc_loaded[i] == NULL ||
+		    kmc->kmc_previous[i] == NULL) {
+			panic("kheap_cpuinit: Out of memory\n");
+		}
+	}
+	kmc->kmc_hits = 0;
+	kmc->kmc_exchanges = 0;
+	kmc->kmc_misses = 0;
+	for (i=0; i<NSIZES; i++) {
+		kmc->kmc_nreqs[i] = 0;
+		kmc->kmc_reqbytes[i] = 0;
+	}
+
+	if (first) {
+		/* Enough empties for the depots to fill up on frees. */
+		for (i=0; i<NSIZES; i++) {
+			for (j=0; j<KMDEPOT_MAXFULL; j++) {
+				mag = kmag_create();
+				if (mag == NULL) {
+					panic("kheap_cpuinit: Out of memory\n");
+				}
+				mag->km_next = kmdepots[i].kd_empty;
+				kmdepots[i].kd_empty = mag;
+				kmdepots[i].kd_nempty++;
+			}
+		}
+	}
+
+	spinlock_acquire(&kmalloc_spinlock);
+	KASSERT(nkmcaches < MAXCPUS);
+	kmcaches[nkmcaches++] = kmc;
+	spinlock_release(&kmalloc_spinlock);
+
+	c->c_kmcache = kmc;
+}
+
+/*
+ * Swap KMC's loaded and previous magazines for BLKTYPE.
+ */
+static
+void
+kmcache_swap(struct kmcache *kmc, unsigned blktype)
+{
+	struct kmag *mag;
+
+	mag = kmc->kmc_loaded[blktype];
+	kmc->kmc_loaded[blktype] = kmc->kmc_previous[blktype];
+	kmc->kmc_previous[blktype] = mag;
+}
+
+/*
+ * Get a block for a request of SZ bytes from the current cpu's
+ * magazines, or return NULL.
+ *
+ * The thread may migrate between looking up curcpu and taking the
+ * lock, in which case we use another cpu's magazines. That's still
+ * correct, just not local.
+ */
+static
+void *
+kmcache_alloc(size_t sz)
+{
+	struct kmcache *kmc;
+	struct kmdepot *kd;
+	struct kmag *mag;
+	unsigned blktype;
+	void *ret;
+
+	if (!CURCPU_EXISTS() || curcpu->c_kmcache == NULL) {
+		/* Too early. */
+		return NULL;
+	}
+	kmc = curcpu->c_kmcache;
+	blktype = blocktype(sz);
+
+	spinlock_acquire(&kmc->kmc_lock);
+	if (kmc->kmc_loaded[blktype]->km_rounds == 0) {
+		if (kmc->kmc_previous[blktype]->km_rounds == 0) {
+			/* Trade the empty one for a full one. */
+			kd = &kmdepots[blktype];
+			spinlock_acquire(&kd->kd_lock);
+			mag = kd->kd_full;
+			if (mag == NULL) {
+				spinlock_release(&kd->kd_lock);
+				kmc->kmc_misses++;
+				spinlock_release(&kmc->kmc_lock);
+				return NULL;
+			}
+			kd->kd_full = mag->km_next;
+			kd->kd_nfull--;
+			kmc->kmc_previous[blktype]->km_next = kd->kd_empty;
+			kd->kd_empty = kmc->kmc_previous[blktype];
+			kd->kd_nempty++;
+			spinlock_release(&kd->kd_lock);
+
+			kmc->kmc_previous[blktype] = mag;
+			kmc->kmc_exchanges++;
+		}
+		kmcache_swap(kmc, blktype);
+	}
+	mag = kmc->kmc_loaded[blktype];
+	ret = mag->km_blocks[--mag->km_rounds];
+	kmc->kmc_hits++;
+	kmc->kmc_nreqs[blktype]++;
+	kmc->kmc_reqbytes[blktype] += sz;
+	spinlock_release(&kmc->kmc_lock);
+
+	return ret;
+}
+
+/*
+ * Put the block at PTR in the current cpu's magazines. Returns false
+ * if there's no room (or PTR isn't a subpage block), in which case the
+ * caller should free it the slow way.
+ */
+static
+bool
+kmcache_free(void *ptr)
+{
+	struct kmcache *kmc;
+	struct kmdepot *kd;
+	struct kmag *mag;
+	struct pageref *pr;
+	vaddr_t ptraddr, offset;
+	unsigned blktype;
+
+	if (!CURCPU_EXISTS() || curcpu->c_kmcache == NULL) {
+		return false;
+	}
+
+	/* Find out what size it is. */
+	ptraddr = (vaddr_t)ptr;
+	pr = subpage_findpage(ptraddr);
+	if (pr == NULL) {
+		return false;
+	}
+	blktype = PR_BLOCKTYPE(pr);
+	offset = ptraddr - PR_PAGEADDR(pr);
+
+	if (offset % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+	fill_deadbeef(ptr, sizes[blktype]);
+
+	kd = &kmdepots[blktype];
+	kmc = curcpu->c_kmcache;
+	spinlock_acquire(&kmc->kmc_lock);
+	if (kmc->kmc_loaded[blktype]->km_rounds == KMAG_ROUNDS) {
+		if (kmc->kmc_previous[blktype]->km_rounds == KMAG_ROUNDS) {
+			/* Trade the full one for an empty one. */
+			spinlock_acquire(&kd->kd_lock);
+			mag = kd->kd_empty;
+			if (kd->kd_nfull >= KMDEPOT_MAXFULL || mag == NULL) {
+				/*
+				 * The depot has plenty, or no empties;
+				 * making one could sleep, so don't.
+				 */
+				spinlock_release(&kd->kd_lock);
+				kmc->kmc_misses++;
+				spinlock_release(&kmc->kmc_lock);
+				return false;
+			}
+			kd->kd_empty = mag->km_next;
+			kd->kd_nempty--;
+			kmc->kmc_previous[blktype]->km_next = kd->kd_full;
+			kd->kd_full = kmc->kmc_previous[blktype];
+			kd->kd_nfull++;
+			spinlock_release(&kd->kd_lock);
+
+			kmc->kmc_previous[blktype] = mag;
+			kmc->kmc_exchanges++;
+		}
+		kmcache_swap(kmc, blktype);
+	}
+	mag = kmc->kmc_loaded[blktype];
+	mag->km_blocks[mag->km_rounds++] = ptr;
+	kmc->kmc_hits++;
+	spinlock_release(&kmc->kmc_lock);
+
+	return true;
+}
+
+/*
+ * Move the blocks in MAG onto the list at *LIST.
+ */
+static
+void
+kmag_empty(struct kmag *mag, struct freelist **list)
+{
+	struct freelist *fl;
+
+	while (mag->km_rounds > 0) {
+		fl = mag->km_blocks[--mag->km_rounds];
+		fl->next = *list;
+		*list = fl;
+	}
+}
+
+/*
+ * Give every block in the magazines and the depots back to the pages
+ * underneath, so that pages with nothing else in them get freed.
+ */
+void
+kheap_drain(void)
+{
+	struct freelist *list, *fl;
+	struct kmcache *kmc;
+	struct kmdepot *kd;
+	struct kmag *full, *mag;
+	unsigned i, j, n;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	n = nkmcaches;
+	spinlock_release(&kmalloc_spinlock);
+
+	list = NULL;
+	for (i=0; i<n; i++) {
+		kmc = kmcaches[i];
+		spinlock_acquire(&kmc->kmc_lock);
+		for (j=0; j<NSIZES; j++) {
+			kmag_empty(kmc->kmc_loaded[j], &list);
+			kmag_empty(kmc->kmc_previous[j], &list);
+		}
+		spinlock_release(&kmc->kmc_lock);
+	}
+
+	for (j=0; j<NSIZES; j++) {
+		kd = &kmdepots[j];
+		spinlock_acquire(&kd->kd_lock);
+		full = kd->kd_full;
+		kd->kd_full = NULL;
+		kd->kd_nfull = 0;
+		for (mag = full; mag != NULL; mag = mag->km_next) {
+			kmag_empty(mag, &list);
+		}
+		if (full != NULL) {
+			/* Now they're empty; find the end and link them in. */
+			for (mag = full; mag->km_next != NULL;
+			     mag = mag->km_next) {
+				kd->kd_nempty++;
+			}
+			kd->kd_nempty++;
+			mag->km_next = kd->kd_empty;
+			kd->kd_empty = full;
+		}
+		spinlock_release(&kd->kd_lock);
+	}
+
+	while (list != NULL) {
+		fl = list;
+		list = fl->next;
+		if (subpage_kfree(fl)) {
+			panic("kheap_drain: %p is not a subpage block\n", fl);
+		}
+	}
+}
+
+/*
+ * Print magazine statistics.
+ */
+static
+void
+kmcache_printstats(void)
+{
+	struct kmcache *kmc;
+	unsigned i, j, n, cached;
+	unsigned hits, exchanges, misses;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	n = nkmcaches;
+	spinlock_release(&kmalloc_spinlock);
+
+	for (i=0; i<n; i++) {
+		kmc = kmcaches[i];
+		spinlock_acquire(&kmc->kmc_lock);
+		hits = kmc->kmc_hits;
+		exchanges = kmc->kmc_exchanges;
+		misses = kmc->kmc_misses;
+		cached = 0;
+		for (j=0; j<NSIZES; j++) {
+			cached += kmc->kmc_loaded[j]->km_rounds;
+			cached += kmc->kmc_previous[j]->km_rounds;
+		}
+		spinlock_release(&kmc->kmc_lock);
+
+		kprintf("cpu%u magazines: %u hits, %u depot exchanges, "
+			"%u misses, %u blocks cached\n",
+			i, hits, exchanges, misses, cached);
+	}
+	for (j=0; j<NSIZES; j++) {
+		spinlock_acquire(&kmdepots[j].kd_lock);
+		kprintf("depot %-4lu: %u full, %u empty\n",
+			(unsigned long)sizes[j], kmdepots[j].kd_nfull,
+			kmdepots[j].kd_nempty);
+		spinlock_release(&kmdepots[j].kd_lock);
+	}
+}
+
+/*
+ * Add the blocks cached in magazines, and the allocations the
+ * magazines served, to the per-block-type totals passed in.
+ */
+static
+void
+kmcache_classstats(unsigned *cached, unsigned *nreqs, uint64_t *reqbytes)
+{
+	struct kmcache *kmc;
+	struct kmag *mag;
+	unsigned i, j, n;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	n = nkmcaches;
+	spinlock_release(&kmalloc_spinlock);
+
+	for (i=0; i<n; i++) {
+		kmc = kmcaches[i];
+		spinlock_acquire(&kmc->kmc_lock);
+		for (j=0; j<NSIZES; j++) {
+			cached[j] += kmc->kmc_loaded[j]->km_rounds;
+			cached[j] += kmc->kmc_previous[j]->km_rounds;
+			nreqs[j] += kmc->kmc_nreqs[j];
+			reqbytes[j] += kmc->kmc_reqbytes[j];
+		}
+		spinlock_release(&kmc->kmc_lock);
+	}
+	for (j=0; j<NSIZES; j++) {
+		spinlock_acquire(&kmdepots[j].kd_lock);
+		for (mag = kmdepots[j].kd_full; mag != NULL;
+		     mag = mag->km_next) {
+			cached[j] += mag->km_rounds;
+		}
+		spinlock_release(&kmdepots[j].kd_lock);
+	}
+}
+
+#else /* MAGAZINES */
+
+void
+kheap_cpuinit(struct cpu *c)
+{
+	c->c_kmcache = NULL;
+}
+
+void
+kheap_drain(void)
+{
+	/* Nothing cached. */
+}
+
+#endif /* MAGAZINES */
+
+/*
+ * Return the number of times kmalloc and kfree have taken the global
+ * heap lock. (With the magazines, this is how often they couldn't be
+ * served by the current cpu.)
+ */
+unsigned
+kheap_lockcount(void)
+{
+	unsigned ret;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	ret = kmalloc_lockcount;
+	spinlock_release(&kmalloc_spinlock);
+	return ret;
+}
+
 //
 ////////////////////////////////////////////////////////////
 
+////////////////////////////////////////////////////////////
+//
+// Allocation-site profiler.
+//
+// One kmalloc in every kprof_period is sampled: we remember the
+// block, its size, and the address kmalloc was called from, until it
+// is freed. Live samples are totalled per call site, so a site whose
+// live bytes keep growing is leaking. Each sample counts for as many
+// blocks as the period it was taken at, which gives an estimate of
+// the site's real usage that survives changing the period.
+//
+// Unlike LABELS this is always compiled in and costs nothing per
+// block. Each kmalloc decrements a counter; each kfree looks at one
+// hash bucket of sampled blocks, and only takes kprof_lock if the
+// bucket isn't empty.
+//
+// Everything lives in fixed-size tables, so the profiler never calls
+// kmalloc itself. When the tables fill, further samples are dropped
+// (and counted), except that a call site with nothing live can be
+// replaced by a new one.
+//
+
+#define KPROF_PERIOD	64	/* default sampling period */
+#define KPROF_SAMPLES	512	/* live samples we can track */
+#define KPROF_SITES	128	/* call sites we can track */
+#define KPROF_BUCKETS	1024	/* hash buckets for live samples */
+
+struct kprof_sample {
+	struct kprof_sample *kps_next;	/* bucket or free list */
+	void *kps_ptr;			/* the block */
+	size_t kps_size;		/* size asked for */
+	unsigned kps_site;		/* index into kprof_sites[] */
+	unsigned kps_period;		/* sampling period when taken */
+};
+
+struct kprof_site {
+	vaddr_t kpst_addr;		/* kmalloc's return address */
+	unsigned long kpst_livebytes;	/* sampled bytes not yet freed */
+	unsigned kpst_liveblocks;	/* sampled blocks not yet freed */
+	unsigned kpst_samples;		/* blocks sampled ever */
+	unsigned long kpst_estbytes;	/* live bytes scaled by period */
+	unsigned kpst_estblocks;	/* live blocks scaled by period */
+};
+
+static struct spinlock kprof_lock = SPINLOCK_INITIALIZER;
+static struct kprof_sample kprof_samples[KPROF_SAMPLES];
+static struct kprof_sample *kprof_freesamples;
+static struct kprof_sample *kprof_buckets[KPROF_BUCKETS];
+static struct kprof_site kprof_sites[KPROF_SITES];
+static unsigned kprof_nsites;
+static unsigned kprof_nlive;
+static unsigned kprof_dropped;
+static bool kprof_initialized;
+
+/*
+ * Not protected by any lock, so cpus can race on the countdown and
+ * lose or repeat a step. kprof_sampletime reads it once and stores
+ * it once, and resets anything out of range (0, or above the period
+ * after kheap_setsampling lowers it), so a race can't make it wrap
+ * and stop the sampling.
+ */
+static unsigned kprof_period = KPROF_PERIOD;
+static unsigned kprof_countdown = KPROF_PERIOD;
+
+static
+inline
+unsigned
+kprof_hash(void *ptr)
+{
+	vaddr_t va = (vaddr_t)ptr;
+
+	/* page-sized blocks are page aligned, so fold in the page number */
+	return ((va >> 4) ^ (va >> 12)) % KPROF_BUCKETS;
+}
+
 /*
- * Allocate a block of size SZ. Redirect either to subpage_kmalloc or
- * alloc_kpages depending on how big SZ is.
+ * If this allocation should be sampled, return the sampling period;
+ * otherwise return 0.
  */
+static
+inline
+unsigned
+kprof_sampletime(void)
+{
+	unsigned period, count;
+
+	period = kprof_period;
+	if (period == 0) {
+		return 0;
+	}
+	count = kprof_countdown;
+	if (count > 1 && count <= period) {
+		kprof_countdown = count - 1;
+		return 0;
+	}
+	kprof_countdown = period;
+	return period;
+}
+
+/*
+ * Find or make the entry for call site SITE. Returns KPROF_SITES if
+ * there's no room.
+ */
+static
+unsigned
+kprof_getsite(vaddr_t site)
+{
+	unsigned i, spare = KPROF_SITES;
+
+	KASSERT(spinlock_do_i_hold(&kprof_lock));
+
+	for (i=0; i<kprof_nsites; i++) {
+		if (kprof_sites[i].kpst_addr == site) {
+			return i;
+		}
+		if (spare == KPROF_SITES && kprof_sites[i].kpst_liveblocks == 0) {
+			spare = i;
+		}
+	}
+	if (kprof_nsites < KPROF_SITES) {
+		spare = kprof_nsites++;
+	}
+	if (spare < KPROF_SITES) {
+		kprof_sites[spare].kpst_addr = site;
+		kprof_sites[spare].kpst_livebytes = 0;
+		kprof_sites[spare].kpst_liveblocks = 0;
+		kprof_sites[spare].kpst_samples = 0;
+		kprof_sites[spare].kpst_estbytes = 0;
+		kprof_sites[spare].kpst_estblocks = 0;
+	}
+	return spare;
+}
+
+/*
+ * Record the block PTR of SZ bytes, allocated from SITE, as sampled
+ * one in PERIOD.
+ */
+static
+void
+kprof_record(void *ptr, size_t sz, vaddr_t site, unsigned period)
+{
+	struct kprof_sample *kps;
+	unsigned i, b;
+
+	spinlock_acquire(&kprof_lock);
+	if (!kprof_initialized) {
+		for (i=0; i<KPROF_SAMPLES; i++) {
+			kprof_samples[i].kps_next = kprof_freesamples;
+			kprof_freesamples = &kprof_samples[i];
+		}
+		kprof_initialized = true;
+	}
+
+	kps = kprof_freesamples;
+	i = kprof_getsite(site);
+	if (kps == NULL || i == KPROF_SITES) {
+		kprof_dropped++;
+		spinlock_release(&kprof_lock);
+		return;
+	}
+	kprof_freesamples = kps->kps_next;
+
+	kps->kps_ptr = ptr;
+	kps->kps_size = sz;
+	kps->kps_site = i;
+	kps->kps_period = period;
+	b = kprof_hash(ptr);
+	kps->kps_next = kprof_buckets[b];
+	kprof_buckets[b] = kps;
+
+	kprof_sites[i].kpst_livebytes += sz;
+	kprof_sites[i].kpst_liveblocks++;
+	kprof_sites[i].kpst_samples++;
+	kprof_sites[i].kpst_estbytes += (unsigned long)sz * period;
+	kprof_sites[i].kpst_estblocks += period;
+	kprof_nlive++;
+	spinlock_release(&kprof_lock);
+}
+
+/*
+ * Forget PTR, which is being freed, if it was sampled.
+ */
+static
+void
+kprof_forget(void *ptr)
+{
+	struct kprof_sample **p, *kps;
+	struct kprof_site *site;
+	unsigned b;
+
+	b = kprof_hash(ptr);
+	if (kprof_buckets[b] == NULL) {
+		/*
+		 * Nothing sampled hashes here. If PTR was sampled, the
+		 * caller got it from kmalloc after it was recorded, so
+		 * we can't miss it by not locking.
+		 */
+		return;
+	}
+
+	spinlock_acquire(&kprof_lock);
+	for (p = &kprof_buckets[b]; *p != NULL; p = &(*p)->kps_next) {
+		kps = *p;
+		if (kps->kps_ptr == ptr) {
+			*p = kps->kps_next;
+			site = &kprof_sites[kps->kps_site];
+			KASSERT(site->kpst_liveblocks > 0);
+			KASSERT(site->kpst_livebytes >= kps->kps_size);
+			site->kpst_livebytes -= kps->kps_size;
+			site->kpst_liveblocks--;
+			site->kpst_estbytes -=
+				(unsigned long)kps->kps_size * kps->kps_period;
+			site->kpst_estblocks -= kps->kps_period;
+			kprof_nlive--;
+			kps->kps_next = kprof_freesamples;
+			kprof_freesamples = kps;
+			break;
+		}
+	}
+	spinlock_release(&kprof_lock);
+}
+
+/*
+ * Print the MAX call sites with the most sampled bytes live, with
+ * estimates of their real usage.
+ */
+void
+kheap_printsites(unsigned max)
+{
+	struct kprof_site *site;
+	bool shown[KPROF_SITES];
+	unsigned i, n, best;
+
+	/* print the whole thing with interrupts off, like kheap_printstats */
+	spinlock_acquire(&kprof_lock);
+
+	if (kprof_period == 0) {
+		kprintf("Sampling off; %u samples live, %u dropped\n",
+			kprof_nlive, kprof_dropped);
+	}
+	else {
+		kprintf("Sampling 1 in %u kmallocs; %u samples live, "
+			"%u dropped\n",
+			kprof_period, kprof_nlive, kprof_dropped);
+	}
+	kprintf("  site        est. bytes  est. blocks  sampled\n");
+
+	for (i=0; i<kprof_nsites; i++) {
+		shown[i] = false;
+	}
+	for (n=0; n<max; n++) {
+		best = KPROF_SITES;
+		for (i=0; i<kprof_nsites; i++) {
+			if (shown[i] || kprof_sites[i].kpst_liveblocks == 0) {
+				continue;
+			}
+			if (best == KPROF_SITES ||
+			    kprof_sites[i].kpst_estbytes >
+			    kprof_sites[best].kpst_estbytes) {
+				best = i;
+			}
+		}
+		if (best == KPROF_SITES) {
+			break;
+		}
+		shown[best] = true;
+		site = &kprof_sites[best];
+		kprintf("  0x%08lx %11lu %12u %8u\n",
+			(unsigned long)site->kpst_addr,
+			site->kpst_estbytes,
+			site->kpst_estblocks,
+			site->kpst_samples);
+	}
+
+	spinlock_release(&kprof_lock);
+}
+
+/*
+ * Set the sampling period. 0 turns sampling off; blocks already
+ * sampled are still tracked until they're freed.
+ */
+void
+kheap_setsampling(unsigned period)
+{
+	kprof_period = period;
+	kprof_countdown = period;
+}
+
+//
+////////////////////////////////////////////////////////////
+
+/*
+ * Allocate a block of size SZ for the caller at LABEL. Redirect
+ * either to subpage_kmalloc or alloc_kpages depending on how big SZ
+ * is.
+ */
+static
 void *
-kmalloc(size_t sz)
+kmalloc_label(size_t sz, vaddr_t label)
 {
 	size_t checksz;
-#ifdef LABELS
-	vaddr_t label;
+#ifdef MAGAZINES
+	void *ptr;
 #endif
 
-#ifdef LABELS
-#ifdef __GNUC__
-	label = (vaddr_t)__builtin_return_address(0);
-#else
-#error "Don't know how to get return address with this compiler"
-#endif /* __GNUC__ */
-#endif /* LABELS */
+#ifndef LABELS
+	(void)label;
+#endif
 
 	checksz = sz + GUARD_OVERHEAD + LABEL_OVERHEAD;
 	if (checksz >= LARGEST_SUBPAGE_SIZE) {
@@ -1249,10 +2223,42 @@ kmalloc(size_t sz)
 #ifdef LABELS
 	return subpage_kmalloc(sz, label);
 #else
+#ifdef MAGAZINES
+	ptr = kmcache_alloc(sz);
+	if (ptr != NULL) {
+		return ptr;
+	}
+#endif
 	return subpage_kmalloc(sz);
 #endif
 }
 
+/*
+ * Allocate a block of size SZ.
+ */
+void *
+kmalloc(size_t sz)
+{
+	vaddr_t label;
+	void *ptr;
+	unsigned period;
+
+#ifdef __GNUC__
+	label = (vaddr_t)__builtin_return_address(0);
+#else
+#error "Don't know how to get return address with this compiler"
+#endif /* __GNUC__ */
+
+	ptr = kmalloc_label(sz, label);
+	if (ptr != NULL) {
+		period = kprof_sampletime();
+		if (period != 0) {
+			kprof_record(ptr, sz, label, period);
+		}
+	}
+	return ptr;
+}
+
 /*
  * Free a block previously returned from kmalloc.
  */
@@ -1264,7 +2270,14 @@ kfree(void *ptr)
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+	kprof_forget(ptr);
+#ifdef MAGAZINES
+	if (kmcache_free(ptr)) {
+		return;
+	}
+#endif
+	if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
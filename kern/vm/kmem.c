@@ -0,0 +1,420 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Object caches. See kmem.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <kmem.h>
+
+/*
+ * A slab is one page. The header sits at the start of the page and
+ * the object slots follow, so the slab an object belongs to is found
+ * by rounding its address down to the page.
+ *
+ * Free slots are chained through a link word. For caches with a
+ * constructor the link gets a word of its own after the object, so
+ * freeing doesn't clobber the constructed state; otherwise it
+ * overlays the start of the object.
+ */
+struct kmem_slab {
+	struct kmem_cache *ks_cache;	/* owner */
+	struct kmem_slab *ks_next;	/* on one of the cache's lists */
+	struct kmem_slab *ks_prev;
+	void *ks_free;			/* free slots */
+	unsigned ks_inuse;		/* allocated slots */
+};
+
+struct kmem_cache {
+	struct spinlock kc_lock;
+	const char *kc_name;
+	void (*kc_ctor)(void *obj);
+	size_t kc_objsize;		/* as requested */
+	size_t kc_slotsize;		/* including alignment and link */
+	size_t kc_linkoff;		/* offset of the link word in a slot */
+	unsigned kc_perslab;		/* slots per slab */
+
+	/* Slabs, by how full they are. */
+	struct kmem_slab *kc_partial;
+	struct kmem_slab *kc_full;
+	struct kmem_slab *kc_empty;
+	unsigned kc_nslabs;
+	unsigned kc_nempty;
+
+	/* statistics */
+	unsigned kc_inuse;		/* objects allocated now */
+	unsigned kc_allocs;		/* kmem_cache_alloc calls */
+	unsigned kc_frees;		/* kmem_cache_free calls */
+
+	/* Registry of all caches, under kmem_lock. */
+	struct kmem_cache *kc_next;
+};
+
+/* Slots are aligned to this, like kmalloc's blocks. */
+#define KMEM_ALIGN	8
+#define KMEM_ROUNDUP(x)	(((x) + KMEM_ALIGN - 1) & ~(size_t)(KMEM_ALIGN - 1))
+
+/* Offset of the first slot in a slab. */
+#define KMEM_SLOTBASE	KMEM_ROUNDUP(sizeof(struct kmem_slab))
+
+/* Empty slabs each cache holds on to before giving pages back. */
+#define KMEM_MAXEMPTY	2
+
+/* Protects the cache registry. Ordered before every kc_lock. */
+static struct spinlock kmem_lock = SPINLOCK_INITIALIZER;
+static struct kmem_cache *kmem_caches;
+
+////////////////////////////////////////////////////////////
+// slab lists
+
+static
+void
+kmem_slab_push(struct kmem_slab **head, struct kmem_slab *ks)
+{
+	ks->ks_prev = NULL;
+	ks->ks_next = *head;
+	if (*head != NULL) {
+		(*head)->ks_prev = ks;
+	}
+	*head = ks;
+}
+
+static
+void
+kmem_slab_unlink(struct kmem_slab **head, struct kmem_slab *ks)
+{
+	if (ks->ks_prev != NULL) {
+		ks->ks_prev->ks_next = ks->ks_next;
+	}
+	else {
+		KASSERT(*head == ks);
+		*head = ks->ks_next;
+	}
+	if (ks->ks_next != NULL) {
+		ks->ks_next->ks_prev = ks->ks_prev;
+	}
+	ks->ks_next = ks->ks_prev = NULL;
+}
+
+static
+inline
+void **
+kmem_link(struct kmem_cache *kc, void *obj)
+{
+	return (void **)((char *)obj + kc->kc_linkoff);
+}
+
+/*
+ * Make a new slab, with every slot constructed and free. Called
+ * without kc_lock, since alloc_kpages may sleep.
+ */
+static
+struct kmem_slab *
+kmem_slab_create(struct kmem_cache *kc)
+{
+	struct kmem_slab *ks;
+	vaddr_t va;
+	char *obj;
+	unsigned i;
+
+	va = alloc_kpages(1);
+	if (va == 0) {
+		return NULL;
+	}
+	KASSERT((va & PAGE_FRAME) == va);
+
+	ks = (struct kmem_slab *)va;
+	ks->ks_cache = kc;
+	ks->ks_next = ks->ks_prev = NULL;
+	ks->ks_free = NULL;
+	ks->ks_inuse = 0;
+
+	/* Chain the slots in reverse so they're handed out in order. */
+	for (i = kc->kc_perslab; i-- > 0; ) {
+		obj = (char *)va + KMEM_SLOTBASE + i * kc->kc_slotsize;
+		if (kc->kc_ctor != NULL) {
+			kc->kc_ctor(obj);
+		}
+		*kmem_link(kc, obj) = ks->ks_free;
+		ks->ks_free = obj;
+	}
+	return ks;
+}
+
+////////////////////////////////////////////////////////////
+// interface
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size, void (*ctor)(void *obj))
+{
+	struct kmem_cache *kc;
+	size_t slotsize;
+
+	KASSERT(size > 0);
+
+	if (ctor != NULL) {
+		slotsize = KMEM_ROUNDUP(size) + KMEM_ROUNDUP(sizeof(void *));
+	}
+	else {
+		slotsize = KMEM_ROUNDUP(size < sizeof(void *) ?
+					sizeof(void *) : size);
+	}
+	KASSERT(KMEM_SLOTBASE + 2 * slotsize <= PAGE_SIZE);
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+	spinlock_init(&kc->kc_lock);
+	kc->kc_name = name;
+	kc->kc_ctor = ctor;
+	kc->kc_objsize = size;
+	kc->kc_slotsize = slotsize;
+	kc->kc_linkoff = ctor != NULL ? KMEM_ROUNDUP(size) : 0;
+	kc->kc_perslab = (PAGE_SIZE - KMEM_SLOTBASE) / slotsize;
+	kc->kc_partial = kc->kc_full = kc->kc_empty = NULL;
+	kc->kc_nslabs = 0;
+	kc->kc_nempty = 0;
+	kc->kc_inuse = 0;
+	kc->kc_allocs = 0;
+	kc->kc_frees = 0;
+
+	spinlock_acquire(&kmem_lock);
+	kc->kc_next = kmem_caches;
+	kmem_caches = kc;
+	spinlock_release(&kmem_lock);
+
+	return kc;
+}
+
+void
+kmem_cache_destroy(struct kmem_cache *kc)
+{
+	struct kmem_cache **p;
+	struct kmem_slab *ks;
+
+	spinlock_acquire(&kmem_lock);
+	for (p = &kmem_caches; *p != kc; p = &(*p)->kc_next) {
+		KASSERT(*p != NULL);
+	}
+	*p = kc->kc_next;
+	spinlock_release(&kmem_lock);
+
+	KASSERT(kc->kc_inuse == 0);
+	KASSERT(kc->kc_partial == NULL);
+	KASSERT(kc->kc_full == NULL);
+
+	while (kc->kc_empty != NULL) {
+		ks = kc->kc_empty;
+		kmem_slab_unlink(&kc->kc_empty, ks);
+		free_kpages((vaddr_t)ks);
+	}
+
+	spinlock_cleanup(&kc->kc_lock);
+	kfree(kc);
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct kmem_slab *ks, *newks;
+	void *obj;
+
+	spinlock_acquire(&kc->kc_lock);
+	while (kc->kc_partial == NULL && kc->kc_empty == NULL) {
+		/*
+		 * We release the spinlock while calling alloc_kpages,
+		 * like kmalloc does. Someone else may have freed an
+		 * object or grown the cache meanwhile; if so we keep
+		 * the new slab as an empty one anyway.
+		 */
+		spinlock_release(&kc->kc_lock);
+		newks = kmem_slab_create(kc);
+		if (newks == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&kc->kc_lock);
+		kmem_slab_push(&kc->kc_empty, newks);
+		kc->kc_nslabs++;
+		kc->kc_nempty++;
+	}
+
+	if (kc->kc_partial != NULL) {
+		ks = kc->kc_partial;
+		kmem_slab_unlink(&kc->kc_partial, ks);
+	}
+	else {
+		ks = kc->kc_empty;
+		kmem_slab_unlink(&kc->kc_empty, ks);
+		kc->kc_nempty--;
+	}
+
+	obj = ks->ks_free;
+	KASSERT(obj != NULL);
+	ks->ks_free = *kmem_link(kc, obj);
+	ks->ks_inuse++;
+
+	if (ks->ks_inuse == kc->kc_perslab) {
+		kmem_slab_push(&kc->kc_full, ks);
+	}
+	else {
+		kmem_slab_push(&kc->kc_partial, ks);
+	}
+
+	kc->kc_inuse++;
+	kc->kc_allocs++;
+	spinlock_release(&kc->kc_lock);
+
+	return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	struct kmem_slab *ks, *extra = NULL;
+
+	KASSERT(obj != NULL);
+	ks = (struct kmem_slab *)((vaddr_t)obj & PAGE_FRAME);
+	if (ks->ks_cache != kc) {
+		panic("kmem_cache_free: %p isn't from cache %s\n",
+		      obj, kc->kc_name);
+	}
+	KASSERT(((vaddr_t)obj - (vaddr_t)ks - KMEM_SLOTBASE)
+		% kc->kc_slotsize == 0);
+
+	spinlock_acquire(&kc->kc_lock);
+	KASSERT(ks->ks_inuse > 0);
+
+	*kmem_link(kc, obj) = ks->ks_free;
+	ks->ks_free = obj;
+
+	if (ks->ks_inuse == kc->kc_perslab) {
+		kmem_slab_unlink(&kc->kc_full, ks);
+	}
+	else {
+		kmem_slab_unlink(&kc->kc_partial, ks);
+	}
+	ks->ks_inuse--;
+
+	if (ks->ks_inuse == 0) {
+		if (kc->kc_nempty < KMEM_MAXEMPTY) {
+			kmem_slab_push(&kc->kc_empty, ks);
+			kc->kc_nempty++;
+		}
+		else {
+			extra = ks;
+			kc->kc_nslabs--;
+		}
+	}
+	else {
+		kmem_slab_push(&kc->kc_partial, ks);
+	}
+
+	kc->kc_inuse--;
+	kc->kc_frees++;
+	spinlock_release(&kc->kc_lock);
+
+	if (extra != NULL) {
+		free_kpages((vaddr_t)extra);
+	}
+}
+
+unsigned
+kmem_reclaim(void)
+{
+	struct kmem_cache *kc;
+	struct kmem_slab *ks, *list = NULL;
+	unsigned n = 0;
+
+	spinlock_acquire(&kmem_lock);
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		spinlock_acquire(&kc->kc_lock);
+		while (kc->kc_empty != NULL) {
+			ks = kc->kc_empty;
+			kmem_slab_unlink(&kc->kc_empty, ks);
+			ks->ks_next = list;
+			list = ks;
+			n++;
+		}
+		kc->kc_nslabs -= kc->kc_nempty;
+		kc->kc_nempty = 0;
+		spinlock_release(&kc->kc_lock);
+	}
+	spinlock_release(&kmem_lock);
+
+	/* Call free_kpages without holding any of our locks. */
+	while (list != NULL) {
+		ks = list;
+		list = ks->ks_next;
+		free_kpages((vaddr_t)ks);
+	}
+	return n;
+}
+
+void
+kmem_printstats(void)
+{
+	struct kmem_cache *kc, copy;
+	unsigned i, j;
+
+	kprintf("%-12s %6s %6s %6s %6s %8s %10s %10s\n", "cache",
+		"size", "slot", "/slab", "slabs", "inuse", "allocs", "frees");
+
+	/*
+	 * Copy each cache out under the locks so we don't kprintf
+	 * while holding a spinlock.
+	 */
+	for (i = 0; ; i++) {
+		spinlock_acquire(&kmem_lock);
+		kc = kmem_caches;
+		for (j = 0; j < i && kc != NULL; j++) {
+			kc = kc->kc_next;
+		}
+		if (kc != NULL) {
+			spinlock_acquire(&kc->kc_lock);
+			copy = *kc;
+			spinlock_release(&kc->kc_lock);
+		}
+		spinlock_release(&kmem_lock);
+
+		if (kc == NULL) {
+			break;
+		}
+		kprintf("%-12s %6u %6u %6u %6u %8u %10u %10u\n",
+			copy.kc_name, (unsigned)copy.kc_objsize,
+			(unsigned)copy.kc_slotsize, copy.kc_perslab,
+			copy.kc_nslabs, copy.kc_inuse,
+			copy.kc_allocs, copy.kc_frees);
+	}
+}
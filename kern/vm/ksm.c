@@ -0,0 +1,318 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Same-page merging scanner. See ksm.h.
+ *
+ * Each pass walks every physical page once, in batches, building a
+ * table from content hash to page. Pages are hashed without being
+ * pinned, so a hash is only a hint; when a page's hash matches one
+ * already in the table, both pages are pinned and shot down from the
+ * TLBs, so nobody can write them, and then compared in full before
+ * being merged.
+ *
+ * Only a private page (one reference, with a known owner) can be
+ * merged away, since we need its one PTE to point elsewhere. It can
+ * be merged into any user page with the same contents, including one
+ * that is already shared.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <addrspace.h>
+#include <pagetable.h>
+#include <vm.h>
+#include <coremap.h>
+#include <ksm.h>
+
+/* Pages looked at per wakeup, and seconds between wakeups */
+#define KSM_BATCH	256
+#define KSM_INTERVAL	1
+
+struct ksm_slot {
+	uint32_t ks_hash;
+	paddr_t ks_pa;			/* 0 if empty */
+};
+
+/*
+ * Hash table for the current pass; open addressing, twice as many
+ * slots as pages so it never fills. Only the scanner thread uses it.
+ */
+static struct ksm_slot *ksm_table;
+static unsigned ksm_tablesize;		/* a power of 2 */
+
+/* Statistics, protected by ksm_lock */
+static struct spinlock ksm_lock = SPINLOCK_INITIALIZER;
+static unsigned ksm_passes;		/* complete sweeps */
+static unsigned ksm_scanned;		/* user pages hashed */
+static unsigned ksm_matches;		/* hash matches */
+static unsigned ksm_mismatches;		/* ...that weren't identical */
+static unsigned ksm_merged;		/* pages merged away */
+
+/*
+ * FNV-1a over the words of the page.
+ */
+static
+uint32_t
+ksm_hash(paddr_t pa)
+{
+	const uint32_t *p;
+	uint32_t h;
+	unsigned i;
+
+	p = (const uint32_t *)PADDR_TO_KVADDR(pa);
+	h = 2166136261U;
+	for (i=0; i<PAGE_SIZE / sizeof(uint32_t); i++) {
+		h = (h ^ p[i]) * 16777619U;
+	}
+	return h;
+}
+
+/*
+ * Check whether two pages have the same contents.
+ */
+static
+bool
+ksm_same(paddr_t a, paddr_t b)
+{
+	const uint32_t *pa, *pb;
+	unsigned i;
+
+	pa = (const uint32_t *)PADDR_TO_KVADDR(a);
+	pb = (const uint32_t *)PADDR_TO_KVADDR(b);
+	for (i=0; i<PAGE_SIZE / sizeof(uint32_t); i++) {
+		if (pa[i] != pb[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Merge the private page SRC into DST, if they're identical. Returns
+ * true if SRC is gone.
+ */
+static
+bool
+ksm_merge(paddr_t src, paddr_t dst)
+{
+	struct addrspace *sas, *das;
+	vaddr_t sva, dva;
+	unsigned srefs, drefs;
+	pte_t *pte;
+
+	if (!coremap_trypin(src, &sas, &sva, &srefs)) {
+		return false;
+	}
+	if (srefs != 1 || sas == NULL) {
+		coremap_unpin(src);
+		return false;
+	}
+	if (!coremap_trypin(dst, &das, &dva, &drefs)) {
+		coremap_unpin(src);
+		return false;
+	}
+	if (drefs == 1 && das == NULL) {
+		/* Was shared; we can't find its mapping to protect it. */
+		coremap_unpin(dst);
+		coremap_unpin(src);
+		return false;
+	}
+	if (!coremap_canmerge(dst)) {
+		/*
+		 * A MAP_SHARED or file cache page. The former is
+		 * written in place, and those writes would show through
+		 * the private mapping we'd point at it.
+		 */
+		coremap_unpin(dst);
+		coremap_unpin(src);
+		return false;
+	}
+
+	/*
+	 * Get rid of any writeable TLB entries. While the pages are
+	 * pinned they can't be faulted back in. (Pages shared
+	 * copy-on-write are never mapped writeable. MAP_SHARED pages
+	 * are, but coremap_canmerge turned those down above.)
+	 */
+	vm_tlbunmap(sas, sva, sva + PAGE_SIZE);
+	if (drefs == 1) {
+		vm_tlbunmap(das, dva, dva + PAGE_SIZE);
+	}
+
+	if (!ksm_same(src, dst)) {
+		coremap_unpin(dst);
+		coremap_unpin(src);
+		spinlock_acquire(&ksm_lock);
+		ksm_mismatches++;
+		spinlock_release(&ksm_lock);
+		return false;
+	}
+
+	pte = pt_lookup(sas->as_pt, sva, false);
+	KASSERT(pte != NULL);
+	KASSERT((*pte & PTE_VALID) && (*pte & PTE_FRAME) == src);
+
+	coremap_incref(dst);
+	coremap_markmerged(dst);
+	*pte = dst | (*pte & ~PTE_FRAME);
+	coremap_decref(src);
+	coremap_unpin(dst);
+
+	spinlock_acquire(&ksm_lock);
+	ksm_merged++;
+	spinlock_release(&ksm_lock);
+	return true;
+}
+
+/*
+ * Look at one physical page.
+ */
+static
+void
+ksm_scanpage(paddr_t pa)
+{
+	struct ksm_slot *ks;
+	unsigned refs, otherrefs;
+	uint32_t h, i;
+
+	refs = coremap_userrefs(pa);
+	if (refs == 0) {
+		return;
+	}
+
+	h = ksm_hash(pa);
+	spinlock_acquire(&ksm_lock);
+	ksm_scanned++;
+	spinlock_release(&ksm_lock);
+
+	for (i = h & (ksm_tablesize - 1); ; i = (i + 1) & (ksm_tablesize - 1)) {
+		ks = &ksm_table[i];
+		if (ks->ks_pa == 0) {
+			/* New contents; remember them. */
+			ks->ks_hash = h;
+			ks->ks_pa = pa;
+			return;
+		}
+		if (ks->ks_hash == h && ks->ks_pa != pa) {
+			break;
+		}
+	}
+
+	spinlock_acquire(&ksm_lock);
+	ksm_matches++;
+	spinlock_release(&ksm_lock);
+
+	/* Merge whichever one is private into the other. */
+	if (refs == 1) {
+		ksm_merge(pa, ks->ks_pa);
+		return;
+	}
+	otherrefs = coremap_userrefs(ks->ks_pa);
+	if (otherrefs == 1 && ksm_merge(ks->ks_pa, pa)) {
+		ks->ks_pa = pa;
+	}
+}
+
+static
+void
+ksm_thread(void *p, unsigned long n)
+{
+	unsigned pn, i, npages;
+
+	(void)p;
+	(void)n;
+
+	npages = coremap_totalpages();
+	pn = 0;
+	while (1) {
+		for (i=0; i<KSM_BATCH; i++) {
+			if (pn == npages) {
+				/* Start a new pass with an empty table. */
+				bzero(ksm_table,
+				      ksm_tablesize * sizeof(ksm_table[0]));
+				pn = 0;
+				spinlock_acquire(&ksm_lock);
+				ksm_passes++;
+				spinlock_release(&ksm_lock);
+			}
+			ksm_scanpage((paddr_t)pn * PAGE_SIZE);
+			pn++;
+		}
+		clocksleep(KSM_INTERVAL);
+	}
+}
+
+void
+ksm_bootstrap(void)
+{
+	int result;
+
+	ksm_tablesize = 1;
+	while (ksm_tablesize < 2 * coremap_totalpages()) {
+		ksm_tablesize *= 2;
+	}
+	ksm_table = kmalloc(ksm_tablesize * sizeof(ksm_table[0]));
+	if (ksm_table == NULL) {
+		panic("ksm_bootstrap: Out of memory\n");
+	}
+	bzero(ksm_table, ksm_tablesize * sizeof(ksm_table[0]));
+
+	result = thread_fork("ksm", NULL, ksm_thread, NULL, 0);
+	if (result) {
+		panic("ksm_bootstrap: thread_fork: %s\n", strerror(result));
+	}
+}
+
+void
+ksm_printstats(void)
+{
+	unsigned passes, scanned, matches, mismatches, merged;
+	unsigned frames, saved;
+
+	spinlock_acquire(&ksm_lock);
+	passes = ksm_passes;
+	scanned = ksm_scanned;
+	matches = ksm_matches;
+	mismatches = ksm_mismatches;
+	merged = ksm_merged;
+	spinlock_release(&ksm_lock);
+
+	coremap_mergestats(&frames, &saved);
+
+	kprintf("ksm: %u passes, %u pages hashed, %u matches "
+		"(%u false), %u pages merged\n",
+		passes, scanned, matches, mismatches, merged);
+	kprintf("ksm: %u shared pages now saving %u pages (%u KB)\n",
+		frames, saved, saved * (PAGE_SIZE / 1024));
+}
@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Two-level user page tables. See pagetable.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pagetable.h>
+#include <swap.h>
+
+struct pagetable *
+pt_create(void)
+{
+	struct pagetable *pt;
+	unsigned i;
+
+	pt = kmalloc(sizeof(*pt));
+	if (pt == NULL) {
+		return NULL;
+	}
+	for (i=0; i<PT_L1_ENTRIES; i++) {
+		pt->pt_dir[i] = NULL;
+	}
+	return pt;
+}
+
+void
+pt_destroy(struct pagetable *pt)
+{
+	unsigned i, j;
+	pte_t *l2;
+
+	for (i=0; i<PT_L1_ENTRIES; i++) {
+		l2 = pt->pt_dir[i];
+		if (l2 == NULL) {
+			continue;
+		}
+		for (j=0; j<PT_L2_ENTRIES; j++) {
+			/* Pinning waits out any eviction in progress. */
+			if (coremap_pin(&l2[j])) {
+				coremap_decref(l2[j] & PTE_FRAME);
+			}
+			else if (l2[j] & PTE_SWAP) {
+				swap_decref(PTE_SWAPSLOT(l2[j]));
+			}
+		}
+		free_kpages((vaddr_t)l2);
+	}
+	kfree(pt);
+}
+
+pte_t *
+pt_lookup(struct pagetable *pt, vaddr_t va, bool create)
+{
+	pte_t *l2;
+
+	KASSERT(va < USERSPACETOP);
+
+	l2 = pt->pt_dir[PT_L1_INDEX(va)];
+	if (l2 == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		/* An all-zero table is all invalid entries. */
+		l2 = (pte_t *)alloc_kzpage();
+		if (l2 == NULL) {
+			return NULL;
+		}
+		pt->pt_dir[PT_L1_INDEX(va)] = l2;
+	}
+	return &l2[PT_L2_INDEX(va)];
+}
+
+unsigned
+pt_unmap(struct pagetable *pt, vaddr_t start, vaddr_t end)
+{
+	pte_t *l2, *pte;
+	paddr_t pa;
+	unsigned slot, n;
+	vaddr_t va;
+
+	KASSERT(start <= end && end <= USERSPACETOP);
+
+	n = 0;
+	va = start;
+	while (va < end) {
+		l2 = pt->pt_dir[PT_L1_INDEX(va)];
+		if (l2 == NULL) {
+			/* Nothing in this 4M; skip to the next. */
+			va = (vaddr_t)(PT_L1_INDEX(va) + 1) << PT_L1_SHIFT;
+			continue;
+		}
+		pte = &l2[PT_L2_INDEX(va)];
+		if (coremap_pin(pte)) {
+			pa = *pte & PTE_FRAME;
+			*pte = 0;
+			coremap_decref(pa);
+			n++;
+		}
+		else if (*pte & PTE_SWAP) {
+			slot = PTE_SWAPSLOT(*pte);
+			*pte = 0;
+			swap_decref(slot);
+		}
+		va += PAGE_SIZE;
+	}
+	return n;
+}
+
+int
+pt_copy(struct pagetable *old, struct pagetable *new, unsigned *resident)
+{
+	unsigned i, j;
+	pte_t *l2;
+	pte_t *newpte;
+	vaddr_t va;
+
+	*resident = 0;
+	for (i=0; i<PT_L1_ENTRIES; i++) {
+		l2 = old->pt_dir[i];
+		if (l2 == NULL) {
+			continue;
+		}
+		for (j=0; j<PT_L2_ENTRIES; j++) {
+			if (l2[j] == 0) {
+				continue;
+			}
+			va = (i << PT_L1_SHIFT) | (j << PT_L2_SHIFT);
+			newpte = pt_lookup(new, va, true);
+			if (newpte == NULL) {
+				return ENOMEM;
+			}
+			if (coremap_pin(&l2[j])) {
+				coremap_incref(l2[j] & PTE_FRAME);
+				*newpte = l2[j];
+				coremap_unpin(l2[j] & PTE_FRAME);
+				(*resident)++;
+			}
+			else if (l2[j] & PTE_SWAP) {
+				swap_incref(PTE_SWAPSLOT(l2[j]));
+				*newpte = l2[j];
+			}
+		}
+	}
+	return 0;
+}
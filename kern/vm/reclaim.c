@@ -0,0 +1,274 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Reclaim daemon. See reclaim.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <thread.h>
+#include <current.h>
+#include <vm.h>
+#include <coremap.h>
+#include <reclaim.h>
+
+/*
+ * reclaim_lock protects everything below except the source list,
+ * which is only appended to (at boot) and never shrinks.
+ *
+ * Lock ordering: reclaim_lock before the coremap lock.
+ */
+static struct spinlock reclaim_lock = SPINLOCK_INITIALIZER;
+static struct wchan *reclaim_wchan;	/* the daemon sleeps here */
+static struct wchan *reclaim_waitchan;	/* allocators sleep here */
+static struct thread *reclaim_thread;	/* the daemon; NULL until it runs */
+
+static struct reclaimer *reclaim_sources;
+static struct reclaimer **reclaim_sourcetail = &reclaim_sources;
+
+static unsigned reclaim_low;		/* wake the daemon below this */
+static unsigned reclaim_high;		/* ...and reclaim up to this */
+
+static bool reclaim_requested;		/* an allocator wants a pass */
+static unsigned reclaim_gen;		/* bumped whenever waiters wake */
+static bool reclaim_exhausted;		/* last pass found nothing */
+
+/* Statistics */
+static unsigned reclaim_wakeups;	/* daemon passes */
+static unsigned reclaim_waits;		/* allocators that slept */
+static unsigned reclaim_failedwaits;	/* ...and were told to give up */
+static unsigned reclaim_directs;	/* reclaims done without the daemon */
+static unsigned reclaim_scans;		/* clock steps during passes */
+static struct timespec reclaim_busytime; /* time spent in passes */
+
+void
+reclaim_register(struct reclaimer *rc)
+{
+	rc->rc_next = NULL;
+	rc->rc_calls = 0;
+	rc->rc_pages = 0;
+
+	spinlock_acquire(&reclaim_lock);
+	*reclaim_sourcetail = rc;
+	reclaim_sourcetail = &rc->rc_next;
+	spinlock_release(&reclaim_lock);
+}
+
+/*
+ * Try each source in turn until one frees something. Returns the
+ * number of pages freed.
+ */
+static
+unsigned
+reclaim_some(unsigned npages)
+{
+	struct reclaimer *rc;
+	unsigned got;
+
+	got = 0;
+	for (rc = reclaim_sources; rc != NULL && got == 0; rc = rc->rc_next) {
+		got = rc->rc_reclaim(npages);
+
+		spinlock_acquire(&reclaim_lock);
+		rc->rc_calls++;
+		rc->rc_pages += got;
+		spinlock_release(&reclaim_lock);
+	}
+	return got;
+}
+
+/*
+ * Reclaim until the high watermark is reached or nothing more can be
+ * freed, waking waiting allocators every time there's progress.
+ * Returns the number of pages freed.
+ */
+static
+unsigned
+reclaim_run(void)
+{
+	unsigned nfree, got, freed;
+
+	freed = 0;
+	while ((nfree = coremap_nfree()) < reclaim_high) {
+		got = reclaim_some(reclaim_high - nfree);
+		if (got == 0) {
+			break;
+		}
+		freed += got;
+
+		spinlock_acquire(&reclaim_lock);
+		reclaim_exhausted = false;
+		reclaim_gen++;
+		wchan_wakeall(reclaim_waitchan, &reclaim_lock);
+		spinlock_release(&reclaim_lock);
+	}
+	return freed;
+}
+
+static
+void
+reclaim_daemon(void *p, unsigned long n)
+{
+	struct timespec start, end, delta;
+	unsigned scans, freed;
+
+	(void)p;
+	(void)n;
+
+	spinlock_acquire(&reclaim_lock);
+	reclaim_thread = curthread;
+	while (1) {
+		while (!reclaim_requested && coremap_nfree() >= reclaim_low) {
+			wchan_sleep(reclaim_wchan, &reclaim_lock);
+		}
+		reclaim_requested = false;
+		reclaim_wakeups++;
+		spinlock_release(&reclaim_lock);
+
+		gettime(&start);
+		scans = coremap_clockscans();
+		freed = reclaim_run();
+		gettime(&end);
+
+		spinlock_acquire(&reclaim_lock);
+		timespec_sub(&end, &start, &delta);
+		timespec_add(&reclaim_busytime, &delta, &reclaim_busytime);
+		reclaim_scans += coremap_clockscans() - scans;
+
+		/* Tell the waiters how it went. */
+		reclaim_exhausted = freed == 0 && coremap_nfree() == 0;
+		reclaim_gen++;
+		wchan_wakeall(reclaim_waitchan, &reclaim_lock);
+	}
+}
+
+void
+reclaim_bootstrap(void)
+{
+	int result;
+
+	/* Keep about 3% of memory free, and at least a few pages. */
+	reclaim_low = coremap_nfree() / 32;
+	if (reclaim_low < 4) {
+		reclaim_low = 4;
+	}
+	reclaim_high = reclaim_low * 2;
+
+	reclaim_wchan = wchan_create("reclaim");
+	reclaim_waitchan = wchan_create("reclaim_wait");
+	if (reclaim_wchan == NULL || reclaim_waitchan == NULL) {
+		panic("reclaim_bootstrap: Out of memory\n");
+	}
+
+	result = thread_fork("reclaim", NULL, reclaim_daemon, NULL, 0);
+	if (result) {
+		panic("reclaim_bootstrap: thread_fork: %s\n",
+		      strerror(result));
+	}
+}
+
+void
+reclaim_check(void)
+{
+	if (reclaim_thread == NULL || coremap_nfree() >= reclaim_low) {
+		return;
+	}
+	spinlock_acquire(&reclaim_lock);
+	wchan_wakeone(reclaim_wchan, &reclaim_lock);
+	spinlock_release(&reclaim_lock);
+}
+
+bool
+reclaim_wait(void)
+{
+	unsigned gen;
+	bool ok;
+
+	if (reclaim_thread == NULL || curthread == reclaim_thread) {
+		/* Nobody to wait for; do it ourselves. */
+		spinlock_acquire(&reclaim_lock);
+		reclaim_directs++;
+		spinlock_release(&reclaim_lock);
+		return reclaim_some(1) > 0;
+	}
+
+	spinlock_acquire(&reclaim_lock);
+	reclaim_waits++;
+	gen = reclaim_gen;
+	reclaim_requested = true;
+	wchan_wakeone(reclaim_wchan, &reclaim_lock);
+	while (reclaim_gen == gen) {
+		wchan_sleep(reclaim_waitchan, &reclaim_lock);
+	}
+	ok = !reclaim_exhausted;
+	if (!ok) {
+		reclaim_failedwaits++;
+	}
+	spinlock_release(&reclaim_lock);
+
+	return ok;
+}
+
+void
+reclaim_printstats(void)
+{
+	struct reclaimer *rc;
+	unsigned wakeups, waits, failedwaits, directs, scans;
+	struct timespec busy;
+	uint64_t ms;
+
+	spinlock_acquire(&reclaim_lock);
+	wakeups = reclaim_wakeups;
+	waits = reclaim_waits;
+	failedwaits = reclaim_failedwaits;
+	directs = reclaim_directs;
+	scans = reclaim_scans;
+	busy = reclaim_busytime;
+	spinlock_release(&reclaim_lock);
+
+	ms = busy.tv_sec * 1000ULL + busy.tv_nsec / 1000000;
+
+	kprintf("reclaim: watermarks %u/%u pages, %u free now\n",
+		reclaim_low, reclaim_high, coremap_nfree());
+	kprintf("reclaim: %u daemon passes, %u waits (%u failed), "
+		"%u direct\n", wakeups, waits, failedwaits, directs);
+	kprintf("reclaim: clock scanned %u pages in %llu.%03llu s "
+		"(%llu pages per second)\n", scans,
+		(unsigned long long)ms / 1000, (unsigned long long)ms % 1000,
+		ms ? (unsigned long long)scans * 1000 / ms : 0ULL);
+	for (rc = reclaim_sources; rc != NULL; rc = rc->rc_next) {
+		kprintf("reclaim: %s: %u calls, %u pages\n",
+			rc->rc_name, rc->rc_calls, rc->rc_pages);
+	}
+}
@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Swap space management. See swap.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <bitmap.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <vm.h>
+#include <swap.h>
+#include "opt-zswap.h"
+#if OPT_ZSWAP
+#include <zswap.h>
+#endif
+
+/* The disk we swap to */
+#define SWAP_DEVICE	"lhd0:"
+
+static struct vnode *swap_vnode;	/* NULL if no swap */
+static unsigned swap_nslots;
+
+/*
+ * swap_lock protects the bitmap, the reference counts, and the
+ * statistics. The I/O itself needs no lock; each slot is only ever
+ * read or written by whoever holds the page that belongs in it.
+ */
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+static struct bitmap *swap_map;		/* which slots are in use */
+static uint16_t *swap_refcounts;	/* references per slot */
+static unsigned swap_nused;
+
+/* Statistics */
+static unsigned swap_pageouts;
+static unsigned swap_pageins;
+static unsigned swap_zpageins;		/* served by the compressed pool */
+static unsigned swap_maxused;
+
+void
+swap_bootstrap(void)
+{
+	struct stat st;
+	struct vnode *vn;
+	unsigned i;
+	int result;
+
+#if OPT_ZSWAP
+	zswap_bootstrap();
+#endif
+
+	result = vfs_swapon(SWAP_DEVICE, &vn);
+	if (result) {
+		kprintf("swap: %s: %s; running without swap\n",
+			SWAP_DEVICE, strerror(result));
+		return;
+	}
+
+	result = VOP_STAT(vn, &st);
+	if (result) {
+		panic("swap: stat %s: %s\n", SWAP_DEVICE, strerror(result));
+	}
+
+	swap_nslots = st.st_size / PAGE_SIZE;
+	if (swap_nslots > SWAP_ZSLOT) {
+		/* Can't number any more than that. */
+		swap_nslots = SWAP_ZSLOT;
+	}
+	swap_map = bitmap_create(swap_nslots);
+	swap_refcounts = kmalloc(swap_nslots * sizeof(swap_refcounts[0]));
+	if (swap_map == NULL || swap_refcounts == NULL) {
+		panic("swap: Out of memory\n");
+	}
+	for (i=0; i<swap_nslots; i++) {
+		swap_refcounts[i] = 0;
+	}
+
+	/* Publish this last; swap_alloc uses it to see if we have swap. */
+	swap_vnode = vn;
+
+	kprintf("swap: %u pages on %s\n", swap_nslots, SWAP_DEVICE);
+}
+
+/*
+ * Allocate a disk slot, with one reference.
+ */
+static
+int
+swap_alloc(unsigned *slot)
+{
+	int result;
+
+	if (swap_vnode == NULL) {
+		return ENOSPC;
+	}
+
+	spinlock_acquire(&swap_lock);
+	result = bitmap_alloc(swap_map, slot);
+	if (result) {
+		spinlock_release(&swap_lock);
+		return ENOSPC;
+	}
+	KASSERT(swap_refcounts[*slot] == 0);
+	swap_refcounts[*slot] = 1;
+	swap_nused++;
+	if (swap_nused > swap_maxused) {
+		swap_maxused = swap_nused;
+	}
+	spinlock_release(&swap_lock);
+	return 0;
+}
+
+bool
+swap_hasroom(void)
+{
+	bool ret;
+
+#if OPT_ZSWAP
+	if (!zswap_full()) {
+		return true;
+	}
+#endif
+	if (swap_vnode == NULL) {
+		return false;
+	}
+	spinlock_acquire(&swap_lock);
+	ret = swap_nused < swap_nslots;
+	spinlock_release(&swap_lock);
+	return ret;
+}
+
+void
+swap_incref(unsigned slot)
+{
+#if OPT_ZSWAP
+	if (slot & SWAP_ZSLOT) {
+		zswap_incref(slot & ~SWAP_ZSLOT);
+		return;
+	}
+#endif
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(swap_refcounts[slot] > 0);
+	if (swap_refcounts[slot] == 0xffff) {
+		panic("swap_incref: too many references to slot %u\n", slot);
+	}
+	swap_refcounts[slot]++;
+	spinlock_release(&swap_lock);
+}
+
+void
+swap_decref(unsigned slot)
+{
+#if OPT_ZSWAP
+	if (slot & SWAP_ZSLOT) {
+		zswap_decref(slot & ~SWAP_ZSLOT);
+		return;
+	}
+#endif
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(swap_refcounts[slot] > 0);
+	swap_refcounts[slot]--;
+	if (swap_refcounts[slot] == 0) {
+		bitmap_unmark(swap_map, slot);
+		swap_nused--;
+	}
+	spinlock_release(&swap_lock);
+}
+
+/*
+ * Transfer one page between memory and SLOT.
+ */
+static
+int
+swap_io(unsigned slot, paddr_t pa, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(swap_vnode != NULL);
+	KASSERT(slot < swap_nslots);
+	KASSERT((pa & PAGE_FRAME) == pa);
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(pa), PAGE_SIZE,
+		  (off_t)slot * PAGE_SIZE, rw);
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vnode, &ku);
+	}
+	else {
+		result = VOP_WRITE(swap_vnode, &ku);
+	}
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		return EIO;
+	}
+	return 0;
+}
+
+int
+swap_store(paddr_t pa, unsigned *slot)
+{
+	int result;
+
+#if OPT_ZSWAP
+	unsigned handle;
+
+	if (zswap_store(pa, &handle) == 0) {
+		*slot = handle | SWAP_ZSLOT;
+		return 0;
+	}
+	/* Didn't compress well enough, or the pool is full. */
+#endif
+
+	result = swap_alloc(slot);
+	if (result) {
+		return result;
+	}
+	result = swap_io(*slot, pa, UIO_WRITE);
+	if (result) {
+		swap_decref(*slot);
+		return result;
+	}
+	spinlock_acquire(&swap_lock);
+	swap_pageouts++;
+	spinlock_release(&swap_lock);
+	return 0;
+}
+
+int
+swap_pagein(unsigned slot, paddr_t pa)
+{
+	int result;
+
+#if OPT_ZSWAP
+	if (slot & SWAP_ZSLOT) {
+		zswap_load(slot & ~SWAP_ZSLOT, pa);
+		spinlock_acquire(&swap_lock);
+		swap_zpageins++;
+		spinlock_release(&swap_lock);
+		return 0;
+	}
+#endif
+
+	result = swap_io(slot, pa, UIO_READ);
+	if (result == 0) {
+		spinlock_acquire(&swap_lock);
+		swap_pageins++;
+		spinlock_release(&swap_lock);
+	}
+	return result;
+}
+
+void
+swap_printstats(void)
+{
+	unsigned nused, maxused, pageouts, pageins, zpageins;
+#if OPT_ZSWAP
+	unsigned long total;
+#endif
+
+	spinlock_acquire(&swap_lock);
+	nused = swap_nused;
+	maxused = swap_maxused;
+	pageouts = swap_pageouts;
+	pageins = swap_pageins;
+	zpageins = swap_zpageins;
+	spinlock_release(&swap_lock);
+
+#if OPT_ZSWAP
+	zswap_printstats();
+	total = (unsigned long)zpageins + pageins;
+	kprintf("zswap: %u hits, %u misses (%lu%% hit)\n", zpageins,
+		pageins, total ? (unsigned long)zpageins * 100 / total : 0UL);
+#else
+	(void)zpageins;
+#endif
+
+	if (swap_vnode == NULL) {
+		kprintf("swap: none\n");
+		return;
+	}
+
+	kprintf("swap: %u of %u slots used (max %u), "
+		"%u pageouts, %u pageins\n",
+		nused, swap_nslots, maxused, pageouts, pageins);
+}
@@ -0,0 +1,1378 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Machine-independent part of the VM system: kernel page allocation
+ * and user page faults. Address spaces are in addrspace.c, page tables
+ * in pagetable.c, and physical memory in coremap.c.
+ *
+ * Note! If OPT_DUMBVM is set this file is not used; see dumbvm.c.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spl.h>
+#include <clock.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <proc.h>
+#include <current.h>
+#include <uio.h>
+#include <vnode.h>
+#include <mips/tlb.h>
+#include <addrspace.h>
+#include <pagetable.h>
+#include <vm.h>
+#include <coremap.h>
+#include <swap.h>
+#include <reclaim.h>
+#include <ksm.h>
+#include <filecache.h>
+#include <kmem.h>
+
+/* Fault statistics, protected by vmstats_lock */
+static struct spinlock vmstats_lock = SPINLOCK_INITIALIZER;
+static unsigned vmstats_faults;		/* calls to vm_fault */
+static unsigned vmstats_zerofills;	/* pages zero-filled on demand */
+static unsigned vmstats_stackgrowths;	/* faults that grew the stack */
+static unsigned vmstats_filereads;	/* pages read from files on demand */
+static unsigned vmstats_filehits;	/* file pages found in the cache */
+static unsigned vmstats_tlbloads;	/* TLB entries loaded */
+static unsigned vmstats_aroundloads;	/* ...of which preloaded neighbors */
+static unsigned vmstats_cowcopies;	/* shared frames copied on write */
+static unsigned vmstats_cowreuses;	/* write faults on unshared frames */
+static unsigned vmstats_evictions;	/* pages written out to swap */
+static unsigned vmstats_pageins;	/* pages read back from swap */
+static unsigned vmstats_oomkills;	/* processes killed for memory */
+static unsigned vmstats_asidallocs;	/* ASIDs handed out */
+static unsigned vmstats_asidrollovers;	/* TLB flushes for ASID reuse */
+static unsigned vmstats_shootdowns;	/* vm_tlbunmap calls */
+static unsigned vmstats_shootipis;	/* cpus asked to shoot down */
+static unsigned vmstats_shootskips;	/* cpus skipped as not needed */
+static unsigned vmstats_shootmerges;	/* requests merged into others */
+static unsigned vmstats_shootprobes;	/* ranges done page by page */
+static unsigned vmstats_shootscans;	/* ranges done by TLB scan */
+static unsigned vmstats_shootflushes;	/* queue overflow flushes */
+static unsigned vmstats_lastloads;	/* tlbloads at last printstats */
+static struct timespec vmstats_lasttime; /* time of last printstats */
+
+/*
+ * Fault latency histogram, also under vmstats_lock. Bucket 0 counts
+ * faults that took under 1 us; bucket N, those that took 2^(N-1) to
+ * 2^N us; the last bucket also takes everything slower.
+ *
+ * Timing a fault costs two reads of the timer device, so it's off
+ * unless turned on from the menu ("vmp on"). vm_faulthist_on is read
+ * without the lock; a fault that races with turning it on or off
+ * just isn't counted.
+ */
+#define VM_FAULTHIST_BUCKETS	16
+static unsigned vm_faulthist[VM_FAULTHIST_BUCKETS];
+static bool vm_faulthist_on;
+
+/*
+ * Fault-around: on a fault, also load TLB entries for resident pages
+ * in the same aligned block of vm_faultaround pages, so sequential
+ * access doesn't trap once per page. Only free TLB slots are used, so
+ * this never pushes out live entries. 0 or 1 turns it off; settable
+ * with vm_setfaultaround (menu command "fa").
+ */
+#define VM_FAULTAROUND_DEFAULT	8
+static unsigned vm_faultaround = VM_FAULTAROUND_DEFAULT;
+
+/*
+ * Only one thread evicts at a time. This keeps the disk from seeking
+ * between writes.
+ */
+static struct lock *vm_evictlock;
+
+/* Pages to page out per call from the reclaim daemon */
+#define VM_EVICT_BATCH	8
+
+static int vm_evict(void);
+
+/*
+ * Out-of-memory killing. Only one thread picks a victim at a time;
+ * the others wait for it and then retry. A process's score is its
+ * resident size, scaled down as it gets older so that long-running
+ * processes (like the shell) outlast the newcomers that filled up
+ * memory: at VM_OOM_AGEHALF seconds old a process counts half.
+ *
+ * A victim asleep in the kernel may never get back to user mode to
+ * exit. So a kill only counts as in progress for VM_OOM_WAITSECS;
+ * after that the next-worst process is picked (killed processes
+ * score 0).
+ */
+static struct lock *vm_oomlock;
+static struct timespec vm_oomlastkill;	/* under vm_oomlock */
+#define VM_OOM_AGEHALF	10	/* seconds */
+#define VM_OOM_WAITSECS	5	/* how long to wait for a victim */
+
+/*
+ * Reclaim sources, cheapest first: the free pages sitting in the
+ * per-cpu magazines (including heap pages freed up by draining the
+ * kmalloc magazines), then paging out.
+ */
+static
+unsigned
+vm_reclaim_magazines(unsigned npages)
+{
+	(void)npages;
+	kheap_drain();
+	return coremap_drain();
+}
+
+static
+unsigned
+vm_reclaim_slabs(unsigned npages)
+{
+	(void)npages;
+	return kmem_reclaim();
+}
+
+static
+unsigned
+vm_reclaim_swap(unsigned npages)
+{
+	unsigned n;
+
+	for (n = 0; n < npages && n < VM_EVICT_BATCH; n++) {
+		if (vm_evict()) {
+			break;
+		}
+	}
+	return n;
+}
+
+static struct reclaimer vm_slab_reclaimer = {
+	.rc_name = "slabs",
+	.rc_reclaim = vm_reclaim_slabs,
+};
+
+static struct reclaimer vm_magazine_reclaimer = {
+	.rc_name = "magazines",
+	.rc_reclaim = vm_reclaim_magazines,
+};
+
+static struct reclaimer vm_swap_reclaimer = {
+	.rc_name = "swap",
+	.rc_reclaim = vm_reclaim_swap,
+};
+
+void
+vm_bootstrap(void)
+{
+	coremap_bootstrap();
+	gettime(&vmstats_lasttime);
+
+	vm_evictlock = lock_create("vm_evict");
+	vm_oomlock = lock_create("vm_oom");
+	if (vm_evictlock == NULL || vm_oomlock == NULL) {
+		panic("vm_bootstrap: Out of memory\n");
+	}
+
+	swap_bootstrap();
+
+	/* Slabs first, so the magazines pass sweeps up their pages. */
+	reclaim_register(&vm_slab_reclaimer);
+	reclaim_register(&vm_magazine_reclaimer);
+	filecache_bootstrap();
+	reclaim_register(&vm_swap_reclaimer);
+	reclaim_bootstrap();
+	ksm_bootstrap();
+}
+
+/*
+ * Check if we're in a context that can sleep.
+ */
+static
+void
+vm_can_sleep(void)
+{
+	if (CURCPU_EXISTS()) {
+		/* must not hold spinlocks */
+		KASSERT(curcpu->c_spinlocks == 0);
+
+		/* must not be in an interrupt handler */
+		KASSERT(curthread->t_in_interrupt == 0);
+	}
+}
+
+/*
+ * OOM score of PROC, whose p_lock is held, as of the time in DATA.
+ * Kernel-only processes score 0 and are never picked.
+ */
+static
+unsigned
+vm_oomscore(struct proc *proc, void *data)
+{
+	struct timespec *now = data;
+	struct timespec age;
+	unsigned resident;
+
+	if (proc->p_addrspace == NULL) {
+		return 0;
+	}
+	/* One word, so no need for as_reslock to read it. */
+	resident = proc->p_addrspace->as_resident;
+
+	timespec_sub(now, &proc->p_starttime, &age);
+	return (uint64_t)resident * VM_OOM_AGEHALF /
+		(VM_OOM_AGEHALF + age.tv_sec);
+}
+
+/*
+ * Out of memory, and the reclaim daemon couldn't help: kill a process
+ * and wait (a while) for a victim to exit and give its memory back.
+ * Returns true if it's worth retrying the allocation.
+ */
+static
+bool
+vm_oom(void)
+{
+	struct timespec now, since;
+	unsigned i, nkilled;
+	bool ok;
+
+	if (vm_oomlock == NULL || curproc == NULL || curproc == kproc ||
+	    curproc->p_killed) {
+		/*
+		 * Too early, or a kernel thread (which may be holding
+		 * things the victim needs to exit), or we're a victim
+		 * ourselves and should fail and get on with exiting.
+		 */
+		return false;
+	}
+
+	lock_acquire(vm_oomlock);
+	if (coremap_nfree() > 0) {
+		/* Someone else's kill already made room. */
+		lock_release(vm_oomlock);
+		return true;
+	}
+	gettime(&now);
+	timespec_sub(&now, &vm_oomlastkill, &since);
+	nkilled = proc_nkilled();
+	if (nkilled == 0 || since.tv_sec >= VM_OOM_WAITSECS) {
+		/* None pending, or the pending ones look stuck. */
+		if (!proc_killworst(vm_oomscore, &now)) {
+			/* Nobody (else) to kill. */
+			lock_release(vm_oomlock);
+			return false;
+		}
+		vm_oomlastkill = now;
+		nkilled++;
+		spinlock_acquire(&vmstats_lock);
+		vmstats_oomkills++;
+		spinlock_release(&vmstats_lock);
+	}
+	if (curproc->p_killed) {
+		/* We were the worst. */
+		lock_release(vm_oomlock);
+		return false;
+	}
+
+	/*
+	 * The victim may be asleep holding something we have (a pinned
+	 * page it shares with us, say), so don't wait forever. Any
+	 * victim exiting is progress; stuck ones never will.
+	 */
+	for (i = 0; i < VM_OOM_WAITSECS && proc_nkilled() >= nkilled; i++) {
+		clocksleep(1);
+	}
+	ok = proc_nkilled() < nkilled || coremap_nfree() > 0;
+	lock_release(vm_oomlock);
+
+	return ok;
+}
+
+/*
+ * Allocate physical pages. If there's no memory, wait for the reclaim
+ * daemon to make some, and failing that kill a process. Only single
+ * pages are waited for; the daemon doesn't try to free contiguous
+ * runs.
+ */
+static
+paddr_t
+vm_getppages(unsigned npages)
+{
+	paddr_t pa;
+
+	pa = coremap_alloc(npages);
+	while (pa == 0 && npages == 1 && (reclaim_wait() || vm_oom())) {
+		pa = coremap_alloc(1);
+	}
+	reclaim_check();
+	return pa;
+}
+
+/*
+ * Allocate a single zero-filled physical page, waiting for memory
+ * like vm_getppages.
+ */
+static
+paddr_t
+vm_getzeroedpage(void)
+{
+	paddr_t pa;
+
+	pa = coremap_alloc_zeroed();
+	while (pa == 0 && (reclaim_wait() || vm_oom())) {
+		pa = coremap_alloc_zeroed();
+	}
+	reclaim_check();
+	return pa;
+}
+
+/*
+ * Idle-time work, called from the idle loop (thread_switch) with
+ * interrupts off before each cpu_idle, so it must not sleep: keep
+ * the zero pool topped up, a page at a time. Returns true if there
+ * might be more to do, in which case the caller should check for
+ * runnable threads and call us again rather than idling.
+ */
+bool
+vm_idle(void)
+{
+	return coremap_zerofill();
+}
+
+/* Allocate/free some kernel-space virtual pages */
+vaddr_t
+alloc_kpages(unsigned npages)
+{
+	paddr_t pa;
+
+	vm_can_sleep();
+	pa = vm_getppages(npages);
+	if (pa==0) {
+		return 0;
+	}
+	return PADDR_TO_KVADDR(pa);
+}
+
+/* Allocate one zero-filled kernel page */
+vaddr_t
+alloc_kzpage(void)
+{
+	paddr_t pa;
+
+	vm_can_sleep();
+	pa = vm_getzeroedpage();
+	if (pa == 0) {
+		return 0;
+	}
+	return PADDR_TO_KVADDR(pa);
+}
+
+void
+free_kpages(vaddr_t addr)
+{
+	KASSERT(addr >= MIPS_KSEG0 && addr < MIPS_KSEG1);
+	coremap_free(addr - MIPS_KSEG0);
+}
+
+void
+vm_printstats(void)
+{
+	unsigned faults, zerofills, filereads, filehits, tlbloads;
+	unsigned aroundloads, stackgrowths;
+	unsigned cowcopies, cowreuses;
+	unsigned asidallocs, asidrollovers, loads, evictions, pageins;
+	unsigned oomkills;
+	unsigned shootdowns, shootipis, shootskips, shootmerges;
+	unsigned shootprobes, shootscans, shootflushes;
+	struct timespec now, delta;
+	uint64_t ms;
+
+	coremap_printstats();
+
+	gettime(&now);
+	spinlock_acquire(&vmstats_lock);
+	faults = vmstats_faults;
+	zerofills = vmstats_zerofills;
+	filereads = vmstats_filereads;
+	filehits = vmstats_filehits;
+	tlbloads = vmstats_tlbloads;
+	aroundloads = vmstats_aroundloads;
+	stackgrowths = vmstats_stackgrowths;
+	cowcopies = vmstats_cowcopies;
+	cowreuses = vmstats_cowreuses;
+	asidallocs = vmstats_asidallocs;
+	asidrollovers = vmstats_asidrollovers;
+	evictions = vmstats_evictions;
+	oomkills = vmstats_oomkills;
+	pageins = vmstats_pageins;
+	shootdowns = vmstats_shootdowns;
+	shootipis = vmstats_shootipis;
+	shootskips = vmstats_shootskips;
+	shootmerges = vmstats_shootmerges;
+	shootprobes = vmstats_shootprobes;
+	shootscans = vmstats_shootscans;
+	shootflushes = vmstats_shootflushes;
+	loads = tlbloads - vmstats_lastloads;
+	timespec_sub(&now, &vmstats_lasttime, &delta);
+	vmstats_lastloads = tlbloads;
+	vmstats_lasttime = now;
+	spinlock_release(&vmstats_lock);
+
+	ms = delta.tv_sec * 1000ULL + delta.tv_nsec / 1000000;
+
+	kprintf("vm: %u faults, %u zero-fills, %u file reads, "
+		"%u cached file pages, %u tlb loads\n",
+		faults, zerofills, filereads, filehits, tlbloads);
+	kprintf("vm: fault-around window %u pages, %u traps avoided\n",
+		vm_faultaround, aroundloads);
+	kprintf("vm: %u stack growth faults\n", stackgrowths);
+	kprintf("vm: %u tlb loads in the last %llu.%03llu s "
+		"(%llu per second)\n", loads,
+		(unsigned long long)ms / 1000, (unsigned long long)ms % 1000,
+		ms ? (unsigned long long)loads * 1000 / ms : 0ULL);
+	kprintf("vm: %u asids assigned, %u rollover flushes\n",
+		asidallocs, asidrollovers);
+	kprintf("vm: %u shootdowns, %u ipis, %u cpus skipped, "
+		"%u merged\n", shootdowns, shootipis, shootskips, shootmerges);
+	kprintf("vm: shootdown ranges: %u probed, %u scanned, "
+		"%u full flushes\n", shootprobes, shootscans, shootflushes);
+	kprintf("vm: copy-on-write: %u copies, %u reuses\n",
+		cowcopies, cowreuses);
+	kprintf("vm: %u evictions, %u pageins, %u oom kills\n",
+		evictions, pageins, oomkills);
+	filecache_printstats();
+	swap_printstats();
+	reclaim_printstats();
+	ksm_printstats();
+}
+
+void
+vm_printfaulthist(void)
+{
+	unsigned hist[VM_FAULTHIST_BUCKETS];
+	unsigned i, total;
+
+	spinlock_acquire(&vmstats_lock);
+	memcpy(hist, vm_faulthist, sizeof(hist));
+	spinlock_release(&vmstats_lock);
+
+	total = 0;
+	for (i = 0; i < VM_FAULTHIST_BUCKETS; i++) {
+		total += hist[i];
+	}
+
+	if (!vm_faulthist_on && total == 0) {
+		kprintf("Fault latency: not recorded (vmp on to start)\n");
+		return;
+	}
+	kprintf("Fault latency (%u faults%s):\n", total,
+		vm_faulthist_on ? "" : ", recording off");
+	for (i = 0; i < VM_FAULTHIST_BUCKETS; i++) {
+		if (i == 0) {
+			kprintf("  %8s < %6u us", "", 1U);
+		}
+		else if (i == VM_FAULTHIST_BUCKETS - 1) {
+			kprintf("  %6u us <= %8s", 1U << (i - 1), "");
+		}
+		else {
+			kprintf("  %6u us -  %6u us", 1U << (i - 1), 1U << i);
+		}
+		kprintf(": %8u  %3u%%\n", hist[i],
+			total ? hist[i] * 100 / total : 0);
+	}
+}
+
+void
+vm_setfaulthist(bool on)
+{
+	spinlock_acquire(&vmstats_lock);
+	if (on && !vm_faulthist_on) {
+		/* Start afresh. */
+		bzero(vm_faulthist, sizeof(vm_faulthist));
+	}
+	vm_faulthist_on = on;
+	spinlock_release(&vmstats_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// TLB and address space IDs
+//
+// Each cpu hands out the hardware's ASIDs (1 to NUM_ASID-1; 0 is
+// used when no address space is active) to address spaces as they
+// are activated on it. When it runs out it flushes its whole TLB,
+// starts a new generation, and starts over, so all previously
+// assigned ASIDs become stale at once. The TLB is otherwise never
+// flushed on context switch.
+//
+// An address space remembers, per cpu, the tag
+//	generation * NUM_ASID + asid
+// it was given there, or 0 for none; a tag is only valid if its
+// generation is that cpu's current one. Forgetting a tag (setting
+// it to 0) is enough to guarantee that the entries made under it
+// will never match again, since the ASID won't be handed out again
+// until after the next flush.
+//
+// The per-cpu state lives in struct cpu and is only touched by that
+// cpu with interrupts off.
+
+/*
+ * Invalidate every entry in this cpu's TLB. Interrupts must be off.
+ */
+static
+void
+vm_tlbflush(void)
+{
+	int i;
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	/* Put the current ASID back. */
+	tlb_setentryhi(curcpu->c_asid_cur << TLBHI_PIDSHIFT);
+}
+
+void
+vm_tlbactivate(struct addrspace *as)
+{
+	struct cpu *c;
+	uint32_t tag;
+	int spl;
+
+	spl = splhigh();
+	c = curcpu;
+
+	tag = as->as_asid[c->c_number];
+	if (tag / NUM_ASID != c->c_asid_gen) {
+		if (c->c_asid_next == NUM_ASID) {
+			/* Out of ASIDs; start a new generation. */
+			c->c_asid_gen++;
+			c->c_asid_next = 1;
+			vm_tlbflush();
+			spinlock_acquire(&vmstats_lock);
+			vmstats_asidrollovers++;
+			spinlock_release(&vmstats_lock);
+		}
+		tag = c->c_asid_gen * NUM_ASID + c->c_asid_next++;
+		as->as_asid[c->c_number] = tag;
+		spinlock_acquire(&vmstats_lock);
+		vmstats_asidallocs++;
+		spinlock_release(&vmstats_lock);
+	}
+
+	c->c_asid_cur = tag % NUM_ASID;
+	tlb_setentryhi(c->c_asid_cur << TLBHI_PIDSHIFT);
+
+	splx(spl);
+}
+
+/*
+ * Forget AS's ASIDs on every cpu but this one. This cpu's entries are
+ * the caller's business.
+ *
+ * Since processes are single-threaded, AS can't be active on another
+ * cpu, so nobody else is using the tags we clear.
+ */
+static
+void
+vm_tlbinvalidate_remote(struct addrspace *as)
+{
+	unsigned i, me;
+	int spl;
+
+	spl = splhigh();
+	me = curcpu->c_number;
+	for (i=0; i<MAXCPUS; i++) {
+		if (i != me) {
+			as->as_asid[i] = 0;
+		}
+	}
+	splx(spl);
+}
+
+void
+vm_tlbinvalidate(struct addrspace *as)
+{
+	unsigned i;
+
+	for (i=0; i<MAXCPUS; i++) {
+		as->as_asid[i] = 0;
+	}
+	if (as == proc_getas()) {
+		vm_tlbactivate(as);
+	}
+}
+
+/*
+ * Past this many pages, a range is cleared from the TLB by reading
+ * every entry rather than probing for each page.
+ */
+#define VM_SHOOTDOWN_MAXPAGES	16
+
+/*
+ * Remove this cpu's TLB entries, if any, for [START, END) in AS.
+ * Interrupts must be off.
+ */
+static
+void
+vm_tlbunmap_local(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	struct cpu *c;
+	uint32_t tag, pid, ehi, elo;
+	vaddr_t va;
+	int i;
+
+	c = curcpu;
+	tag = as->as_asid[c->c_number];
+	if (tag / NUM_ASID != c->c_asid_gen) {
+		/* No live ASID here, so no entries either. */
+		return;
+	}
+	pid = (tag % NUM_ASID) << TLBHI_PIDSHIFT;
+
+	if ((end - start) / PAGE_SIZE <= VM_SHOOTDOWN_MAXPAGES) {
+		for (va = start; va < end; va += PAGE_SIZE) {
+			i = tlb_probe(va | pid, 0);
+			if (i >= 0) {
+				tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+			}
+		}
+	}
+	else {
+		for (i=0; i<NUM_TLB; i++) {
+			tlb_read(&ehi, &elo, i);
+			if ((elo & TLBLO_VALID) &&
+			    (ehi & TLBHI_PID) == pid &&
+			    (ehi & TLBHI_VPAGE) >= start &&
+			    (ehi & TLBHI_VPAGE) < end) {
+				tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+			}
+		}
+	}
+	tlb_setentryhi(c->c_asid_cur << TLBHI_PIDSHIFT);
+}
+
+/*
+ * Remove [START, END) in AS from every cpu's TLB, and wait until
+ * that's done. Cpus where AS has no live ASID are left alone.
+ */
+void
+vm_tlbunmap(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	struct tlbshootdown ts;
+	unsigned n;
+	int spl;
+
+	KASSERT(as != NULL);
+	ts.ts_as = as;
+	ts.ts_start = start & PAGE_FRAME;
+	ts.ts_end = ROUNDUP(end, PAGE_SIZE);
+	KASSERT(ts.ts_start < ts.ts_end);
+
+	spl = splhigh();
+	vm_tlbunmap_local(as, ts.ts_start, ts.ts_end);
+	splx(spl);
+
+	n = ipi_tlbshootdown_allcpus(&ts);
+
+	spinlock_acquire(&vmstats_lock);
+	vmstats_shootdowns++;
+	vmstats_shootipis += n;
+	spinlock_release(&vmstats_lock);
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	int spl;
+
+	spl = splhigh();
+	if (ts->ts_as == NULL) {
+		vm_tlbflush();
+	}
+	else {
+		vm_tlbunmap_local(ts->ts_as, ts->ts_start, ts->ts_end);
+	}
+	splx(spl);
+
+	spinlock_acquire(&vmstats_lock);
+	if (ts->ts_as == NULL) {
+		vmstats_shootflushes++;
+	}
+	else if ((ts->ts_end - ts->ts_start) / PAGE_SIZE
+		 <= VM_SHOOTDOWN_MAXPAGES) {
+		vmstats_shootprobes++;
+	}
+	else {
+		vmstats_shootscans++;
+	}
+	spinlock_release(&vmstats_lock);
+}
+
+void
+vm_tlbshootdown_all(void)
+{
+	int spl;
+
+	spl = splhigh();
+	vm_tlbflush();
+	splx(spl);
+
+	spinlock_acquire(&vmstats_lock);
+	vmstats_shootflushes++;
+	spinlock_release(&vmstats_lock);
+}
+
+/*
+ * Requests for the same address space merge if their ranges overlap
+ * or touch. A full flush swallows anything.
+ */
+bool
+vm_tlbshootdown_coalesce(struct tlbshootdown *pending,
+			 const struct tlbshootdown *ts)
+{
+	if (pending->ts_as != NULL) {
+		if (pending->ts_as != ts->ts_as ||
+		    ts->ts_end < pending->ts_start ||
+		    ts->ts_start > pending->ts_end) {
+			return false;
+		}
+		if (ts->ts_start < pending->ts_start) {
+			pending->ts_start = ts->ts_start;
+		}
+		if (ts->ts_end > pending->ts_end) {
+			pending->ts_end = ts->ts_end;
+		}
+	}
+
+	spinlock_acquire(&vmstats_lock);
+	vmstats_shootmerges++;
+	spinlock_release(&vmstats_lock);
+	return true;
+}
+
+/*
+ * A cpu can only have entries for AS if AS has an ASID there from the
+ * cpu's current generation. We look without that cpu's cooperation;
+ * the worst a stale read can do is send an IPI that wasn't needed,
+ * because a tag that isn't live can't become live again, and a fresh
+ * one has no entries yet.
+ */
+bool
+vm_tlbshootdown_needed(const struct cpu *c, const struct tlbshootdown *ts)
+{
+	uint32_t tag;
+
+	if (ts->ts_as == NULL) {
+		return true;
+	}
+	tag = ts->ts_as->as_asid[c->c_number];
+	if (tag / NUM_ASID == c->c_asid_gen) {
+		return true;
+	}
+
+	spinlock_acquire(&vmstats_lock);
+	vmstats_shootskips++;
+	spinlock_release(&vmstats_lock);
+	return false;
+}
+
+/*
+ * Load a translation for the current address space into the TLB,
+ * replacing any existing entry for the same page, or a random entry
+ * if there is none. If WRITEABLE is false the entry is loaded without
+ * the dirty bit, so a store to the page traps with VM_FAULT_READONLY.
+ */
+static
+void
+vm_tlbload(vaddr_t va, paddr_t pa, bool writeable)
+{
+	uint32_t ehi, elo;
+	int i, spl;
+
+	elo = (pa & TLBLO_PPAGE) | TLBLO_VALID;
+	if (writeable) {
+		elo |= TLBLO_DIRTY;
+	}
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+	ehi = (va & TLBHI_VPAGE) | (curcpu->c_asid_cur << TLBHI_PIDSHIFT);
+	i = tlb_probe(ehi, 0);
+	if (i >= 0) {
+		tlb_write(ehi, elo, i);
+	}
+	else {
+		tlb_random(ehi, elo);
+	}
+	splx(spl);
+}
+
+/*
+ * Preload TLB entries for the resident neighbors of VA (which was
+ * just loaded) in region VR of AS, into free TLB slots only. Each one
+ * is pinned while it's loaded, like in vm_fault, so eviction can't
+ * shoot it down before we load it; pages somebody else has pinned
+ * are just skipped. Returns the number of entries loaded.
+ */
+static
+unsigned
+vm_faultaround_load(struct addrspace *as, struct vm_region *vr, vaddr_t va)
+{
+	int freeslots[VM_FAULTAROUND_MAX];
+	unsigned nfree, nloaded, window;
+	struct addrspace *owner;
+	vaddr_t start, end, nva, ownerva;
+	uint32_t ehi, elo;
+	unsigned refs;
+	pte_t *pte;
+	paddr_t pa;
+	int i, spl;
+
+	window = vm_faultaround;
+	if (window <= 1) {
+		return 0;
+	}
+	if ((vr->vr_perm & (VR_READ | VR_EXEC)) == 0) {
+		return 0;
+	}
+	start = va & ~(vaddr_t)(window * PAGE_SIZE - 1);
+	end = start + window * PAGE_SIZE;
+	if (start < vr->vr_base) {
+		start = vr->vr_base;
+	}
+	if (end > vr->vr_base + vr->vr_npages * PAGE_SIZE) {
+		end = vr->vr_base + vr->vr_npages * PAGE_SIZE;
+	}
+
+	nloaded = 0;
+	spl = splhigh();
+
+	/* Find free slots first; without any there's nothing to do. */
+	nfree = 0;
+	for (i=0; i<NUM_TLB && nfree < window - 1; i++) {
+		tlb_read(&ehi, &elo, i);
+		if ((elo & TLBLO_VALID) == 0) {
+			freeslots[nfree++] = i;
+		}
+	}
+	tlb_setentryhi(curcpu->c_asid_cur << TLBHI_PIDSHIFT);
+
+	for (nva = start; nva < end && nloaded < nfree; nva += PAGE_SIZE) {
+		if (nva == va) {
+			continue;
+		}
+		pte = pt_lookup(as->as_pt, nva, false);
+		if (pte == NULL || (*pte & PTE_VALID) == 0) {
+			continue;
+		}
+		pa = *pte & PTE_FRAME;
+		if (!coremap_trypin(pa, &owner, &ownerva, &refs)) {
+			continue;
+		}
+		if ((*pte & (PTE_FRAME | PTE_VALID)) != (pa | PTE_VALID)) {
+			/* Changed before we pinned it. */
+			coremap_unpin(pa);
+			continue;
+		}
+
+		ehi = nva | (curcpu->c_asid_cur << TLBHI_PIDSHIFT);
+		if (tlb_probe(ehi, 0) < 0) {
+			/* Same rules as vm_fault for writeability. */
+			elo = (pa & TLBLO_PPAGE) | TLBLO_VALID;
+			if ((vr->vr_flags & VRF_SHARED) == 0 &&
+			    (vr->vr_perm & VR_WRITE) && refs == 1 &&
+			    owner == as && ownerva == nva) {
+				elo |= TLBLO_DIRTY;
+			}
+			tlb_write(ehi, elo, freeslots[nloaded++]);
+		}
+		coremap_unpin(pa);
+	}
+	tlb_setentryhi(curcpu->c_asid_cur << TLBHI_PIDSHIFT);
+
+	splx(spl);
+	return nloaded;
+}
+
+/*
+ * Set the fault-around window, in pages. Must be a power of two no
+ * bigger than VM_FAULTAROUND_MAX; 0 turns fault-around off.
+ */
+int
+vm_setfaultaround(unsigned npages)
+{
+	if (npages > VM_FAULTAROUND_MAX || (npages & (npages - 1)) != 0) {
+		return EINVAL;
+	}
+	vm_faultaround = npages;
+	return 0;
+}
+
+unsigned
+vm_getfaultaround(void)
+{
+	return vm_faultaround;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Paging
+
+/*
+ * Page out one user page to make room. Returns 0 if a page was
+ * freed, or an error if nothing could be. Normally called from the
+ * reclaim daemon.
+ *
+ * The victim stays pinned throughout, which keeps its owner from
+ * faulting it back into a TLB (vm_fault pins before loading the TLB)
+ * and keeps as_destroy from freeing the page table under us. We
+ * shoot down existing TLB entries before writing the page out, so
+ * nobody can change it while it's being written.
+ */
+static
+int
+vm_evict(void)
+{
+	struct addrspace *as;
+	vaddr_t va;
+	paddr_t pa;
+	pte_t *pte;
+	unsigned slot;
+	int result;
+
+	if (vm_evictlock == NULL || lock_do_i_hold(vm_evictlock)) {
+		/* Too early, or we're being called from swap I/O. */
+		return ENOMEM;
+	}
+
+	lock_acquire(vm_evictlock);
+
+	if (!swap_hasroom()) {
+		lock_release(vm_evictlock);
+		return ENOMEM;
+	}
+
+	pa = coremap_pickvictim(&as, &va);
+	if (pa == 0) {
+		lock_release(vm_evictlock);
+		return ENOMEM;
+	}
+
+	pte = pt_lookup(as->as_pt, va, false);
+	KASSERT(pte != NULL);
+	KASSERT((*pte & PTE_VALID) && (*pte & PTE_FRAME) == pa);
+
+	vm_tlbunmap(as, va, va + PAGE_SIZE);
+
+	result = swap_store(pa, &slot);
+	if (result) {
+		if (result != ENOSPC) {
+			kprintf("vm: pageout: %s\n", strerror(result));
+		}
+		coremap_unpin(pa);
+		lock_release(vm_evictlock);
+		return ENOMEM;
+	}
+
+	*pte = PTE_MKSWAP(slot);
+	coremap_free(pa);
+	as->as_swapouts++;
+	as_addresident(as, -1);
+
+	spinlock_acquire(&vmstats_lock);
+	vmstats_evictions++;
+	spinlock_release(&vmstats_lock);
+
+	lock_release(vm_evictlock);
+	return 0;
+}
+
+/*
+ * Get ready to write to the page PTE maps, which the caller has
+ * pinned. If its frame is shared copy-on-write, give this address
+ * space a private copy; the PTE is then left mapping the new frame,
+ * pinned, and the old one is unpinned. If it was shared but everyone
+ * else has since let go of it, just keep it.
+ *
+ * Our own reference keeps the refcount from dropping to zero, and
+ * new references are only added with the page pinned (by as_copy in
+ * this address space, or by the merge scanner), so a count of 1
+ * seen here can't go back up while we have it.
+ */
+static
+int
+vm_unshare(struct addrspace *as, vaddr_t va, pte_t *pte)
+{
+	paddr_t oldpa, newpa;
+
+	oldpa = *pte & PTE_FRAME;
+	if (coremap_refcount(oldpa) == 1) {
+		spinlock_acquire(&vmstats_lock);
+		vmstats_cowreuses++;
+		spinlock_release(&vmstats_lock);
+		return 0;
+	}
+
+	newpa = vm_getppages(1);
+	if (newpa == 0) {
+		return ENOMEM;
+	}
+	coremap_setuser(newpa, as, va);
+	memmove((void *)PADDR_TO_KVADDR(newpa),
+		(const void *)PADDR_TO_KVADDR(oldpa), PAGE_SIZE);
+	*pte = newpa | (*pte & ~PTE_FRAME);
+	coremap_decref(oldpa);
+
+	/* Other cpus may still have the old frame in their TLBs. */
+	vm_tlbinvalidate_remote(as);
+
+	spinlock_acquire(&vmstats_lock);
+	vmstats_cowcopies++;
+	spinlock_release(&vmstats_lock);
+	return 0;
+}
+
+/*
+ * Work out which part of the page at VA comes from VR's file, if
+ * any: the file data goes from START to END.
+ */
+static
+bool
+vm_filespan(struct vm_region *vr, vaddr_t va, vaddr_t *start, vaddr_t *end)
+{
+	if (vr->vr_vnode == NULL) {
+		return false;
+	}
+	*start = va > vr->vr_fileaddr ? va : vr->vr_fileaddr;
+	*end = vr->vr_fileaddr + vr->vr_filesize;
+	if (*end > va + PAGE_SIZE) {
+		*end = va + PAGE_SIZE;
+	}
+	/* If not, this page is all bss. */
+	return *start < *end;
+}
+
+/*
+ * Materialize the page at VA in a file-backed region, whose PTE is
+ * PTE, and hand back its frame, pinned. The file data (from START to
+ * END) is read into a zeroed page. Pages of VRF_CACHED regions are
+ * shared through the file cache, so they're only read once no matter
+ * how many processes use them. Sets *READ if we did read the file.
+ */
+static
+int
+vm_filepage(struct addrspace *as, struct vm_region *vr, vaddr_t va,
+	    vaddr_t start, vaddr_t end, pte_t *pte, paddr_t *ret, bool *read)
+{
+	struct iovec iov;
+	struct uio ku;
+	paddr_t pa, cached;
+	off_t offset;
+	bool shared;
+	int result;
+
+	*read = false;
+	offset = vr->vr_fileoff + (start - vr->vr_fileaddr);
+	shared = (vr->vr_flags & VRF_CACHED) != 0;
+
+	if (shared) {
+		pa = filecache_lookup(vr->vr_vnode, offset,
+				      start - va, end - start);
+		if (pa != 0) {
+			coremap_pinpage(pa);
+			*pte = pa | PTE_VALID;
+			*ret = pa;
+			return 0;
+		}
+	}
+
+	pa = vm_getzeroedpage();
+	if (pa == 0) {
+		return ENOMEM;
+	}
+	coremap_setuser(pa, as, va);
+
+	uio_kinit(&iov, &ku, (void *)(PADDR_TO_KVADDR(pa) + (start - va)),
+		  end - start, offset, UIO_READ);
+	result = VOP_READ(vr->vr_vnode, &ku);
+	if (result == 0 && ku.uio_resid != 0 &&
+	    (vr->vr_flags & VRF_MMAP) == 0) {
+		/* The file shrank since it was mapped. */
+		result = EIO;
+	}
+	/* (For mmap, the part past EOF just reads as zeros.) */
+	if (result) {
+		coremap_decref(pa);
+		return result;
+	}
+	*read = true;
+
+	if (shared) {
+		cached = filecache_insert(vr->vr_vnode, offset,
+					  start - va, end - start, pa);
+		if (cached != pa) {
+			/* Someone else read it meanwhile; use theirs. */
+			coremap_decref(pa);
+			pa = cached;
+			coremap_pinpage(pa);
+		}
+	}
+
+	*pte = pa | PTE_VALID;
+	*ret = pa;
+	return 0;
+}
+
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+	struct addrspace *as;
+	struct vm_region *vr;
+	pte_t *pte;
+	paddr_t pa;
+	vaddr_t start, end;
+	unsigned slot;
+	bool zerofilled, fileread, filemapped, pagedin, owned, writeable;
+	bool resident, cowbroke, timed;
+	unsigned around, bucket;
+	struct timespec before, after, delta;
+	uint64_t us;
+	int result;
+
+	faultaddress &= PAGE_FRAME;
+
+	DEBUG(DB_VM, "vm: fault: 0x%x\n", faultaddress);
+
+	switch (faulttype) {
+	    case VM_FAULT_READONLY:
+	    case VM_FAULT_READ:
+	    case VM_FAULT_WRITE:
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	if (curproc == NULL) {
+		/*
+		 * No process. This is probably a kernel fault early
+		 * in boot. Return EFAULT so as to panic instead of
+		 * getting into an infinite faulting loop.
+		 */
+		return EFAULT;
+	}
+
+	if (curproc->p_killed) {
+		/* Don't use memory; fail, and exit on the way out. */
+		return EFAULT;
+	}
+
+	as = proc_getas();
+	if (as == NULL) {
+		/*
+		 * No address space set up. This is probably also a
+		 * kernel fault early in boot.
+		 */
+		return EFAULT;
+	}
+
+	timed = vm_faulthist_on;
+	if (timed) {
+		gettime(&before);
+	}
+
+	vr = as_findregion(as, faultaddress);
+	if (vr == NULL) {
+		vr = as_growstack(as, faultaddress);
+		if (vr == NULL) {
+			return EFAULT;
+		}
+		spinlock_acquire(&vmstats_lock);
+		vmstats_stackgrowths++;
+		spinlock_release(&vmstats_lock);
+	}
+	if (faulttype == VM_FAULT_READ) {
+		/* Instruction fetches show up as reads. */
+		if ((vr->vr_perm & (VR_READ | VR_EXEC)) == 0) {
+			return EFAULT;
+		}
+	}
+	else if ((vr->vr_perm & VR_WRITE) == 0) {
+		return EFAULT;
+	}
+
+	pte = pt_lookup(as->as_pt, faultaddress, true);
+	if (pte == NULL) {
+		return ENOMEM;
+	}
+
+	zerofilled = fileread = filemapped = pagedin = false;
+	resident = cowbroke = false;
+	if (coremap_pin(pte)) {
+		/* Resident. */
+		resident = true;
+		pa = *pte & PTE_FRAME;
+		if (faulttype != VM_FAULT_READ &&
+		    (vr->vr_flags & VRF_SHARED) == 0) {
+			/* Writing; break copy-on-write sharing if needed. */
+			result = vm_unshare(as, faultaddress, pte);
+			if (result) {
+				coremap_unpin(pa);
+				return result;
+			}
+			cowbroke = (*pte & PTE_FRAME) != pa;
+			pa = *pte & PTE_FRAME;
+		}
+	}
+	else if (*pte & PTE_SWAP) {
+		/* Paged out; read it back. */
+		slot = PTE_SWAPSLOT(*pte);
+		pa = vm_getppages(1);
+		if (pa == 0) {
+			return ENOMEM;
+		}
+		coremap_setuser(pa, as, faultaddress);
+		result = swap_pagein(slot, pa);
+		if (result) {
+			coremap_decref(pa);
+			return result;
+		}
+		*pte = pa | PTE_VALID;
+		swap_decref(slot);
+		pagedin = true;
+	}
+	else if (vm_filespan(vr, faultaddress, &start, &end)) {
+		/* First touch of a page with file data in it. */
+		result = vm_filepage(as, vr, faultaddress, start, end, pte,
+				     &pa, &fileread);
+		if (result) {
+			return result;
+		}
+		filemapped = !fileread;
+	}
+	else {
+		/* First touch: materialize a zero-filled page. */
+		pa = vm_getzeroedpage();
+		if (pa == 0) {
+			return ENOMEM;
+		}
+		coremap_setuser(pa, as, faultaddress);
+		*pte = pa | PTE_VALID;
+		zerofilled = true;
+	}
+	if (!resident) {
+		as_addresident(as, 1);
+	}
+
+	/*
+	 * Shared frames are mapped read-only until someone writes. A
+	 * frame we have to ourselves may have been shared before, so
+	 * make sure the clock knows it's ours now. Frames in read-only
+	 * regions are always mapped read-only.
+	 *
+	 * MAP_SHARED frames are written in place instead, and are also
+	 * mapped read-only until written so we can tell they're dirty.
+	 * They have no owner, so the clock never evicts them behind the
+	 * file's back.
+	 */
+	owned = coremap_refcount(pa) == 1;
+	if (vr->vr_flags & VRF_SHARED) {
+		if (owned) {
+			coremap_setuser(pa, NULL, 0);
+		}
+		coremap_marknomerge(pa);
+		writeable = (vr->vr_perm & VR_WRITE) &&
+			faulttype != VM_FAULT_READ;
+		if (writeable) {
+			coremap_setdirty(pa, true);
+		}
+	}
+	else {
+		if (owned) {
+			coremap_setuser(pa, as, faultaddress);
+		}
+		writeable = owned && (vr->vr_perm & VR_WRITE);
+	}
+	vm_tlbload(faultaddress, pa, writeable);
+	coremap_unpin(pa);
+
+	around = vm_faultaround_load(as, vr, faultaddress);
+
+	spinlock_acquire(&curproc->p_lock);
+	if (fileread || pagedin) {
+		curproc->p_vmstats.pvs_majfaults++;
+	}
+	else {
+		curproc->p_vmstats.pvs_minfaults++;
+	}
+	if (cowbroke) {
+		curproc->p_vmstats.pvs_cowbreaks++;
+	}
+	else if (resident) {
+		curproc->p_vmstats.pvs_tlbrefills++;
+	}
+	if (pagedin) {
+		curproc->p_vmstats.pvs_swapins++;
+	}
+	spinlock_release(&curproc->p_lock);
+
+	bucket = 0;
+	if (timed) {
+		gettime(&after);
+		timespec_sub(&after, &before, &delta);
+		us = delta.tv_sec * 1000000ULL + delta.tv_nsec / 1000;
+		for (; us > 0 && bucket < VM_FAULTHIST_BUCKETS - 1; bucket++) {
+			us >>= 1;
+		}
+	}
+
+	spinlock_acquire(&vmstats_lock);
+	if (timed && vm_faulthist_on) {
+		vm_faulthist[bucket]++;
+	}
+	vmstats_faults++;
+	vmstats_aroundloads += around;
+	if (zerofilled) {
+		vmstats_zerofills++;
+	}
+	if (fileread) {
+		vmstats_filereads++;
+	}
+	if (filemapped) {
+		vmstats_filehits++;
+	}
+	if (pagedin) {
+		vmstats_pageins++;
+	}
+	vmstats_tlbloads++;
+	spinlock_release(&vmstats_lock);
+
+	return 0;
+}
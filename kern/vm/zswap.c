@@ -0,0 +1,522 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Compressed swap pool. See zswap.h.
+ *
+ * Compressed pages are kept in kmalloc'd buffers of their compressed
+ * size, so very compressible pages (zero padding, say) cost only a few
+ * bytes each. The pool is limited by the total of those sizes, and
+ * the number of pages it can hold is limited by the entry table.
+ *
+ * The codec is a simplified LZ4. The output is a series of sequences,
+ * each one a token byte, some literal bytes, and a match:
+ *
+ *    token           high nibble: literal count; low nibble: match
+ *                    length minus ZSWAP_MINMATCH. 15 means more
+ *                    length bytes follow (see below).
+ *    [length bytes]  extra literal count: bytes added up until one
+ *                    is less than 255
+ *    literals
+ *    offset          2 bytes, little-endian: how far back the match is
+ *    [length bytes]  extra match length, likewise
+ *
+ * The last sequence has literals only and ends the data. Matches are
+ * found through a hash table of 4-byte prefixes, one candidate per
+ * bucket, which is fast and does well on the repetitive pages this
+ * is for.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <bitmap.h>
+#include <vm.h>
+#include <coremap.h>
+#include <swap.h>
+#include <zswap.h>
+
+/* Pool size limit, as a fraction of physical memory */
+#define ZSWAP_FRACTION	4
+
+/* Entries per page of physical memory */
+#define ZSWAP_ENTRIES	2
+
+/* Pages that don't compress to this size or less go to disk */
+#define ZSWAP_MAXCSIZE	(PAGE_SIZE / 2)
+
+/* Codec parameters */
+#define ZSWAP_MINMATCH	4
+#define ZSWAP_HASHBITS	10
+#define ZSWAP_HASHSIZE	(1 << ZSWAP_HASHBITS)
+
+struct zentry {
+	void *ze_data;		/* compressed page */
+	uint16_t ze_size;	/* its size */
+	uint16_t ze_refcount;
+};
+
+/*
+ * zswap_lock protects the entry table, the bitmap, and the
+ * statistics. zswap_complock serializes use of the compressor's
+ * static buffers.
+ */
+static struct spinlock zswap_lock = SPINLOCK_INITIALIZER;
+static struct lock *zswap_complock;
+static struct zentry *zswap_entries;	/* NULL if no pool */
+static struct bitmap *zswap_map;	/* which entries are in use */
+static unsigned zswap_nentries;
+static unsigned zswap_maxbytes;		/* cap on compressed bytes */
+static unsigned zswap_bytes;		/* compressed bytes held */
+static unsigned zswap_npages;		/* pages held */
+
+/* Compressor state, protected by zswap_complock */
+static uint16_t zswap_hash[ZSWAP_HASHSIZE];	/* position + 1, or 0 */
+static uint8_t zswap_buf[ZSWAP_MAXCSIZE];
+
+/* Statistics */
+static unsigned zswap_stores;		/* pages taken */
+static unsigned zswap_rejects;		/* didn't compress enough */
+static unsigned zswap_spills;		/* pool was full */
+static unsigned zswap_loads;		/* pages given back */
+static unsigned zswap_maxpages;		/* high-water mark */
+
+////////////////////////////////////////////////////////////
+//
+// Codec
+
+static
+unsigned
+lz_hash(const uint8_t *p)
+{
+	uint32_t v;
+
+	v = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+	return (v * 2654435761U) >> (32 - ZSWAP_HASHBITS);
+}
+
+/*
+ * Append the part of a length past 15 to DST at *OP. Returns false
+ * if it doesn't fit in MAX bytes.
+ */
+static
+bool
+lz_putlen(uint8_t *dst, size_t *op, size_t max, size_t len)
+{
+	for (;;) {
+		if (*op >= max) {
+			return false;
+		}
+		if (len < 255) {
+			dst[(*op)++] = len;
+			return true;
+		}
+		dst[(*op)++] = 255;
+		len -= 255;
+	}
+}
+
+/*
+ * Append one sequence: NLIT literals from LIT, then (if MLEN isn't 0)
+ * a match of MLEN bytes OFFSET back. Returns false if it doesn't fit.
+ */
+static
+bool
+lz_putseq(uint8_t *dst, size_t *op, size_t max, const uint8_t *lit,
+	  size_t nlit, size_t offset, size_t mlen)
+{
+	size_t tokenpos;
+	uint8_t token;
+
+	if (*op >= max) {
+		return false;
+	}
+	tokenpos = (*op)++;
+	token = (nlit < 15 ? nlit : 15) << 4;
+	if (nlit >= 15 && !lz_putlen(dst, op, max, nlit - 15)) {
+		return false;
+	}
+	if (*op + nlit > max) {
+		return false;
+	}
+	memcpy(dst + *op, lit, nlit);
+	*op += nlit;
+
+	if (mlen > 0) {
+		KASSERT(mlen >= ZSWAP_MINMATCH);
+		KASSERT(offset > 0 && offset <= 0xffff);
+		if (*op + 2 > max) {
+			return false;
+		}
+		dst[(*op)++] = offset & 0xff;
+		dst[(*op)++] = offset >> 8;
+		mlen -= ZSWAP_MINMATCH;
+		token |= mlen < 15 ? mlen : 15;
+		if (mlen >= 15 && !lz_putlen(dst, op, max, mlen - 15)) {
+			return false;
+		}
+	}
+	dst[tokenpos] = token;
+	return true;
+}
+
+/*
+ * Compress N bytes (at most 65535) from SRC into DST. Returns the
+ * compressed size, or 0 if it would be more than MAX bytes.
+ */
+static
+size_t
+lz_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t max)
+{
+	size_t ip, anchor, op, ref, mlen;
+	unsigned h;
+
+	KASSERT(n <= 0xffff);
+
+	for (h=0; h<ZSWAP_HASHSIZE; h++) {
+		zswap_hash[h] = 0;
+	}
+
+	ip = anchor = op = 0;
+	while (ip + ZSWAP_MINMATCH <= n) {
+		h = lz_hash(src + ip);
+		ref = zswap_hash[h];
+		zswap_hash[h] = ip + 1;
+		if (ref == 0) {
+			ip++;
+			continue;
+		}
+		ref--;
+		for (mlen = 0; ip + mlen < n; mlen++) {
+			if (src[ref + mlen] != src[ip + mlen]) {
+				break;
+			}
+		}
+		if (mlen < ZSWAP_MINMATCH) {
+			/* Hash collision. */
+			ip++;
+			continue;
+		}
+		if (!lz_putseq(dst, &op, max, src + anchor, ip - anchor,
+			       ip - ref, mlen)) {
+			return 0;
+		}
+		ip += mlen;
+		anchor = ip;
+	}
+	if (!lz_putseq(dst, &op, max, src + anchor, n - anchor, 0, 0)) {
+		return 0;
+	}
+	return op;
+}
+
+/*
+ * Read the rest of a length that was 15 in the token.
+ */
+static
+bool
+lz_getlen(const uint8_t *src, size_t *ip, size_t len, size_t *ret)
+{
+	uint8_t b;
+
+	do {
+		if (*ip >= len) {
+			return false;
+		}
+		b = src[(*ip)++];
+		*ret += b;
+	} while (b == 255);
+	return true;
+}
+
+/*
+ * Decompress LEN bytes from SRC into exactly N bytes at DST.
+ */
+static
+int
+lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t n)
+{
+	size_t ip, op, nlit, mlen, offset;
+	uint8_t token;
+
+	ip = op = 0;
+	while (ip < len) {
+		token = src[ip++];
+
+		nlit = token >> 4;
+		if (nlit == 15 && !lz_getlen(src, &ip, len, &nlit)) {
+			return EIO;
+		}
+		if (ip + nlit > len || op + nlit > n) {
+			return EIO;
+		}
+		memcpy(dst + op, src + ip, nlit);
+		ip += nlit;
+		op += nlit;
+		if (ip == len) {
+			/* Last sequence. */
+			break;
+		}
+
+		if (ip + 2 > len) {
+			return EIO;
+		}
+		offset = src[ip] | (src[ip + 1] << 8);
+		ip += 2;
+		mlen = token & 15;
+		if (mlen == 15 && !lz_getlen(src, &ip, len, &mlen)) {
+			return EIO;
+		}
+		mlen += ZSWAP_MINMATCH;
+		if (offset == 0 || offset > op || op + mlen > n) {
+			return EIO;
+		}
+		/* Byte at a time: the match may overlap what it makes. */
+		for (; mlen > 0; mlen--, op++) {
+			dst[op] = dst[op - offset];
+		}
+	}
+	return op == n ? 0 : EIO;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Pool
+
+void
+zswap_bootstrap(void)
+{
+	unsigned i, npages;
+
+	npages = coremap_totalpages();
+	zswap_maxbytes = npages / ZSWAP_FRACTION * PAGE_SIZE;
+	zswap_nentries = npages * ZSWAP_ENTRIES;
+	/* swap.c marks our handles with SWAP_ZSLOT. */
+	if (zswap_nentries > SWAP_ZSLOT) {
+		zswap_nentries = SWAP_ZSLOT;
+	}
+
+	zswap_complock = lock_create("zswap");
+	zswap_map = bitmap_create(zswap_nentries);
+	zswap_entries = kmalloc(zswap_nentries * sizeof(zswap_entries[0]));
+	if (zswap_complock == NULL || zswap_map == NULL ||
+	    zswap_entries == NULL) {
+		panic("zswap: Out of memory\n");
+	}
+	for (i=0; i<zswap_nentries; i++) {
+		zswap_entries[i].ze_data = NULL;
+		zswap_entries[i].ze_size = 0;
+		zswap_entries[i].ze_refcount = 0;
+	}
+
+	kprintf("zswap: up to %u pages in %u KB\n",
+		zswap_nentries, zswap_maxbytes / 1024);
+}
+
+int
+zswap_store(paddr_t pa, unsigned *handle)
+{
+	struct zentry *ze;
+	size_t csize;
+	void *data;
+	int result;
+
+	KASSERT((pa & PAGE_FRAME) == pa);
+
+	lock_acquire(zswap_complock);
+	csize = lz_compress((const uint8_t *)PADDR_TO_KVADDR(pa), PAGE_SIZE,
+			    zswap_buf, sizeof(zswap_buf));
+	if (csize == 0) {
+		lock_release(zswap_complock);
+		spinlock_acquire(&zswap_lock);
+		zswap_rejects++;
+		spinlock_release(&zswap_lock);
+		return ENOSPC;
+	}
+
+	/* Reserve the space, then allocate it. */
+	spinlock_acquire(&zswap_lock);
+	if (zswap_bytes + csize > zswap_maxbytes) {
+		zswap_spills++;
+		spinlock_release(&zswap_lock);
+		lock_release(zswap_complock);
+		return ENOSPC;
+	}
+	zswap_bytes += csize;
+	spinlock_release(&zswap_lock);
+
+	data = kmalloc(csize);
+	if (data != NULL) {
+		memcpy(data, zswap_buf, csize);
+	}
+	lock_release(zswap_complock);
+
+	spinlock_acquire(&zswap_lock);
+	result = data == NULL ? ENOMEM : bitmap_alloc(zswap_map, handle);
+	if (result) {
+		zswap_bytes -= csize;
+		zswap_spills++;
+		spinlock_release(&zswap_lock);
+		kfree(data);
+		return ENOSPC;
+	}
+	ze = &zswap_entries[*handle];
+	KASSERT(ze->ze_refcount == 0);
+	ze->ze_data = data;
+	ze->ze_size = csize;
+	ze->ze_refcount = 1;
+	zswap_npages++;
+	if (zswap_npages > zswap_maxpages) {
+		zswap_maxpages = zswap_npages;
+	}
+	zswap_stores++;
+	spinlock_release(&zswap_lock);
+	return 0;
+}
+
+/*
+ * The caller holds a reference, so the entry can't go away, and its
+ * data never changes; no need to hold the lock while decompressing.
+ */
+void
+zswap_load(unsigned handle, paddr_t pa)
+{
+	struct zentry *ze;
+	int result;
+
+	KASSERT(handle < zswap_nentries);
+	KASSERT((pa & PAGE_FRAME) == pa);
+
+	ze = &zswap_entries[handle];
+	KASSERT(ze->ze_refcount > 0);
+	result = lz_decompress(ze->ze_data, ze->ze_size,
+			       (uint8_t *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
+	if (result) {
+		panic("zswap: entry %u is corrupt\n", handle);
+	}
+
+	spinlock_acquire(&zswap_lock);
+	zswap_loads++;
+	spinlock_release(&zswap_lock);
+}
+
+void
+zswap_incref(unsigned handle)
+{
+	KASSERT(handle < zswap_nentries);
+
+	spinlock_acquire(&zswap_lock);
+	KASSERT(zswap_entries[handle].ze_refcount > 0);
+	if (zswap_entries[handle].ze_refcount == 0xffff) {
+		panic("zswap_incref: too many references to %u\n", handle);
+	}
+	zswap_entries[handle].ze_refcount++;
+	spinlock_release(&zswap_lock);
+}
+
+void
+zswap_decref(unsigned handle)
+{
+	struct zentry *ze;
+	void *data;
+
+	KASSERT(handle < zswap_nentries);
+	ze = &zswap_entries[handle];
+
+	data = NULL;
+	spinlock_acquire(&zswap_lock);
+	KASSERT(ze->ze_refcount > 0);
+	ze->ze_refcount--;
+	if (ze->ze_refcount == 0) {
+		data = ze->ze_data;
+		KASSERT(zswap_bytes >= ze->ze_size);
+		zswap_bytes -= ze->ze_size;
+		zswap_npages--;
+		ze->ze_data = NULL;
+		ze->ze_size = 0;
+		bitmap_unmark(zswap_map, handle);
+	}
+	spinlock_release(&zswap_lock);
+
+	if (data != NULL) {
+		kfree(data);
+	}
+}
+
+/*
+ * Out of entries or bytes? Only a hint.
+ */
+bool
+zswap_full(void)
+{
+	bool ret;
+
+	if (zswap_entries == NULL) {
+		return true;
+	}
+	spinlock_acquire(&zswap_lock);
+	ret = zswap_npages >= zswap_nentries ||
+		zswap_bytes >= zswap_maxbytes;
+	spinlock_release(&zswap_lock);
+	return ret;
+}
+
+void
+zswap_printstats(void)
+{
+	unsigned npages, bytes, maxpages, stores, rejects, spills, loads;
+	unsigned long ratio;
+
+	if (zswap_entries == NULL) {
+		kprintf("zswap: none\n");
+		return;
+	}
+
+	spinlock_acquire(&zswap_lock);
+	npages = zswap_npages;
+	bytes = zswap_bytes;
+	maxpages = zswap_maxpages;
+	stores = zswap_stores;
+	rejects = zswap_rejects;
+	spills = zswap_spills;
+	loads = zswap_loads;
+	spinlock_release(&zswap_lock);
+
+	/* Compression ratio, times 100. */
+	ratio = bytes ? (unsigned long)npages * PAGE_SIZE * 100 / bytes : 0;
+
+	kprintf("zswap: %u pages (max %u) in %u of %u bytes, "
+		"ratio %lu.%02lu:1\n", npages, maxpages, bytes,
+		zswap_maxbytes, ratio / 100, ratio % 100);
+	kprintf("zswap: %u stored, %u loaded, %u incompressible, "
+		"%u spilled to disk\n", stores, loads, rejects, spills);
+}